@@ -1,5 +1,9 @@
 #include "APU.h"
 
+#include <algorithm>
+
+#include "HostProfiler.h"
+
 void APU::Fifo::Clear()
 {
     data.fill(0);
@@ -31,7 +35,8 @@ bool APU::Fifo::Pop(int8_t& outSample)
 }
 
 APU::APU(std::array<uint8_t, 1024>& ioRegisters)
-    : ioRegisters(ioRegisters)
+    : psg(ioRegisters, CYCLES_PER_OUTPUT_SAMPLE)
+    , ioRegisters(ioRegisters)
 {
     Reset();
 }
@@ -43,11 +48,42 @@ void APU::Reset()
     latchedSampleA = 0;
     latchedSampleB = 0;
 
-    frameRing.fill(0);
-    frameReadIndex = 0;
-    frameWriteIndex = 0;
-    frameCount = 0;
+    //the ring is left alone, only its consumer can empty it safely (DiscardSamples)
     sampleClock = 0;
+    lastSync = 0;
+    psg.Reset();
+}
+
+void APU::WriteState(SaveState& state) const
+{
+    state.BeginSection("APU");
+    state.Write(fifoA);
+    state.Write(fifoB);
+    state.Write(latchedSampleA);
+    state.Write(latchedSampleB);
+    state.Write(sampleClock);
+    state.Write(lastSync);
+    psg.WriteState(state);
+}
+
+void APU::ReadState(SaveState& state)
+{
+    //the indices go straight into the fifo's array, and a sample clock past the end of a sample would have
+    //Sync generate billions of frames
+    auto isValidFifo = [](const Fifo& fifo) {
+        return fifo.readIndex < FIFO_DEPTH && fifo.writeIndex < FIFO_DEPTH && fifo.count <= FIFO_DEPTH
+            && (fifo.readIndex + fifo.count) % FIFO_DEPTH == fifo.writeIndex;
+    };
+    state.ReadChecked(fifoA, isValidFifo);
+    state.ReadChecked(fifoB, isValidFifo);
+    state.Read(latchedSampleA);
+    state.Read(latchedSampleB);
+    state.ReadChecked(sampleClock, [](uint32_t clock) { return clock < CYCLES_PER_OUTPUT_SAMPLE; });
+    state.Read(lastSync);
+    psg.ReadState(state);
+
+    //the output ring isn't part of the state, how much was queued only says how far ahead the host happened
+    //to be. whoever restores empties it with DiscardSamples, only the consumer can
 }
 
 bool APU::IsFifoOffset(uint32_t offset)
@@ -60,6 +96,11 @@ uint16_t APU::ReadSoundCntH() const
     return static_cast<uint16_t>(ioRegisters[0x082] | (ioRegisters[0x083] << 8));
 }
 
+uint16_t APU::ReadSoundBias() const
+{
+    return static_cast<uint16_t>(ioRegisters[0x088] | (ioRegisters[0x089] << 8));
+}
+
 bool APU::MasterEnabled() const
 {
     return (ioRegisters[0x084] & 0x80) != 0;
@@ -75,6 +116,59 @@ void APU::WriteFifo(uint32_t offset, uint8_t value)
         fifoB.Push(sample);
 }
 
+void APU::WriteRegister(uint32_t offset, uint8_t value, uint64_t now)
+{
+    Sync(now);
+
+    if (PSG::IsPsgOffset(offset))
+    {
+        psg.WriteRegister(offset, value, sampleClock);
+        return;
+    }
+
+    //everything past here changes the mix, so the psg has to be caught up under the old settings first
+    psg.RunUntil(sampleClock);
+
+    //SOUNDCNT_X bits 0 to 3 are channel status, only the master enable is writable
+    if (offset == 0x084)
+    {
+        bool wasEnabled = MasterEnabled();
+        ioRegisters[0x084] = static_cast<uint8_t>((ioRegisters[0x084] & 0x0F) | (value & ~0x0F));
+        OnSoundCntXWrite();
+        if (wasEnabled && !MasterEnabled())
+            psg.PowerOff();
+        else
+            psg.OnMixerWrite();
+        return;
+    }
+
+    ioRegisters[offset] = value;
+
+    if (offset == 0x082)
+        psg.OnMixerWrite();
+    else if (offset == 0x083)
+        OnSoundCntHWrite();
+}
+
+uint8_t APU::ReadRegister(uint32_t offset) const
+{
+    if (PSG::IsPsgOffset(offset))
+        return psg.ReadRegister(offset);
+
+    switch (offset)
+    {
+        //SOUNDCNT_H, the fifo reset bits always read 0
+        case 0x082: return static_cast<uint8_t>(ioRegisters[0x082] & 0x0F);
+        case 0x083: return static_cast<uint8_t>(ioRegisters[0x083] & 0x77);
+        //SOUNDCNT_X, master enable and the channel status bits
+        case 0x084: return static_cast<uint8_t>(ioRegisters[0x084] & 0x8F);
+        //SOUNDBIAS
+        case 0x088: return ioRegisters[0x088];
+        case 0x089: return static_cast<uint8_t>(ioRegisters[0x089] & 0xC3);
+        default: return 0;
+    }
+}
+
 void APU::OnSoundCntHWrite()
 {
     uint16_t control = ReadSoundCntH();
@@ -129,10 +223,12 @@ static int32_t Clamp16(int32_t value)
     return value;
 }
 
-void APU::GenerateFrame()
+void APU::GenerateFrame(int16_t* frame)
 {
-    int32_t left = 0;
-    int32_t right = 0;
+    //everything here is in the 10-bit dac's units times 64, which puts the default bias range on int16's
+    int32_t left;
+    int32_t right;
+    psg.EndSample(left, right);
 
     if (MasterEnabled())
     {
@@ -145,60 +241,71 @@ void APU::GenerateFrame()
         if (!(control & 0x0004)) a >>= 1;
         if (!(control & 0x0008)) b >>= 1;
 
-        if (control & 0x0200) left += a;
-        if (control & 0x0100) right += a;
-        if (control & 0x2000) left += b;
-        if (control & 0x1000) right += b;
+        //a fifo sample counts double on the 10-bit scale
+        if (control & 0x0200) left += a * 128;
+        if (control & 0x0100) right += a * 128;
+        if (control & 0x2000) left += b * 128;
+        if (control & 0x1000) right += b * 128;
     }
 
-    //clamp to +-256
-    left = Clamp16(left * 128);
-    right = Clamp16(right * 128);
+    //the hardware adds SOUNDBIAS and clips to 10 bits, taking the bias back off afterwards keeps it centred
+    int32_t bias = (ReadSoundBias() & 0x3FE) * 64;
+    left = Clamp16(std::max(0, std::min(left + bias, 0x3FF * 64)) - bias);
+    right = Clamp16(std::max(0, std::min(right + bias, 0x3FF * 64)) - bias);
+
+    frame[0] = static_cast<int16_t>(left);
+    frame[1] = static_cast<int16_t>(right);
+}
+
+void APU::Sync(uint64_t now)
+{
+    if (now <= lastSync)
+        return;
 
-    if (frameCount >= FRAME_RING_CAPACITY)
+    uint64_t elapsed = now - lastSync;
+    lastSync = now;
+
+    //still inside the same sample, the psg catches up on its own when something changes
+    if (sampleClock + elapsed < CYCLES_PER_OUTPUT_SAMPLE)
     {
+        sampleClock += static_cast<uint32_t>(elapsed);
         return;
     }
 
-    frameRing[frameWriteIndex * 2] = static_cast<int16_t>(left);
-    frameRing[frameWriteIndex * 2 + 1] = static_cast<int16_t>(right);
-    frameWriteIndex = (frameWriteIndex + 1) % FRAME_RING_CAPACITY;
-    frameCount++;
-}
+    PROFILE_SCOPE(ZONE_APU);
 
-size_t APU::ReadSamples(int16_t* destination, size_t maxFrames)
-{
-    size_t taken = 0;
+    elapsed -= CYCLES_PER_OUTPUT_SAMPLE - sampleClock;
+    uint64_t remaining = 1 + elapsed / CYCLES_PER_OUTPUT_SAMPLE;
+    sampleClock = static_cast<uint32_t>(elapsed % CYCLES_PER_OUTPUT_SAMPLE);
 
-    while (taken < maxFrames && frameCount > 0)
+    //a full ring drops frames, the ring counts them
+    static constexpr size_t BATCH_FRAMES = 256;
+    int16_t batch[BATCH_FRAMES * 2];
+    while (remaining > 0)
     {
-        destination[taken * 2] = frameRing[frameReadIndex * 2];
-        destination[taken * 2 + 1] = frameRing[frameReadIndex * 2 + 1];
-        frameReadIndex = (frameReadIndex + 1) % FRAME_RING_CAPACITY;
-        frameCount--;
-        taken++;
+        size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, BATCH_FRAMES));
+        for (size_t i = 0; i < count; i++)
+            GenerateFrame(&batch[i * 2]);
+
+        outputRing.Write(batch, count);
+        if (capture)
+            capture->Write(batch, count);
+        remaining -= count;
     }
-
-    return taken;
 }
 
-APU::RefillRequest APU::Tick(uint8_t overflowMask)
+APU::RefillRequest APU::OnTimerOverflow(uint8_t overflowMask, uint64_t now)
 {
     RefillRequest request;
+    if (!(overflowMask & 0x3) || !MasterEnabled())
+        return request;
 
-    if (overflowMask != 0 && MasterEnabled())
-    {
-        uint16_t control = ReadSoundCntH();
+    //the samples up to here still hear the old latched values
+    Sync(now);
 
-        request.fifoA = ServiceFifo(fifoA, latchedSampleA, overflowMask, (control & 0x0400) != 0);
-        request.fifoB = ServiceFifo(fifoB, latchedSampleB, overflowMask, (control & 0x4000) != 0);
-    }
-
-    if (++sampleClock >= CYCLES_PER_OUTPUT_SAMPLE)
-    {
-        sampleClock = 0;
-        GenerateFrame();
-    }
+    uint16_t control = ReadSoundCntH();
+    request.fifoA = ServiceFifo(fifoA, latchedSampleA, overflowMask, (control & 0x0400) != 0);
+    request.fifoB = ServiceFifo(fifoB, latchedSampleB, overflowMask, (control & 0x4000) != 0);
 
     return request;
 }
@@ -2,6 +2,11 @@
 #include <array>
 #include <cstdint>
 
+#include "AudioCapture.h"
+#include "AudioRing.h"
+#include "PSG.h"
+#include "SaveState.h"
+
 class APU
 {
 public:
@@ -9,6 +14,11 @@ public:
 
     void Reset();
 
+    //the fifos, the psg and whatever output hasn't been played yet. the read appends that output to the ring,
+    //so whoever drains the ring should discard it first
+    void WriteState(SaveState& state) const;
+    void ReadState(SaveState& state);
+
     //sounds fifos
     static constexpr uint32_t FIFO_A_OFFSET = 0x0A0;
     static constexpr uint32_t FIFO_B_OFFSET = 0x0A4;
@@ -18,6 +28,11 @@ public:
 
     void WriteFifo(uint32_t offset, uint8_t value);
 
+    //psg channels, mixer, bias and wave ram, everything from 0x060 up to the fifos
+    static bool IsSoundRegister(uint32_t offset) { return offset >= 0x060 && offset < FIFO_A_OFFSET; }
+    void WriteRegister(uint32_t offset, uint8_t value, uint64_t now);
+    uint8_t ReadRegister(uint32_t offset) const;
+
     static constexpr uint32_t OUTPUT_SAMPLE_RATE = 32768;
     static constexpr uint32_t CYCLES_PER_OUTPUT_SAMPLE = 512;
 
@@ -26,14 +41,27 @@ public:
         bool fifoA = false;
         bool fifoB = false;
     };
-    
-    RefillRequest Tick(uint8_t overflowMask);
 
-    size_t ReadSamples(int16_t* destination, size_t maxFrames);
-    size_t GetQueuedFrames() const { return frameCount; }
+    //nothing runs per cycle. now is the bus's cycle count (cycles fully ticked so far), and every output
+    //sample between the last call and now gets made in one go. anything that changes what comes out
+    //(a fifo pop, a sound register write) syncs first, and the frame loop syncs once at the end
+    void Sync(uint64_t now);
 
-    void OnSoundCntHWrite();
-    void OnSoundCntXWrite();
+    //timer 0 or 1 overflowed during cycle now
+    RefillRequest OnTimerOverflow(uint8_t overflowMask, uint64_t now);
+
+    //the emulation thread produces, exactly one other thread (the audio callback) drains, neither needs the bus lock.
+    //two seconds at 1x, fast forward drains it up to eight times faster and still needs a quarter second of slack
+    static constexpr size_t FRAME_RING_CAPACITY = 65536;
+    typedef AudioRing<FRAME_RING_CAPACITY> OutputRing;
+
+    size_t ReadSamples(int16_t* destination, size_t maxFrames) { return outputRing.Read(destination, maxFrames); }
+    void DiscardSamples() { outputRing.Discard(); }
+    size_t GetQueuedFrames() const { return outputRing.Available(); }
+    const OutputRing& GetOutputRing() const { return outputRing; }
+
+    //gets every frame Sync makes, full ring or not. null turns it off
+    void SetCapture(AudioCapture* capture) { this->capture = capture; }
 
     int8_t GetLatchedSampleA() const { return latchedSampleA; }
     int8_t GetLatchedSampleB() const { return latchedSampleB; }
@@ -62,16 +90,21 @@ private:
 
     bool ServiceFifo(Fifo& fifo, int8_t& latchedSample, uint8_t overflowMask, bool useTimer1);
 
-    static constexpr size_t FRAME_RING_CAPACITY = 8192;
-    std::array<int16_t, FRAME_RING_CAPACITY * 2> frameRing{};
-    size_t frameReadIndex = 0;
-    size_t frameWriteIndex = 0;
-    size_t frameCount = 0;
+    OutputRing outputRing;
+    AudioCapture* capture = nullptr;
 
+    //cycles into the current output sample, and the bus cycle Sync last got to
     uint32_t sampleClock = 0;
-    void GenerateFrame();
+    uint64_t lastSync = 0;
+    void GenerateFrame(int16_t* frame);
+
+    PSG psg;
+
+    void OnSoundCntHWrite();
+    void OnSoundCntXWrite();
 
     uint16_t ReadSoundCntH() const;
+    uint16_t ReadSoundBias() const;
     bool MasterEnabled() const;
 
     std::array<uint8_t, 1024>& ioRegisters;
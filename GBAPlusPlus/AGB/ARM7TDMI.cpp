@@ -4,6 +4,7 @@
 #include <string>
 #include <Windows.h>
 #include "Disassembler.h"
+#include "HostProfiler.h"
 
 ARM7TDMI::ARM7TDMI(MemoryBus* memoryBus, ARMRegisters* registers)
 {
@@ -134,6 +135,37 @@ uint64_t ARM7TDMI::GetTotalCycles() const
     return totalCycles;
 }
 
+void ARM7TDMI::WriteState(SaveState& state) const
+{
+    state.BeginSection("CPU");
+    state.Write(*registers);
+    state.Write(totalCycles);
+    state.Write(FetchedInstruction);
+    state.Write(DecodingInstruction);
+    state.Write(ExecutingInstruction);
+    state.Write(ThumbDecodingInstruction);
+    state.Write(ThumbExecutingInstruction);
+    state.Write(isFlushed);
+}
+
+void ARM7TDMI::ReadState(SaveState& state)
+{
+    state.Read(*registers);
+    state.Read(totalCycles);
+    state.Read(FetchedInstruction);
+    state.Read(DecodingInstruction);
+    state.Read(ExecutingInstruction);
+    state.Read(ThumbDecodingInstruction);
+    state.Read(ThumbExecutingInstruction);
+    state.Read(isFlushed);
+
+    if (state.IsChecking())
+        return;
+
+    //a trace that was running carries on from here, the next line shouldn't be diffed against the old state
+    traceHasPrevious = false;
+}
+
 bool ARM7TDMI::EnableTracing(const std::string& filePath, size_t maxLines)
 {
     auto file = std::make_unique<std::ofstream>(filePath, std::ios::out | std::ios::trunc);
@@ -619,6 +651,8 @@ void ARM7TDMI::EnterException(CPUMode mode, uint32_t vectorAddress, uint32_t ret
 
 void ARM7TDMI::EnterInterrupt()
 {
+    TRACE_INSTANT("IRQ");
+
     uint32_t pc = *registers->GetRegister(PROGRAM_COUNTER);
     bool wasThumb = registers->GetProgramStatusRegister().GetThumbState();
     //LR needs nextInstr+4, arm's pipelined PC is 4 short of that, thumb's isn't
@@ -6,6 +6,7 @@
 
 #include "ARMRegisters.h"
 #include "MemoryBus.h"
+#include "SaveState.h"
 
 enum ConditionCode : uint8_t
 {
@@ -39,6 +40,10 @@ public:
     //cycles so far
     uint64_t GetTotalCycles() const;
 
+    //registers, the pipeline and the cycle count
+    void WriteState(SaveState& state) const;
+    void ReadState(SaveState& state);
+
     //logs one line per instruction, for diffing against a reference trace
     bool EnableTracing(const std::string& filePath, size_t maxLines = 10000000);
     void DisableTracing();
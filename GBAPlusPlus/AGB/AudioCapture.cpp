@@ -0,0 +1,239 @@
+#include "AudioCapture.h"
+
+#include <cctype>
+#include <cstdio>
+
+#include "HostProfiler.h"
+#include "TraceRecorder.h"
+
+namespace
+{
+    const uint64_t FNV_OFFSET = 0xCBF29CE484222325ull;
+    const uint64_t FNV_PRIME = 0x100000001B3ull;
+
+    void PutLE(std::ofstream& file, uint32_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++)
+            file.put(static_cast<char>((value >> (i * 8)) & 0xFF));
+    }
+}
+
+AudioCapture::~AudioCapture()
+{
+    Stop();
+}
+
+AudioCapture::Format AudioCapture::FormatForPath(const std::string& path)
+{
+    if (path.size() >= 4)
+    {
+        std::string extension = path.substr(path.size() - 4);
+        for (char& c : extension)
+            c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        if (extension == ".wav")
+            return Format::Wav;
+    }
+    return Format::Raw;
+}
+
+bool AudioCapture::Start(const std::string& path, Format format, uint32_t sampleRate, const std::string& hashPath)
+{
+    Stop();
+
+    audioFile.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!audioFile.is_open())
+        return false;
+
+    hashing = !hashPath.empty();
+    if (hashing)
+    {
+        hashFile.open(hashPath, std::ios::out | std::ios::trunc);
+        if (!hashFile.is_open())
+        {
+            audioFile.close();
+            return false;
+        }
+    }
+
+    this->format = format;
+    this->sampleRate = sampleRate;
+    dataBytes = 0;
+
+    //placeholder sizes, Stop writes the real ones
+    if (format == Format::Wav)
+        WriteWavHeader(0);
+
+    filling.samples.clear();
+    filling.samples.reserve(BLOCK_FRAMES * 2);
+    filling.hashLines.clear();
+    hash = FNV_OFFSET;
+    framesWritten = 0;
+    framesThisFrame = 0;
+    frameIndex = 0;
+    failed = false;
+
+    stopWriter = false;
+    writerThread = std::thread(&AudioCapture::WriterLoop, this);
+    capturing = true;
+    return true;
+}
+
+void AudioCapture::RequestStop()
+{
+    if (!capturing)
+        return;
+
+    capturing = false;
+    Submit();
+
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        stopWriter = true;
+    }
+    queueCondition.notify_one();
+}
+
+void AudioCapture::Stop()
+{
+    RequestStop();
+    if (!writerThread.joinable())
+        return;
+
+    writerThread.join();
+
+    if (format == Format::Wav)
+    {
+        audioFile.seekp(0);
+        WriteWavHeader(dataBytes);
+    }
+    audioFile.close();
+    if (hashing)
+        hashFile.close();
+}
+
+void AudioCapture::Write(const int16_t* frames, size_t count)
+{
+    if (!capturing)
+        return;
+
+    for (size_t i = 0; i < count * 2; i++)
+    {
+        uint16_t sample = static_cast<uint16_t>(frames[i]);
+        hash = (hash ^ (sample & 0xFF)) * FNV_PRIME;
+        hash = (hash ^ (sample >> 8)) * FNV_PRIME;
+    }
+
+    framesWritten += count;
+    framesThisFrame += count;
+
+    //blocks stay at BLOCK_FRAMES so a write never reallocates
+    while (count > 0)
+    {
+        size_t room = BLOCK_FRAMES - filling.samples.size() / 2;
+        size_t take = count < room ? count : room;
+        filling.samples.insert(filling.samples.end(), frames, frames + take * 2);
+        frames += take * 2;
+        count -= take;
+
+        if (filling.samples.size() / 2 == BLOCK_FRAMES)
+            Submit();
+    }
+}
+
+void AudioCapture::EndFrame()
+{
+    if (!capturing)
+        return;
+
+    if (hashing)
+    {
+        char line[96];
+        snprintf(line, sizeof(line), "%llu %llu %016llx\n", static_cast<unsigned long long>(frameIndex),
+            static_cast<unsigned long long>(framesThisFrame), static_cast<unsigned long long>(hash));
+        filling.hashLines += line;
+    }
+
+    frameIndex++;
+    framesThisFrame = 0;
+}
+
+void AudioCapture::Submit()
+{
+    if (filling.samples.empty() && filling.hashLines.empty())
+        return;
+
+    {
+        //a disk slower than realtime slows the emulation down rather than leaving holes in the capture
+        std::unique_lock<std::mutex> lock(queueMutex);
+        if (queue.size() >= MAX_QUEUED_BLOCKS && !failed)
+        {
+            TRACE_SCOPE("Wait for audio capture");
+            spaceCondition.wait(lock, [this] { return queue.size() < MAX_QUEUED_BLOCKS || failed; });
+        }
+
+        //once the files have failed there's nowhere left to put it
+        if (!failed)
+            queue.push_back(std::move(filling));
+    }
+    queueCondition.notify_one();
+
+    filling = Block();
+    filling.samples.reserve(BLOCK_FRAMES * 2);
+}
+
+void AudioCapture::WriterLoop()
+{
+    TraceRecorder::SetThreadName("Audio capture");
+
+    for (;;)
+    {
+        Block block;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueCondition.wait(lock, [this] { return stopWriter || !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            block = std::move(queue.front());
+            queue.pop_front();
+        }
+        spaceCondition.notify_one();
+
+        //wav and raw are both little endian, so are the machines this runs on
+        size_t bytes = block.samples.size() * sizeof(int16_t);
+        audioFile.write(reinterpret_cast<const char*>(block.samples.data()), static_cast<std::streamsize>(bytes));
+        dataBytes += bytes;
+
+        if (hashing && !block.hashLines.empty())
+            hashFile << block.hashLines;
+
+        if (!audioFile || (hashing && !hashFile))
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            failed = true;
+            queue.clear();
+            spaceCondition.notify_one();
+        }
+    }
+}
+
+void AudioCapture::WriteWavHeader(uint64_t size)
+{
+    //the size fields are 32 bit, a capture that long just gets a header that stops short
+    uint32_t dataSize = size > 0xFFFFFFFFull - 36 ? 0xFFFFFFFFu - 36 : static_cast<uint32_t>(size);
+    const uint32_t channels = 2;
+    const uint32_t bytesPerFrame = channels * sizeof(int16_t);
+
+    audioFile.write("RIFF", 4);
+    PutLE(audioFile, 36 + dataSize, 4);
+    audioFile.write("WAVEfmt ", 8);
+    PutLE(audioFile, 16, 4);
+    PutLE(audioFile, 1, 2);
+    PutLE(audioFile, channels, 2);
+    PutLE(audioFile, sampleRate, 4);
+    PutLE(audioFile, sampleRate * bytesPerFrame, 4);
+    PutLE(audioFile, bytesPerFrame, 2);
+    PutLE(audioFile, 16, 2);
+    audioFile.write("data", 4);
+    PutLE(audioFile, dataSize, 4);
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//streams the apu's output to a wav or raw pcm file for regression runs and offline analysis, no sdl needed.
+//the emulation thread only fills big blocks in memory, a writer thread does all the file io.
+//it can also keep a running hash of every sample and log it once a frame, so two runs that are meant to sound
+//the same can be compared with a diff
+class AudioCapture
+{
+public:
+    enum class Format
+    {
+        Wav,
+        Raw
+    };
+
+    AudioCapture() = default;
+    ~AudioCapture();
+
+    AudioCapture(const AudioCapture&) = delete;
+    AudioCapture& operator=(const AudioCapture&) = delete;
+
+    //.wav gets a header, anything else is headerless 16 bit stereo little endian
+    static Format FormatForPath(const std::string& path);
+
+    //empty hashPath leaves the hash log off. false if either file can't be opened
+    bool Start(const std::string& path, Format format, uint32_t sampleRate, const std::string& hashPath);
+    //emulation side of Stop, hands the writer the last block and lets it finish without waiting for it.
+    //call it wherever Write and EndFrame are serialized, then Stop outside that lock
+    void RequestStop();
+    //writes whatever's buffered, waits for the writer and fixes up the wav header
+    void Stop();
+    bool IsCapturing() const { return capturing; }
+
+    //emulation thread only, interleaved stereo frames
+    void Write(const int16_t* frames, size_t count);
+    //emulation thread, once an emulated frame. logs the running hash if the hash log is on
+    void EndFrame();
+
+    uint64_t GetHash() const { return hash; }
+    uint64_t GetFramesWritten() const { return framesWritten; }
+    //a write to either file went wrong, everything after it is lost so the capture can't be trusted
+    bool HasFailed() const { return failed; }
+
+private:
+    //256kb of audio per write, about two seconds
+    static constexpr size_t BLOCK_FRAMES = 65536;
+    //past this many blocks waiting on the disk the emulation thread waits for the writer instead of
+    //growing forever, nothing is ever dropped unless the files already failed
+    static constexpr size_t MAX_QUEUED_BLOCKS = 32;
+
+    struct Block
+    {
+        std::vector<int16_t> samples;
+        std::string hashLines;
+    };
+
+    void Submit();
+    void WriterLoop();
+    void WriteWavHeader(uint64_t size);
+
+    bool capturing = false;
+    Format format = Format::Raw;
+    uint32_t sampleRate = 0;
+    bool hashing = false;
+
+    //owned by the emulation thread until Submit hands it over
+    Block filling;
+    //fnv-1a over every sample in order, never reset during a capture
+    uint64_t hash = 0;
+    uint64_t framesWritten = 0;
+    uint64_t framesThisFrame = 0;
+    uint64_t frameIndex = 0;
+    std::atomic<bool> failed{ false };
+
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    std::condition_variable spaceCondition;
+    std::deque<Block> queue;
+    bool stopWriter = false;
+
+    //writer thread only once started
+    std::ofstream audioFile;
+    std::ofstream hashFile;
+    uint64_t dataBytes = 0;
+    std::thread writerThread;
+};
@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//stereo int16 frames from exactly one producer to exactly one consumer, no locks. both indices only ever
+//count up and get masked on use, so full and empty never look the same. each side keeps its own index and a
+//stale copy of the other's on its own cache line, the shared one only gets re-read when the stale copy says
+//there's no room (or nothing to read)
+template <size_t CapacityFrames>
+class AudioRing
+{
+    static_assert(CapacityFrames && (CapacityFrames & (CapacityFrames - 1)) == 0, "capacity has to be a power of two");
+
+public:
+    static constexpr size_t CAPACITY = CapacityFrames;
+
+    //producer. anything that doesn't fit is dropped and counted as an overrun
+    size_t Write(const int16_t* frames, size_t count)
+    {
+        size_t head = producer.head.load(std::memory_order_relaxed);
+        if (CAPACITY - (head - producer.cachedTail) < count)
+            producer.cachedTail = consumer.tail.load(std::memory_order_acquire);
+
+        size_t room = CAPACITY - (head - producer.cachedTail);
+        size_t written = std::min(count, room);
+        if (written < count)
+            overrunFrames.fetch_add(count - written, std::memory_order_relaxed);
+        if (written == 0)
+            return 0;
+
+        size_t start = head & MASK;
+        size_t first = std::min(written, CAPACITY - start);
+        std::memcpy(&samples[start * 2], frames, first * FRAME_BYTES);
+        std::memcpy(&samples[0], frames + first * 2, (written - first) * FRAME_BYTES);
+
+        producer.head.store(head + written, std::memory_order_release);
+        return written;
+    }
+
+    //consumer. asking for more than is there counts as an underrun, whatever was there still gets read
+    size_t Read(int16_t* destination, size_t maxFrames)
+    {
+        size_t tail = consumer.tail.load(std::memory_order_relaxed);
+        if (consumer.cachedHead - tail < maxFrames)
+            consumer.cachedHead = producer.head.load(std::memory_order_acquire);
+
+        size_t available = consumer.cachedHead - tail;
+        size_t taken = std::min(maxFrames, available);
+        if (taken < maxFrames)
+            underruns.fetch_add(1, std::memory_order_relaxed);
+        if (taken == 0)
+            return 0;
+
+        size_t start = tail & MASK;
+        size_t first = std::min(taken, CAPACITY - start);
+        std::memcpy(destination, &samples[start * 2], first * FRAME_BYTES);
+        std::memcpy(destination + first * 2, &samples[0], (taken - first) * FRAME_BYTES);
+
+        consumer.tail.store(tail + taken, std::memory_order_release);
+        return taken;
+    }
+
+    //consumer. throws away everything queued so far
+    void Discard()
+    {
+        consumer.cachedHead = producer.head.load(std::memory_order_acquire);
+        consumer.tail.store(consumer.cachedHead, std::memory_order_release);
+    }
+
+    //either side or anyone else, only a snapshot. tail goes first so the difference can't wrap below zero, but
+    //the producer can refill what the consumer freed in between, so it still gets clamped to what fits
+    size_t Available() const
+    {
+        size_t tail = consumer.tail.load(std::memory_order_acquire);
+        size_t head = producer.head.load(std::memory_order_acquire);
+        return std::min(head - tail, CAPACITY);
+    }
+
+    uint64_t GetOverrunFrames() const { return overrunFrames.load(std::memory_order_relaxed); }
+    uint64_t GetUnderruns() const { return underruns.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t MASK = CAPACITY - 1;
+    static constexpr size_t FRAME_BYTES = 2 * sizeof(int16_t);
+
+    //padding rather than alignas, the bus is heap allocated and c++14 new won't over-align it
+    static constexpr size_t CACHE_LINE = 64;
+
+    struct ProducerSide
+    {
+        std::atomic<size_t> head{0};
+        size_t cachedTail = 0;
+        char padding[CACHE_LINE - 2 * sizeof(size_t)];
+    };
+
+    struct ConsumerSide
+    {
+        std::atomic<size_t> tail{0};
+        size_t cachedHead = 0;
+        char padding[CACHE_LINE - 2 * sizeof(size_t)];
+    };
+
+    char leadingPadding[CACHE_LINE];
+    ProducerSide producer;
+    ConsumerSide consumer;
+    std::atomic<uint64_t> overrunFrames{0};
+    std::atomic<uint64_t> underruns{0};
+    char trailingPadding[CACHE_LINE - 2 * sizeof(uint64_t)];
+    std::array<int16_t, CAPACITY * 2> samples{};
+};
+
+template <size_t CapacityFrames>
+constexpr size_t AudioRing<CapacityFrames>::CAPACITY;
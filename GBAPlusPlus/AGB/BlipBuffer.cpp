@@ -0,0 +1,88 @@
+#include "BlipBuffer.h"
+
+#include <cmath>
+
+BlipBuffer::BlipBuffer(uint32_t cyclesPerSample)
+    : cyclesPerSample(cyclesPerSample)
+{
+    Clear();
+}
+
+const BlipBuffer::Kernel& BlipBuffer::GetKernel()
+{
+    static const Kernel kernel = [] {
+        const double pi = 3.14159265358979323846;
+        //a bit under nyquist, blackman window
+        const double cutoff = 0.9;
+        const double half = KERNEL_WIDTH / 2.0;
+
+        Kernel table{};
+        for (uint32_t phase = 0; phase <= PHASES; phase++)
+        {
+            double fraction = static_cast<double>(phase) / PHASES;
+            double values[KERNEL_WIDTH];
+            double sum = 0.0;
+            for (uint32_t k = 0; k < KERNEL_WIDTH; k++)
+            {
+                double x = static_cast<double>(k) - (half - 1.0) - fraction;
+                double sinc = std::fabs(x) < 1e-9 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+                double u = (x + half) / (2.0 * half);
+                double window = (u <= 0.0 || u >= 1.0) ? 0.0 : 0.42 - 0.5 * std::cos(2.0 * pi * u) + 0.08 * std::cos(4.0 * pi * u);
+                values[k] = sinc * window;
+                sum += values[k];
+            }
+
+            //every row has to add up to exactly one step, whatever rounding leaves goes in the middle tap.
+            //otherwise each change leaves a little dc behind and the level wanders off
+            int32_t total = 0;
+            for (uint32_t k = 0; k < KERNEL_WIDTH; k++)
+            {
+                table[phase][k] = static_cast<int32_t>(std::lround(values[k] / sum * (1 << KERNEL_SHIFT)));
+                total += table[phase][k];
+            }
+            table[phase][KERNEL_WIDTH / 2 - 1] += (1 << KERNEL_SHIFT) - total;
+        }
+        return table;
+    }();
+    return kernel;
+}
+
+void BlipBuffer::Clear()
+{
+    deltas.fill(0);
+    readIndex = 0;
+    level = 0;
+}
+
+void BlipBuffer::WriteState(SaveState& state) const
+{
+    state.Write(deltas);
+    state.Write(readIndex);
+    state.Write(level);
+}
+
+void BlipBuffer::ReadState(SaveState& state)
+{
+    state.Read(deltas);
+    state.ReadChecked(readIndex, [](uint32_t index) { return index < RING_SIZE; });
+    state.Read(level);
+}
+
+void BlipBuffer::AddDelta(uint32_t time, int32_t delta)
+{
+    uint32_t sample = time / cyclesPerSample;
+    uint32_t phase = ((time % cyclesPerSample) * PHASES + cyclesPerSample / 2) / cyclesPerSample;
+
+    const std::array<int32_t, KERNEL_WIDTH>& row = GetKernel()[phase];
+    uint32_t start = readIndex + sample;
+    for (uint32_t k = 0; k < KERNEL_WIDTH; k++)
+        deltas[(start + k) & RING_MASK] += delta * row[k];
+}
+
+int32_t BlipBuffer::ReadSample()
+{
+    level += deltas[readIndex];
+    deltas[readIndex] = 0;
+    readIndex = (readIndex + 1) & RING_MASK;
+    return static_cast<int32_t>(level >> KERNEL_SHIFT);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "SaveState.h"
+
+//band-limited steps for the psg. a level change at any cycle gets spread over the neighbouring output samples
+//as a short windowed sinc instead of landing square on one of them, so high notes don't alias into mush.
+//only the changes are stored, ReadSample integrates them back into a level
+class BlipBuffer
+{
+public:
+    static constexpr uint32_t KERNEL_WIDTH = 16;
+    static constexpr uint32_t PHASES = 32;
+    //how far past the read position a delta may land, in output samples
+    static constexpr uint32_t MAX_SAMPLES_AHEAD = 1024 - KERNEL_WIDTH;
+
+    explicit BlipBuffer(uint32_t cyclesPerSample);
+
+    void Clear();
+
+    //the pending deltas and the level, the kernel is the same everywhere
+    void WriteState(SaveState& state) const;
+    void ReadState(SaveState& state);
+
+    //time is in cycles from the start of the sample the next ReadSample returns. the step comes out
+    //KERNEL_WIDTH / 2 - 1 samples late, the filter needs to see a little either side of it
+    void AddDelta(uint32_t time, int32_t delta);
+
+    int32_t ReadSample();
+
+private:
+    static constexpr uint32_t RING_SIZE = 1024;
+    static constexpr uint32_t RING_MASK = RING_SIZE - 1;
+    static constexpr int KERNEL_SHIFT = 14;
+
+    typedef std::array<std::array<int32_t, KERNEL_WIDTH>, PHASES + 1> Kernel;
+    static const Kernel& GetKernel();
+
+    const uint32_t cyclesPerSample;
+    std::array<int32_t, RING_SIZE> deltas{};
+    uint32_t readIndex = 0;
+    int64_t level = 0;
+};
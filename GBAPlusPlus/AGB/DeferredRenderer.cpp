@@ -0,0 +1,327 @@
+#include "DeferredRenderer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "HostProfiler.h"
+
+DeferredRenderer::Worker::Worker()
+    : renderer(new PPU(ioRegisters, vram, paletteRAM, oam))
+{
+    renderer->InvalidateTileCache();
+}
+
+DeferredRenderer::DeferredRenderer(PPU& owner, unsigned workerCount)
+    : owner(owner), publishedFrame(owner.latchedFrame), publishedLineVersion(owner.lineVersion)
+{
+    workerCount = std::max(workerCount, 1u);
+
+    //one frame recording, one queued and one per worker keeps everyone busy without unbounded latency
+    for (unsigned i = 0; i < workerCount + 2; i++)
+    {
+        jobs.emplace_back(new FrameJob());
+        jobs.back()->patches.reserve(256);
+        jobs.back()->pageSwaps.reserve(VRAM_PAGES);
+        freeJobs.push_back(jobs.back().get());
+    }
+
+    RebuildVramPages();
+
+    for (unsigned i = 0; i < workerCount; i++)
+    {
+        workers.emplace_back(new Worker());
+        Worker& worker = *workers.back();
+        worker.thread = std::thread([this, &worker] { WorkerLoop(worker); });
+    }
+}
+
+DeferredRenderer::~DeferredRenderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobReady.notify_all();
+
+    for (auto& worker : workers)
+        worker->thread.join();
+}
+
+bool DeferredRenderer::CaptureLine(int screenY)
+{
+    if (screenY == 0)
+        BeginFrame();
+
+    //a dropped frame still counts as handled, composing it inline would put the cost right back here
+    if (!capturing)
+        return droppingFrame;
+
+    FrameJob& job = *capturing;
+    if (screenY > 0)
+    {
+        RecordPatches(job, screenY);
+        RefreshVramPages(&job, screenY);
+    }
+
+    job.affine[screenY].affineRefX = owner.affineRefX;
+    job.affine[screenY].affineRefY = owner.affineRefY;
+
+    if (screenY == VISIBLE_LINES - 1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pendingJobs.push_back(capturing);
+        }
+        capturing = nullptr;
+        jobReady.notify_one();
+    }
+
+    return true;
+}
+
+void DeferredRenderer::BeginFrame()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (capturing)
+            freeJobs.push_back(capturing);
+        capturing = nullptr;
+
+        //the workers are a whole pipeline behind. waiting for them would stall the cpu on the compositor,
+        //which is the one thing this is here to avoid, so this frame just doesn't get drawn
+        droppingFrame = freeJobs.empty();
+        if (!droppingFrame)
+        {
+            capturing = freeJobs.back();
+            freeJobs.pop_back();
+        }
+    }
+
+    if (droppingFrame)
+    {
+        TRACE_INSTANT("Drop frame");
+        return;
+    }
+
+    //pages copied after this are what the frame sees from line 0, everything after it only goes in the log
+    RefreshVramPages(nullptr, 0);
+
+    capturing->sequence = ++nextSequence;
+    std::memcpy(capturing->io.data(), owner.ioRegisters.data(), PPU::DISPLAY_IO_BYTES);
+    capturing->paletteRAM = owner.paletteRAM;
+    capturing->oam = owner.oam;
+    capturing->vram = vramPages;
+    capturing->patches.clear();
+    capturing->pageSwaps.clear();
+    owner.snapshotDirtyIo = 0;
+    owner.snapshotDirtyPalette = 0;
+    owner.snapshotDirtyOam = 0;
+}
+
+void DeferredRenderer::RecordPatches(FrameJob& job, int screenY)
+{
+    auto record = [&](Region region, uint32_t& dirty, const uint8_t* source)
+    {
+        while (dirty)
+        {
+            int block = 0;
+            while (!(dirty & (1u << block)))
+                block++;
+            dirty &= ~(1u << block);
+
+            Patch patch;
+            patch.line = static_cast<uint16_t>(screenY);
+            patch.region = region;
+            patch.block = static_cast<uint8_t>(block);
+            std::memcpy(patch.bytes.data(), source + block * PPU::SNAPSHOT_BLOCK_BYTES, PPU::SNAPSHOT_BLOCK_BYTES);
+            job.patches.push_back(patch);
+        }
+    };
+
+    record(Region::Io, owner.snapshotDirtyIo, owner.ioRegisters.data());
+    record(Region::Palette, owner.snapshotDirtyPalette, owner.paletteRAM.data());
+    record(Region::Oam, owner.snapshotDirtyOam, owner.oam.data());
+}
+
+void DeferredRenderer::RefreshVramPages(FrameJob* job, int screenY)
+{
+    static constexpr uint32_t TILES_PER_PAGE = VRAM_PAGE_BYTES / PPU::TILE_BYTES_4BPP;
+    static constexpr uint64_t PAGE_MASK = (1ull << TILES_PER_PAGE) - 1;
+
+    for (uint32_t page = 0; page < VRAM_PAGES; page++)
+    {
+        uint32_t firstTile = page * TILES_PER_PAGE;
+        uint64_t& word = owner.snapshotDirtyTiles[firstTile / 64];
+        uint64_t mask = PAGE_MASK << (firstTile % 64);
+        if (!(word & mask))
+            continue;
+        word &= ~mask;
+
+        //the old page is still held by every frame (and worker) that saw it, so it's never written to
+        std::shared_ptr<VramPage> copy = std::make_shared<VramPage>();
+        std::memcpy(copy->data(), &owner.vram[page * VRAM_PAGE_BYTES], VRAM_PAGE_BYTES);
+        vramPages[page] = copy;
+
+        if (job)
+            job->pageSwaps.push_back(PageSwap{static_cast<uint16_t>(screenY), static_cast<uint16_t>(page), vramPages[page]});
+    }
+}
+
+void DeferredRenderer::RebuildVramPages()
+{
+    owner.snapshotDirtyTiles.fill(~0ull);
+    RefreshVramPages(nullptr, 0);
+}
+
+void DeferredRenderer::Flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    jobDone.wait(lock, [this] { return pendingJobs.empty() && busyWorkers == 0; });
+}
+
+void DeferredRenderer::Reset()
+{
+    Flush();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (capturing)
+        freeJobs.push_back(capturing);
+    capturing = nullptr;
+    droppingFrame = false;
+
+    //vram may have been replaced without going through the bus
+    RebuildVramPages();
+
+    //whatever the workers finished last belongs to the machine before the reset, until a new frame comes back
+    //the owner's own latched frame is what gets shown
+    publishedFrame.fill(0);
+    for (auto& version : publishedLineVersion)
+        version = ++owner.lineChangeSequence;
+    publishedSequence = 0;
+}
+
+bool DeferredRenderer::CopyLatestFrame(void* pixels, PPU::PixelFormat format)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (publishedSequence == 0)
+        return false;
+
+    PPU::ConvertFrame(publishedFrame.data(), pixels, format);
+    return true;
+}
+
+bool DeferredRenderer::CopyChangedLines(void* pixels, PPU::PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines, int& written)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (publishedSequence == 0)
+        return false;
+
+    written = PPU::ConvertChangedLines(publishedFrame.data(), publishedLineVersion.data(), pixels, format, lastSeen, changedLines);
+    return true;
+}
+
+void DeferredRenderer::PublishFrame(const std::array<uint16_t, 240 * 160>& frame)
+{
+    for (int y = 0; y < VISIBLE_LINES; y++)
+    {
+        const uint16_t* source = frame.data() + y * 240;
+        uint16_t* destination = publishedFrame.data() + y * 240;
+        if (std::memcmp(source, destination, 240 * sizeof(uint16_t)) == 0)
+            continue;
+
+        std::memcpy(destination, source, 240 * sizeof(uint16_t));
+        publishedLineVersion[y] = ++owner.lineChangeSequence;
+    }
+}
+
+void DeferredRenderer::WorkerLoop(Worker& worker)
+{
+    TraceRecorder::SetThreadName("Compose worker");
+
+    for (;;)
+    {
+        FrameJob* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobReady.wait(lock, [this] { return stopping || !pendingJobs.empty(); });
+            if (pendingJobs.empty())
+                return;
+
+            job = pendingJobs.front();
+            pendingJobs.pop_front();
+            busyWorkers++;
+        }
+
+        RenderJob(worker, *job);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            //frames can finish out of order with several workers, never go backwards
+            if (job->sequence > publishedSequence)
+            {
+                PublishFrame(worker.renderer->latchedFrame);
+                publishedSequence = job->sequence;
+
+                //the lock keeps workers from publishing over each other, so there's still only one producer
+                owner.PublishFrame(publishedFrame, publishedLineVersion);
+            }
+            freeJobs.push_back(job);
+            busyWorkers--;
+        }
+        jobDone.notify_all();
+    }
+}
+
+void DeferredRenderer::RenderJob(Worker& worker, const FrameJob& job)
+{
+    TRACE_SCOPE("Compose frame");
+    PPU& renderer = *worker.renderer;
+
+    //bring this worker's vram up to where the frame started, pages it already holds are skipped outright
+    for (uint32_t page = 0; page < VRAM_PAGES; page++)
+        ApplyVramPage(worker, page, job.vram[page]);
+
+    std::memcpy(worker.ioRegisters.data(), job.io.data(), PPU::DISPLAY_IO_BYTES);
+    worker.paletteRAM = job.paletteRAM;
+    worker.oam = job.oam;
+
+    size_t patch = 0;
+    size_t swap = 0;
+    for (int y = 0; y < VISIBLE_LINES; y++)
+    {
+        for (; swap < job.pageSwaps.size() && job.pageSwaps[swap].line == y; swap++)
+            ApplyVramPage(worker, job.pageSwaps[swap].page, job.pageSwaps[swap].data);
+
+        for (; patch < job.patches.size() && job.patches[patch].line == y; patch++)
+        {
+            const Patch& change = job.patches[patch];
+            uint8_t* destination = change.region == Region::Io ? worker.ioRegisters.data()
+                : change.region == Region::Palette ? worker.paletteRAM.data()
+                : worker.oam.data();
+            std::memcpy(destination + change.block * PPU::SNAPSHOT_BLOCK_BYTES, change.bytes.data(), PPU::SNAPSHOT_BLOCK_BYTES);
+        }
+
+        renderer.affineRefX = job.affine[y].affineRefX;
+        renderer.affineRefY = job.affine[y].affineRefY;
+
+        renderer.ComposeScanline(y);
+    }
+}
+
+void DeferredRenderer::ApplyVramPage(Worker& worker, uint32_t page, const std::shared_ptr<const VramPage>& data)
+{
+    if (worker.pages[page] == data)
+        return;
+
+    //only tiles that really differ get re-decoded
+    for (uint32_t offset = 0; offset < VRAM_PAGE_BYTES; offset += PPU::TILE_BYTES_4BPP)
+    {
+        uint32_t address = page * VRAM_PAGE_BYTES + offset;
+        if (std::memcmp(&worker.vram[address], data->data() + offset, PPU::TILE_BYTES_4BPP) != 0)
+        {
+            std::memcpy(&worker.vram[address], data->data() + offset, PPU::TILE_BYTES_4BPP);
+            worker.renderer->MarkVramDirty(address);
+        }
+    }
+    worker.pages[page] = data;
+}
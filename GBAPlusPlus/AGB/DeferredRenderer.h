@@ -0,0 +1,136 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PPU.h"
+
+//records what every visible line needs at hblank and composes whole frames on worker threads,
+//so the emulation thread only pays for the snapshot and never for the compositor
+class DeferredRenderer
+{
+public:
+    DeferredRenderer(PPU& owner, unsigned workerCount);
+    ~DeferredRenderer();
+
+    //returns false while no frame is being recorded yet, the caller composes that line inline instead.
+    //when every job is still out with the workers the frame is dropped rather than waiting on them
+    bool CaptureLine(int screenY);
+
+    //blocks until every submitted frame has been composed
+    void Flush();
+
+    //drops the half recorded frame and the last published one, the next line 0 starts a fresh frame
+    void Reset();
+
+    //false until the first frame comes back from a worker
+    bool CopyLatestFrame(void* pixels, PPU::PixelFormat format);
+
+    //same contract as PPU::RenderChangedLines, against the published frame
+    bool CopyChangedLines(void* pixels, PPU::PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines, int& written);
+
+private:
+    static constexpr int VISIBLE_LINES = 160;
+
+    //vram goes to the workers in copy-on-write pages, a page is only copied again after the game writes to it
+    static constexpr uint32_t VRAM_PAGE_BYTES = 1024;
+    static constexpr uint32_t VRAM_PAGES = 96 * 1024 / VRAM_PAGE_BYTES;
+    typedef std::array<uint8_t, VRAM_PAGE_BYTES> VramPage;
+    typedef std::array<std::shared_ptr<const VramPage>, VRAM_PAGES> VramPages;
+
+    //one 32 byte block of io, palette or oam rewritten while the frame was drawing, applied before composing its line
+    enum class Region : uint8_t
+    {
+        Io,
+        Palette,
+        Oam
+    };
+
+    struct Patch
+    {
+        uint16_t line;
+        Region region;
+        uint8_t block;
+        std::array<uint8_t, PPU::SNAPSHOT_BLOCK_BYTES> bytes;
+    };
+
+    //a vram page that was copied again while the frame was drawing
+    struct PageSwap
+    {
+        uint16_t line;
+        uint16_t page;
+        std::shared_ptr<const VramPage> data;
+    };
+
+    //the internal reference points step every line, so those are kept for all of them
+    struct AffineLine
+    {
+        std::array<int32_t, 2> affineRefX;
+        std::array<int32_t, 2> affineRefY;
+    };
+
+    //everything as it was at line 0, then only what changed after that
+    struct FrameJob
+    {
+        uint64_t sequence = 0;
+        std::array<uint8_t, PPU::DISPLAY_IO_BYTES> io;
+        std::array<uint8_t, 1024> paletteRAM;
+        std::array<uint8_t, 1024> oam;
+        VramPages vram;
+        std::array<AffineLine, VISIBLE_LINES> affine;
+        std::vector<Patch> patches;
+        std::vector<PageSwap> pageSwaps;
+    };
+
+    //each worker owns a private copy of video memory and a PPU wired to it, so its tile cache survives between frames
+    struct Worker
+    {
+        Worker();
+
+        std::array<uint8_t, 1024> ioRegisters{};
+        std::array<uint8_t, 96 * 1024> vram{};
+        std::array<uint8_t, 1024> paletteRAM{};
+        std::array<uint8_t, 1024> oam{};
+        //the pages this worker's vram currently holds, an unchanged pointer means nothing to copy
+        VramPages pages;
+        std::unique_ptr<PPU> renderer;
+        std::thread thread;
+    };
+
+    void BeginFrame();
+    void RecordPatches(FrameJob& job, int screenY);
+    void RefreshVramPages(FrameJob* job, int screenY);
+    void RebuildVramPages();
+    void WorkerLoop(Worker& worker);
+    void RenderJob(Worker& worker, const FrameJob& job);
+    static void ApplyVramPage(Worker& worker, uint32_t page, const std::shared_ptr<const VramPage>& data);
+    void PublishFrame(const std::array<uint16_t, 240 * 160>& frame);
+
+    PPU& owner;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<FrameJob>> jobs;
+
+    std::mutex mutex;
+    std::condition_variable jobReady;
+    std::condition_variable jobDone;
+    std::vector<FrameJob*> freeJobs;
+    std::deque<FrameJob*> pendingJobs;
+    int busyWorkers = 0;
+    bool stopping = false;
+
+    //only touched by the emulation thread
+    FrameJob* capturing = nullptr;
+    bool droppingFrame = false;
+    uint64_t nextSequence = 0;
+    VramPages vramPages;
+
+    std::array<uint16_t, 240 * 160> publishedFrame;
+    std::array<uint64_t, VISIBLE_LINES> publishedLineVersion;
+    uint64_t publishedSequence = 0;
+};
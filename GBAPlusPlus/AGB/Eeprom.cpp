@@ -0,0 +1,159 @@
+#include "Eeprom.h"
+
+constexpr size_t Eeprom::SIZE;
+constexpr size_t Eeprom::READ_BITS;
+constexpr size_t Eeprom::MAX_COMMAND_BITS;
+
+void Eeprom::Reset()
+{
+    incomingCount = 0;
+    reading = false;
+    readOffset = 0;
+    readPosition = 0;
+}
+
+void Eeprom::WriteState(SaveState& state) const
+{
+    SaveMedia::WriteState(state);
+    state.Write(addressBits);
+    state.Write(incoming);
+    state.Write(incomingCount);
+    state.Write(reading);
+    state.Write(readOffset);
+    state.Write(readPosition);
+}
+
+void Eeprom::ReadState(SaveState& state)
+{
+    SaveMedia::ReadState(state);
+
+    //anything out of range would index past the chip or the command buffer
+    state.ReadChecked(addressBits, [](int bits) { return bits == 0 || bits == 6 || bits == 14; });
+    state.Read(incoming);
+    state.ReadChecked(incomingCount, [this](size_t count) { return count <= incoming.size(); });
+    state.Read(reading);
+    state.ReadChecked(readOffset, [](uint32_t offset) { return offset <= SIZE - 8; });
+    state.ReadChecked(readPosition, [](size_t position) { return position <= READ_BITS; });
+}
+
+void Eeprom::RunCommand(bool isRead, const uint16_t* bits, int count)
+{
+    uint32_t block = 0;
+    for (int i = 0; i < count; i++)
+        block = (block << 1) | (bits[i] & 1);
+
+    //the 8kb chip only decodes the low 10 of its 14 bits
+    const uint32_t blocks = count == 6 ? 64 : SIZE / 8;
+    const uint32_t offset = (block & (blocks - 1)) * 8;
+
+    if (isRead)
+    {
+        reading = true;
+        readOffset = offset;
+        readPosition = 0;
+        return;
+    }
+
+    const uint16_t* value = bits + count;
+    for (int byte = 0; byte < 8; byte++)
+    {
+        uint8_t packed = 0;
+        for (int bit = 0; bit < 8; bit++)
+            packed = static_cast<uint8_t>((packed << 1) | (value[byte * 8 + bit] & 1));
+        data[offset + byte] = packed;
+    }
+    MarkDirty(offset);
+
+    //writes finish instantly, so the ready poll after one never has to wait
+    reading = false;
+}
+
+uint16_t Eeprom::ReadSerial()
+{
+    //idle reads as ready
+    if (!reading)
+        return 1;
+
+    uint16_t bit = 0;
+    if (readPosition >= 4)
+    {
+        size_t index = readPosition - 4;
+        bit = (data[readOffset + index / 8] >> (7 - index % 8)) & 1;
+    }
+
+    if (++readPosition == READ_BITS)
+        reading = false;
+    return bit;
+}
+
+void Eeprom::WriteSerial(uint16_t value)
+{
+    incoming[incomingCount++] = value & 1;
+
+    //every request starts with a 1, anything else is the game resetting the line
+    if (incoming[0] != 1)
+    {
+        incomingCount = 0;
+        return;
+    }
+    if (incomingCount < 2)
+        return;
+
+    const int bits = addressBits ? addressBits : DEFAULT_ADDRESS_BITS;
+    const bool isRead = incoming[1] == 1;
+    const size_t length = 2 + bits + (isRead ? 0 : 64) + 1;
+    if (incomingCount < length)
+        return;
+
+    incomingCount = 0;
+    RunCommand(isRead, &incoming[2], bits);
+}
+
+bool Eeprom::ReadStream(uint16_t* destination, size_t count)
+{
+    if (!reading || readPosition != 0 || count != READ_BITS)
+        return false;
+
+    for (size_t i = 0; i < 4; i++)
+        destination[i] = 0;
+
+    for (size_t byte = 0; byte < 8; byte++)
+    {
+        const uint8_t value = data[readOffset + byte];
+        for (int bit = 0; bit < 8; bit++)
+            destination[4 + byte * 8 + bit] = (value >> (7 - bit)) & 1;
+    }
+
+    reading = false;
+    return true;
+}
+
+bool Eeprom::WriteStream(const uint16_t* source, size_t count)
+{
+    //halfway through something bit by bit, let it carry on that way
+    if (incomingCount != 0)
+        return false;
+
+    int bits;
+    bool isRead;
+    switch (count)
+    {
+        case 9: bits = 6; isRead = true; break;
+        case 17: bits = 14; isRead = true; break;
+        case 73: bits = 6; isRead = false; break;
+        case 81: bits = 14; isRead = false; break;
+        default: return false;
+    }
+
+    if ((source[0] & 1) != 1 || (source[1] & 1) != (isRead ? 1 : 0))
+        return false;
+
+    //the size never changes once a game has shown it
+    if (addressBits == 0)
+        addressBits = bits;
+    else if (addressBits != bits)
+        return false;
+
+    RunCommand(isRead, source + 2, bits);
+    return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "SaveMedia.h"
+
+//serial eeprom, 512 bytes or 8kb in 64 bit blocks. the game clocks it one bit per halfword access:
+//11 + address + 0 asks for a block, which then comes back as 4 junk bits and 64 data bits,
+//10 + address + 64 data bits + 0 writes one. the two sizes only differ in how many address bits there are
+class Eeprom : public SaveMedia
+{
+public:
+    //the file is always 8kb, a 512 byte chip just uses the front of it
+    static constexpr size_t SIZE = 8 * 1024;
+
+    Eeprom() : SaveMedia(SIZE) {}
+
+    Type GetType() const override { return Type::Eeprom; }
+
+    void Reset() override;
+
+    void WriteState(SaveState& state) const override;
+    void ReadState(SaveState& state) override;
+
+    uint16_t ReadSerial() override;
+    void WriteSerial(uint16_t value) override;
+
+    //games always move a whole request or reply with one dma, so a stream is a complete command and its
+    //length says how big the chip is: 9/73 halfwords for 6 address bits, 17/81 for 14
+    bool ReadStream(uint16_t* destination, size_t count) override;
+    bool WriteStream(const uint16_t* source, size_t count) override;
+
+    //0 until the first dma has shown which size this is
+    int GetAddressBits() const { return addressBits; }
+
+private:
+    //what the serial path assumes before a dma has settled it
+    static constexpr int DEFAULT_ADDRESS_BITS = 14;
+    static constexpr size_t READ_BITS = 68;
+    static constexpr size_t MAX_COMMAND_BITS = 2 + 14 + 64 + 1;
+
+    //bits starts at the address, right after the two request bits
+    void RunCommand(bool isRead, const uint16_t* bits, int count);
+
+    int addressBits = 0;
+
+    std::array<uint16_t, MAX_COMMAND_BITS> incoming;
+    size_t incomingCount = 0;
+
+    bool reading = false;
+    uint32_t readOffset = 0;
+    size_t readPosition = 0;
+};
@@ -1,55 +1,79 @@
 #include "Flash.h"
 
-Flash::Flash()
+#include <algorithm>
+
+namespace
+{
+    bool IsLargeChip(Flash::Chip chip)
+    {
+        return chip == Flash::Chip::Sanyo128K || chip == Flash::Chip::Macronix128K;
+    }
+}
+
+Flash::Flash(Chip chip)
+    : SaveMedia(IsLargeChip(chip) ? 2 * BANK_SIZE : BANK_SIZE)
 {
+    switch (chip)
+    {
+        case Chip::Panasonic64K: manufacturerId = 0x32; deviceId = 0x1B; break;
+        case Chip::Macronix64K: manufacturerId = 0xC2; deviceId = 0x1C; break;
+        case Chip::Sanyo128K: manufacturerId = 0x62; deviceId = 0x13; break;
+        case Chip::Macronix128K: manufacturerId = 0xC2; deviceId = 0x09; break;
+    }
+
+    Erase();
     Reset();
 }
 
-void Flash::Reset()
+SaveMedia::Type Flash::GetType() const
 {
-    data.fill(0xFF);
+    return data.size() > BANK_SIZE ? Type::Flash128K : Type::Flash64K;
+}
 
+void Flash::Reset()
+{
     commandPhase = 0;
     idMode = false;
     erasePrepared = false;
     writePending = false;
     bankSwitchPending = false;
     bank = 0;
-    dirty = false;
-}
-
-const uint8_t* Flash::Data() const
-{
-    return data.data();
-}
-
-uint8_t* Flash::Data()
-{
-    return data.data();
 }
 
-size_t Flash::Size() const
+void Flash::WriteState(SaveState& state) const
 {
-    return data.size();
+    SaveMedia::WriteState(state);
+    state.Write(commandPhase);
+    state.Write(idMode);
+    state.Write(erasePrepared);
+    state.Write(writePending);
+    state.Write(bankSwitchPending);
+    state.Write(bank);
 }
 
-bool Flash::ConsumeDirty()
+void Flash::ReadState(SaveState& state)
 {
-    const bool was = dirty;
-    dirty = false;
-    return was;
+    SaveMedia::ReadState(state);
+    state.Read(commandPhase);
+    state.Read(idMode);
+    state.Read(erasePrepared);
+    state.Read(writePending);
+    state.Read(bankSwitchPending);
+
+    //a bank past the end of the chip would index off it
+    state.ReadChecked(bank, [this](uint8_t saved) { return saved * BANK_SIZE < data.size(); });
 }
 
-uint8_t Flash::Read(uint32_t address) const
+uint8_t Flash::Read(uint32_t address)
 {
     const uint32_t offset = address & 0xFFFF;
 
     if (idMode)
     {
         if (offset == 0)
-            return MANUFACTURER_ID;
+            return manufacturerId;
         if (offset == 1)
-            return DEVICE_ID;
+            return deviceId;
     }
 
     return data[bank * BANK_SIZE + offset];
@@ -64,7 +88,7 @@ void Flash::Write(uint32_t address, uint8_t value)
     {
         writePending = false;
         data[bank * BANK_SIZE + offset] = value;
-        dirty = true;
+        MarkDirty(bank * BANK_SIZE + offset);
         return;
     }
 
@@ -72,7 +96,9 @@ void Flash::Write(uint32_t address, uint8_t value)
     if (bankSwitchPending)
     {
         bankSwitchPending = false;
-        bank = value & 1;
+        //the 64kb chips don't have a second bank to switch to
+        if (data.size() > BANK_SIZE)
+            bank = value & 1;
         return;
     }
 
@@ -98,7 +124,7 @@ void Flash::Write(uint32_t address, uint8_t value)
     //anything outside the unlock sequence is an ordinary save-data write
     commandPhase = 0;
     data[bank * BANK_SIZE + offset] = value;
-    dirty = true;
+    MarkDirty(bank * BANK_SIZE + offset);
 }
 
 void Flash::HandleCommand(uint32_t offset, uint8_t value)
@@ -112,7 +138,7 @@ void Flash::HandleCommand(uint32_t offset, uint8_t value)
         for (uint32_t i = 0; i < SECTOR_SIZE; i++)
             data[sector + i] = 0xFF;
 
-        dirty = true;
+        MarkDirty(sector);
         return;
     }
 
@@ -141,8 +167,8 @@ void Flash::HandleCommand(uint32_t offset, uint8_t value)
             if (erasePrepared)
             {
                 erasePrepared = false;
-                data.fill(0xFF);
-                dirty = true;
+                std::fill(data.begin(), data.end(), 0xFF);
+                dirtySectors = 0xFFFFFFFF;
             }
             break;
 
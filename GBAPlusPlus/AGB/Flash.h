@@ -1,33 +1,40 @@
 #pragma once
-#include <array>
 #include <cstdint>
 
-class Flash
+#include "SaveMedia.h"
+
+class Flash : public SaveMedia
 {
 public:
-    Flash();
+    //the ids games actually check for. a game only knows 64kb or 128kb, any maker of that size works
+    enum class Chip
+    {
+        Panasonic64K, //MN63F805MNP
+        Macronix64K,  //MX29L512
+        Sanyo128K,    //LE26FV10N1TS
+        Macronix128K  //MX29L010
+    };
+
+    explicit Flash(Chip chip = Chip::Sanyo128K);
 
-    void Reset();
+    Type GetType() const override;
 
-    uint8_t Read(uint32_t address) const;
-    void Write(uint32_t address, uint8_t value);
+    void Reset() override;
 
-    const uint8_t* Data() const;
-    uint8_t* Data();
-    size_t Size() const;
+    void WriteState(SaveState& state) const override;
+    void ReadState(SaveState& state) override;
 
-    bool ConsumeDirty();
+    uint8_t Read(uint32_t address) override;
+    void Write(uint32_t address, uint8_t value) override;
 
-    //Sanyo LE26FV10N1TS
-    //not really sure if this ever changes...
-    static constexpr uint8_t MANUFACTURER_ID = 0x62;
-    static constexpr uint8_t DEVICE_ID = 0x13;
+    uint8_t GetManufacturerId() const { return manufacturerId; }
+    uint8_t GetDeviceId() const { return deviceId; }
 
 private:
     static constexpr size_t BANK_SIZE = 64 * 1024;
-    static constexpr size_t SECTOR_SIZE = 0x1000;
 
-    std::array<uint8_t, 2 * BANK_SIZE> data;
+    uint8_t manufacturerId = 0;
+    uint8_t deviceId = 0;
 
     uint8_t commandPhase = 0;
     bool idMode = false;
@@ -36,7 +43,5 @@ private:
     bool bankSwitchPending = false;
     uint8_t bank = 0;
 
-    bool dirty = false;
-
     void HandleCommand(uint32_t offset, uint8_t value);
 };
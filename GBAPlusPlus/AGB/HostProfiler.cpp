@@ -0,0 +1,96 @@
+#include "HostProfiler.h"
+
+#include <chrono>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define PROFILER_USE_RDTSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+std::array<std::atomic<uint64_t>, HostProfiler::ZONE_COUNT> HostProfiler::accumulated{};
+std::array<std::atomic<uint64_t>, HostProfiler::ZONE_COUNT> HostProfiler::lastFrame{};
+std::atomic<double> HostProfiler::ticksPerMicrosecond{0.0};
+
+namespace
+{
+    //tsc rate against the wall clock, only touched by EndFrame
+    std::chrono::steady_clock::time_point calibrationStart;
+    uint64_t calibrationTicks = 0;
+}
+
+uint64_t HostProfiler::Now()
+{
+#ifdef PROFILER_USE_RDTSC
+    //about a tenth of what a clock call costs, matters when the apu zone is hit 550 times a frame
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+void HostProfiler::EndFrame()
+{
+    for (int zone = 0; zone < ZONE_COUNT; zone++)
+        lastFrame[zone].store(accumulated[zone].exchange(0, std::memory_order_relaxed), std::memory_order_relaxed);
+
+#ifdef PROFILER_USE_RDTSC
+    //re-measure the tsc rate every second or so, invariant tsc makes this settle straight away
+    auto now = std::chrono::steady_clock::now();
+    uint64_t ticks = Now();
+    if (calibrationTicks == 0)
+    {
+        calibrationStart = now;
+        calibrationTicks = ticks;
+        return;
+    }
+
+    double elapsedUs = std::chrono::duration<double, std::micro>(now - calibrationStart).count();
+    if (elapsedUs >= 1e6)
+    {
+        ticksPerMicrosecond.store(static_cast<double>(ticks - calibrationTicks) / elapsedUs, std::memory_order_relaxed);
+        calibrationStart = now;
+        calibrationTicks = ticks;
+    }
+#else
+    ticksPerMicrosecond.store(1000.0, std::memory_order_relaxed);
+#endif
+}
+
+void HostProfiler::TraceZone(Zone zone, uint64_t startTicks, uint64_t endTicks)
+{
+    static const char* const names[ZONE_COUNT] = {
+        "Emulate frame",
+        "Compose line",
+        "DMA",
+        nullptr,
+        "Present"
+    };
+
+    if (names[zone])
+        TraceRecorder::RecordSlice(names[zone], startTicks, endTicks);
+}
+
+HostProfiler::FrameTimes HostProfiler::GetLastFrame()
+{
+    FrameTimes times;
+    double rate = ticksPerMicrosecond.load(std::memory_order_relaxed);
+    if (rate <= 0.0)
+        return times;
+
+    auto microseconds = [&](Zone zone) { return lastFrame[zone].load(std::memory_order_relaxed) / rate; };
+
+    times.frameUs = microseconds(ZONE_FRAME);
+    times.composeUs = microseconds(ZONE_COMPOSE);
+    times.dmaUs = microseconds(ZONE_DMA);
+    times.apuUs = microseconds(ZONE_APU);
+    times.presentUs = microseconds(ZONE_PRESENT);
+
+    double cpu = times.frameUs - times.composeUs - times.dmaUs - times.apuUs;
+    times.cpuUs = cpu > 0.0 ? cpu : 0.0;
+    return times;
+}
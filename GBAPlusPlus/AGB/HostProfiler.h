@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "TraceRecorder.h"
+
+//define GBA_NO_PROFILING to compile every PROFILE_SCOPE out
+#ifndef GBA_NO_PROFILING
+#define GBA_PROFILING
+#endif
+
+//how much host time each subsystem took, summed per emulated frame. zones nest, the cpu's share is
+//whatever the frame zone took that none of the others claimed
+class HostProfiler
+{
+public:
+    enum Zone : uint8_t
+    {
+        ZONE_FRAME,
+        ZONE_COMPOSE,
+        ZONE_DMA,
+        ZONE_APU,
+        ZONE_PRESENT,
+        ZONE_COUNT
+    };
+
+    struct FrameTimes
+    {
+        double frameUs = 0.0;
+        double cpuUs = 0.0;
+        double composeUs = 0.0;
+        double dmaUs = 0.0;
+        double apuUs = 0.0;
+        double presentUs = 0.0;
+    };
+
+    //raw ticks, tsc where we have it
+    static uint64_t Now();
+
+    static void Add(Zone zone, uint64_t ticks) { accumulated[zone].fetch_add(ticks, std::memory_order_relaxed); }
+
+    //emulation thread, once a frame. moves the running totals over to what GetLastFrame returns
+    static void EndFrame();
+
+    //any thread
+    static FrameTimes GetLastFrame();
+
+    //hands a finished zone to the trace recorder, per sample apu zones are left out to keep traces readable
+    static void TraceZone(Zone zone, uint64_t startTicks, uint64_t endTicks);
+
+private:
+    static std::array<std::atomic<uint64_t>, ZONE_COUNT> accumulated;
+    static std::array<std::atomic<uint64_t>, ZONE_COUNT> lastFrame;
+    static std::atomic<double> ticksPerMicrosecond;
+};
+
+class ScopedProfileTimer
+{
+public:
+    explicit ScopedProfileTimer(HostProfiler::Zone zone) : zone(zone), start(HostProfiler::Now()) {}
+    ~ScopedProfileTimer()
+    {
+        uint64_t end = HostProfiler::Now();
+        HostProfiler::Add(zone, end - start);
+        if (TraceRecorder::IsRecording())
+            HostProfiler::TraceZone(zone, start, end);
+    }
+
+    ScopedProfileTimer(const ScopedProfileTimer&) = delete;
+    ScopedProfileTimer& operator=(const ScopedProfileTimer&) = delete;
+
+private:
+    HostProfiler::Zone zone;
+    uint64_t start;
+};
+
+//a slice that only shows up in traces, not in the per frame totals
+class ScopedTraceSlice
+{
+public:
+    explicit ScopedTraceSlice(const char* name) : name(name), start(HostProfiler::Now()) {}
+    ~ScopedTraceSlice()
+    {
+        if (TraceRecorder::IsRecording())
+            TraceRecorder::RecordSlice(name, start, HostProfiler::Now());
+    }
+
+    ScopedTraceSlice(const ScopedTraceSlice&) = delete;
+    ScopedTraceSlice& operator=(const ScopedTraceSlice&) = delete;
+
+private:
+    const char* name;
+    uint64_t start;
+};
+
+#ifdef GBA_PROFILING
+#define PROFILE_SCOPE(zone) ScopedProfileTimer profileScopeTimer(HostProfiler::zone)
+#define TRACE_SCOPE(name) ScopedTraceSlice traceScopeSlice(name)
+#define TRACE_INSTANT(name) do { if (TraceRecorder::IsRecording()) TraceRecorder::RecordInstant(name); } while (0)
+#else
+#define PROFILE_SCOPE(zone) do {} while (0)
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_INSTANT(name) do {} while (0)
+#endif
@@ -11,6 +11,19 @@ void Input::Reset()
     irqConditionWasMet = false;
 }
 
+void Input::WriteState(SaveState& state) const
+{
+    state.BeginSection("Input");
+    state.Write(control);
+    state.Write(irqConditionWasMet);
+}
+
+void Input::ReadState(SaveState& state)
+{
+    state.Read(control);
+    state.Read(irqConditionWasMet);
+}
+
 void Input::SetButton(GbaButton button, bool isPressed)
 {
     const uint16_t bit = static_cast<uint16_t>(1u << static_cast<uint8_t>(button));
@@ -2,6 +2,8 @@
 #include <atomic>
 #include <cstdint>
 
+#include "SaveState.h"
+
 //the buttons!!!!!!!
 enum class GbaButton : uint8_t
 {
@@ -25,6 +27,10 @@ public:
 
     void Reset();
 
+    //KEYCNT and the irq edge. the buttons belong to whoever's holding the controller, a state never changes them
+    void WriteState(SaveState& state) const;
+    void ReadState(SaveState& state);
+
     void SetButton(GbaButton button, bool pressed);
     void SetPressedMask(uint16_t mask);
     void ReleaseAll();
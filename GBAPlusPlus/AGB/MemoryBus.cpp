@@ -1,6 +1,8 @@
 ﻿#include "MemoryBus.h"
 
+#include <algorithm>
 #include <fstream>
+#include "HostProfiler.h"
 #include <SDL3/SDL_haptic.h>
 
 MemoryBus::MemoryBus()
@@ -11,6 +13,7 @@ MemoryBus::MemoryBus()
     , apu(ioRegisters)
 {
     bios.fill(0);
+    saveMedia = SaveMedia::Create(SaveMedia::Type::None);
     reset();
 }
 
@@ -23,7 +26,7 @@ void MemoryBus::reset()
     paletteRAM.fill(0);
     vram.fill(0);
     oam.fill(0);
-    saveChip.Reset();
+    saveMedia->Reset();
     lastRead = 0;
     biosLocked = false;
     halted = false;
@@ -31,6 +34,7 @@ void MemoryBus::reset()
     timers.fill(TimerChannel{});
     ppu.Reset();
     apu.Reset();
+    audioClock = 0;
     rtc.Reset();
     input.Reset();
 
@@ -43,6 +47,89 @@ void MemoryBus::reset()
         ioRegisters[i] = 0xFF;
 }
 
+void MemoryBus::WriteState(SaveState& state)
+{
+    state.BeginSection("Memory");
+    state.Write(static_cast<uint64_t>(rom.size()));
+    state.Write(romHash);
+
+    state.Write(ewram);
+    state.Write(iwram);
+    state.Write(ioRegisters);
+    state.Write(paletteRAM);
+    state.Write(vram);
+    state.Write(oam);
+    state.Write(lastRead);
+    state.Write(biosLocked);
+    state.Write(halted);
+    state.Write(pendingCycles);
+
+    state.BeginSection("DMA and timers");
+    state.Write(dma);
+    state.Write(timers);
+    state.Write(audioClock);
+
+    ppu.WriteState(state);
+    apu.WriteState(state);
+    rtc.WriteState(state);
+    saveMedia->WriteState(state);
+    input.WriteState(state);
+}
+
+void MemoryBus::ReadState(SaveState& state)
+{
+    uint64_t savedRomSize = 0;
+    uint64_t savedRomHash = 0;
+    state.Inspect(savedRomSize);
+    state.Inspect(savedRomHash);
+    if (!state.IsGood() || savedRomSize != rom.size() || savedRomHash != romHash)
+    {
+        state.Fail();
+        return;
+    }
+
+    state.Read(ewram);
+    state.Read(iwram);
+    state.Read(ioRegisters);
+    state.Read(paletteRAM);
+    state.Read(vram);
+    state.Read(oam);
+    state.Read(lastRead);
+    state.Read(biosLocked);
+    state.Read(halted);
+    state.Read(pendingCycles);
+
+    state.Read(dma);
+    state.Read(timers);
+    state.Read(audioClock);
+
+    ppu.ReadState(state);
+    apu.ReadState(state);
+    rtc.ReadState(state);
+    saveMedia->ReadState(state);
+    input.ReadState(state);
+}
+
+uint64_t MemoryBus::HashRom(const uint8_t* data, size_t size)
+{
+    //fnv-1a, but a whole word at a time, a 32mb rom is a lot of bytes to go through one by one
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash ^= word;
+        hash *= 1099511628211ull;
+    }
+    for (; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
 void MemoryBus::TickPPU()
 {
     PPU::TickResult result = ppu.Tick();
@@ -111,6 +198,7 @@ void MemoryBus::TriggerSoundFifoDma(uint32_t fifoAddress)
 
 void MemoryBus::RunDma(int channel)
 {
+    PROFILE_SCOPE(ZONE_DMA);
     static constexpr uint32_t cntHOffsets[4] = {0xBA, 0xC6, 0xD2, 0xDE};
 
     DmaChannel& ch = dma[channel];
@@ -140,7 +228,10 @@ void MemoryBus::RunDma(int channel)
     uint32_t destination = ch.destination;
     uint32_t destinationStart = destination;
 
-    for (uint32_t i = 0; i < count; i++)
+    bool streamed = channel == 3 && !wordTransfer && hasEeprom
+        && RunEepromDma(source, destination, count, srcControl, destControl);
+
+    for (uint32_t i = 0; !streamed && i < count; i++)
     {
         if (wordTransfer)
             write32Raw(destination, read32Raw(source));
@@ -182,6 +273,40 @@ void MemoryBus::RunDma(int channel)
         ioRegisters[0x203] |= static_cast<uint8_t>(1 << channel);
 }
 
+bool MemoryBus::RunEepromDma(uint32_t& source, uint32_t& destination, uint32_t count, uint8_t srcControl, uint8_t destControl)
+{
+    //a whole eeprom command is one dma of one bit per halfword. handing the chip the lot at once skips going
+    //through the bus for every single bit
+    std::array<uint16_t, 81> bits;
+    if (count > bits.size() || srcControl == 1 || destControl == 1)
+        return false;
+
+    if (IsEepromAddress(destination) && srcControl == 0)
+    {
+        for (uint32_t i = 0; i < count; i++)
+            bits[i] = read16Raw(source + i * 2);
+        if (!saveMedia->WriteStream(bits.data(), count))
+            return false;
+    }
+    else if (IsEepromAddress(source) && destControl != 2)
+    {
+        if (!saveMedia->ReadStream(bits.data(), count))
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+            write16Raw(destination + i * 2, bits[i]);
+    }
+    else
+    {
+        return false;
+    }
+
+    if (srcControl == 0)
+        source += count * 2;
+    if (destControl != 2)
+        destination += count * 2;
+    return true;
+}
+
 uint8_t MemoryBus::TickTimers()
 {
     static constexpr uint32_t cntLOffsets[4] = {0x100, 0x104, 0x108, 0x10C};
@@ -242,15 +367,24 @@ uint8_t MemoryBus::TickTimers()
         previousOverflowed = overflowed;
     }
     //lets the dma increment
-    APU::RefillRequest refill = apu.Tick(overflowMask);
-    if (refill.fifoA)
-        TriggerSoundFifoDma(FIFO_A_ADDRESS);
-    if (refill.fifoB)
-        TriggerSoundFifoDma(FIFO_B_ADDRESS);
+    if (overflowMask & 0x3)
+    {
+        APU::RefillRequest refill = apu.OnTimerOverflow(overflowMask, audioClock);
+        if (refill.fifoA)
+            TriggerSoundFifoDma(FIFO_A_ADDRESS);
+        if (refill.fifoB)
+            TriggerSoundFifoDma(FIFO_B_ADDRESS);
+    }
 
+    audioClock++;
     return overflowMask;
 }
 
+void MemoryBus::SyncAudio()
+{
+    apu.Sync(audioClock);
+}
+
 APU& MemoryBus::GetAPU()
 {
     return apu;
@@ -297,9 +431,16 @@ Input& MemoryBus::GetInput()
     return input;
 }
 
-Flash& MemoryBus::GetSaveChip()
+SaveMedia& MemoryBus::GetSaveMedia()
 {
-    return saveChip;
+    return *saveMedia;
+}
+
+bool MemoryBus::IsEepromAddress(uint32_t address) const
+{
+    //a rom over 16mb needs most of 0x0D itself, the chip only keeps the last 256 bytes then
+    return hasEeprom && (address >> 24) == 0x0D
+        && (rom.size() <= 0x1000000 || (address & 0xFFFFFF) >= 0xFFFF00);
 }
 
 void MemoryBus::loadBIOS(const uint8_t* data, size_t size)
@@ -312,12 +453,25 @@ void MemoryBus::loadROM(const uint8_t* data, size_t size)
 {
     rom.resize(size);
     std::memcpy(rom.data(), data, size);
+    romHash = HashRom(rom.data(), rom.size());
+
+    //homebrew and some hacks don't carry a library string
+    SaveMedia::Type saveType = SaveMedia::Detect(rom.data(), rom.size());
+    if (saveType == SaveMedia::Type::None)
+        saveType = SaveMedia::FALLBACK_TYPE;
+
+    saveMedia = SaveMedia::Create(saveType);
+    hasEeprom = saveMedia->GetType() == SaveMedia::Type::Eeprom;
 }
 
 void MemoryBus::unloadROM()
 {
     rom.clear();
     rom.shrink_to_fit();
+    romHash = 0;
+
+    saveMedia = SaveMedia::Create(SaveMedia::Type::None);
+    hasEeprom = false;
 }
 
 uint32_t MemoryBus::ConsumeCycles()
@@ -404,7 +558,7 @@ uint8_t MemoryBus::read8Raw(uint32_t address)
             return readROM(address);
 
         case 0x0E: case 0x0F:
-            return saveChip.Read(address);
+            return saveMedia->Read(address);
 
         default:
             return openBusRead();
@@ -499,6 +653,8 @@ uint16_t MemoryBus::read16Aligned(uint32_t address)
         }
     case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
         {
+            if (IsEepromAddress(address))
+                return saveMedia->ReadSerial();
             uint32_t offset = address & 0x1FFFFFF;
             if (IsGpioOffset(offset) && rtc.IsReadEnabled())
                 return static_cast<uint16_t>(rtc.ReadRegister(address) | (rtc.ReadRegister(address + 1) << 8));
@@ -534,7 +690,7 @@ uint32_t MemoryBus::read32Aligned(uint32_t address)
     case 0x08: case 0x09: case 0x0A: case 0x0B: case 0x0C: case 0x0D:
         {
             uint32_t offset = address & 0x1FFFFFF;
-            if (IsGpioOffset(offset) || IsGpioOffset(offset + 2))
+            if (IsGpioOffset(offset) || IsGpioOffset(offset + 2) || IsEepromAddress(address))
                 return read16Aligned(address) | (static_cast<uint32_t>(read16Aligned(address + 2)) << 16);
             if (offset + 4 <= rom.size())
                 return *reinterpret_cast<uint32_t*>(&rom[offset]);
@@ -585,7 +741,7 @@ void MemoryBus::write8Raw(uint32_t address, uint8_t value)
         break;
 
     case 0x0E: case 0x0F:
-        saveChip.Write(address, value);
+        saveMedia->Write(address, value);
         break;
 
     default:
@@ -637,6 +793,7 @@ inline void MemoryBus::write16Aligned(uint32_t address, uint16_t value)
             
         case 0x05: 
             *reinterpret_cast<uint16_t*>(&paletteRAM[address & 0x3FF]) = value;
+            ppu.MarkPaletteDirty(address & 0x3FF);
             break;
             
         case 0x06:
@@ -644,11 +801,24 @@ inline void MemoryBus::write16Aligned(uint32_t address, uint16_t value)
             uint32_t offset = (address & 0x1FFFF);
             if (offset >= 0x18000) offset -= 0x8000;
             *reinterpret_cast<uint16_t*>(&vram[offset]) = value;
+            ppu.MarkVramDirty(offset);
             break;
         }
             
         case 0x07:
             *reinterpret_cast<uint16_t*>(&oam[address & 0x3FF]) = value;
+            ppu.MarkOamDirty(address & 0x3FF);
+            break;
+
+        case 0x0D:
+            //the eeprom only ever sees halfwords, a byte write never reaches it
+            if (IsEepromAddress(address))
+            {
+                saveMedia->WriteSerial(value);
+                break;
+            }
+            write8Raw(address, value & 0xFF);
+            write8Raw(address + 1, value >> 8);
             break;
             
         default:
@@ -682,6 +852,10 @@ uint8_t MemoryBus::readIO(uint32_t offset)
     if (Input::IsInputRegister(offset))
         return input.ReadRegister(offset);
 
+    //write only bits read back as zero, and the cpu sees whichever wave bank isn't playing
+    if (APU::IsSoundRegister(offset))
+        return apu.ReadRegister(offset);
+
     //this shit weird
     if (offset == 0x128 && ((ioRegisters[0x129] >> 4) & 0x3) == 1)
         return static_cast<uint8_t>((ioRegisters[0x128] & ~0x3C) | 0x04);
@@ -718,11 +892,10 @@ void MemoryBus::writeIO(uint32_t offset, uint8_t value)
         return;
     }
 
-    //SOUNDCNT_X bits 0 to 3 are channel status, only the master enable is writable
-    if (offset == 0x084)
+    //the apu keeps its own copy of the psg state and has to catch up to now before anything changes
+    if (APU::IsSoundRegister(offset))
     {
-        ioRegisters[0x084] = static_cast<uint8_t>((ioRegisters[0x084] & 0x0F) | (value & ~0x0F));
-        apu.OnSoundCntXWrite();
+        apu.WriteRegister(offset, value, audioClock);
         return;
     }
 
@@ -740,9 +913,10 @@ void MemoryBus::writeIO(uint32_t offset, uint8_t value)
     }
 
     ioRegisters[offset] = value;
+    if (offset < PPU::DISPLAY_IO_BYTES)
+        ppu.MarkDisplayIoDirty(offset);
 
-    if (offset == 0x083) apu.OnSoundCntHWrite();
-    else if (offset == 0xBB) OnDmaControlWrite(0);
+    if (offset == 0xBB) OnDmaControlWrite(0);
     else if (offset == 0xC7) OnDmaControlWrite(1);
     else if (offset == 0xD3) OnDmaControlWrite(2);
     else if (offset == 0xDF) OnDmaControlWrite(3);
@@ -755,6 +929,8 @@ void MemoryBus::writeIO(uint32_t offset, uint8_t value)
     else if (offset == 0x10A) OnTimerControlWrite(2);
     else if (offset == 0x10E) OnTimerControlWrite(3);
     else if (offset == 0x128 || offset == 0x129) OnSiocntWrite();
+    else if (offset >= 0x028 && offset < 0x030) ppu.OnAffineReferenceWrite(2);
+    else if (offset >= 0x038 && offset < 0x040) ppu.OnAffineReferenceWrite(3);
 }
 
 void MemoryBus::OnSiocntWrite()
@@ -779,7 +955,8 @@ void MemoryBus::writeVRAM(uint32_t address, uint8_t value)
 
     if (offset >= 0x18000) offset -= 0x8000;
 
-    vram[offset] = value;   
+    vram[offset] = value;
+    ppu.MarkVramDirty(offset);
 }
 
 uint8_t MemoryBus::readROM(uint32_t address)
@@ -809,6 +986,41 @@ void MemoryBus::RenderFrame(uint32_t* pixels)
     ppu.RenderFrame(pixels);
 }
 
+void MemoryBus::RenderFrame(void* pixels, PPU::PixelFormat format)
+{
+    ppu.RenderFrame(pixels, format);
+}
+
+int MemoryBus::PresentChangedLines(void* pixels, PPU::PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines)
+{
+    return ppu.PresentChangedLines(pixels, format, lastSeen, changedLines);
+}
+
+void MemoryBus::SetFrameSkip(unsigned skipCount, unsigned period)
+{
+    ppu.SetFrameSkip(skipCount, period);
+}
+
+void MemoryBus::SetFrameOutputWanted(bool wanted)
+{
+    ppu.SetFrameOutputWanted(wanted);
+}
+
+int MemoryBus::RenderChangedLines(void* pixels, PPU::PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines)
+{
+    return ppu.RenderChangedLines(pixels, format, lastSeen, changedLines);
+}
+
+void MemoryBus::SetDeferredRendering(bool enabled)
+{
+    ppu.SetDeferredRendering(enabled);
+}
+
+bool MemoryBus::IsDeferredRendering() const
+{
+    return ppu.IsDeferredRendering();
+}
+
 
 //thanks claude
 void MemoryBus::DumpDebugState(const std::string& path)
@@ -930,6 +1142,7 @@ void MemoryBus::SaveFrameAsBMP(const std::string& path)
     static constexpr int height = 160;
 
     std::vector<uint32_t> pixels(width * height);
+    ppu.FlushDeferredFrames();
     RenderFrame(pixels.data());
 
     std::ofstream out(path, std::ios::binary);
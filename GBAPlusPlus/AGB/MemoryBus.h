@@ -1,13 +1,15 @@
 ﻿#pragma once
 #include <array>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "APU.h"
-#include "Flash.h"
 #include "Input.h"
 #include "PPU.h"
 #include "RTC.h"
+#include "SaveMedia.h"
+#include "SaveState.h"
 
 class MemoryBus
 {
@@ -29,16 +31,37 @@ public:
 
     void reset();
 
+    //everything but the bios and rom, which a state is only ever loaded back on top of.
+    //a state from a different rom fails the read without changing anything
+    void WriteState(SaveState& state);
+    void ReadState(SaveState& state);
+
     void TickPPU();
     
     uint8_t TickTimers();
 
+    //makes every audio sample up to the current cycle, the frame loop calls it once a frame
+    void SyncAudio();
+
     static constexpr uint32_t FIFO_A_ADDRESS = 0x040000A0;
     static constexpr uint32_t FIFO_B_ADDRESS = 0x040000A4;
 
     APU& GetAPU();
 
     void RenderFrame(uint32_t* pixels);
+    void RenderFrame(void* pixels, PPU::PixelFormat format);
+    int RenderChangedLines(void* pixels, PPU::PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines = nullptr);
+
+    //lock free, the presenter can call this while another thread is running the emulator
+    int PresentChangedLines(void* pixels, PPU::PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines = nullptr);
+
+    //only ever skips composition, the cpu sees the same registers and interrupts either way
+    void SetFrameSkip(unsigned skipCount, unsigned period);
+    void SetFrameOutputWanted(bool wanted);
+
+    //compose frames on worker threads from per line snapshots instead of inline at hblank
+    void SetDeferredRendering(bool enabled);
+    bool IsDeferredRendering() const;
 
     void DumpDebugState(const std::string& path);
 
@@ -48,7 +71,8 @@ public:
     void ClearHalt();
 
     Input& GetInput();
-    Flash& GetSaveChip();
+    //whichever chip the rom asked for, replaced by every loadROM
+    SaveMedia& GetSaveMedia();
 
     uint32_t ConsumeCycles();
     
@@ -90,6 +114,7 @@ private:
     void RunDma(int channel);
     void TriggerDmaChannels(uint8_t startTiming);
     void TriggerSoundFifoDma(uint32_t fifoAddress);
+    bool RunEepromDma(uint32_t& source, uint32_t& destination, uint32_t count, uint8_t srcControl, uint8_t destControl);
 
     struct TimerChannel
     {
@@ -109,6 +134,8 @@ private:
     PPU ppu;
 
     APU apu;
+    //cycles ticked since reset, the apu's clock
+    uint64_t audioClock = 0;
 
     RTC rtc;
     static bool IsGpioOffset(uint32_t romOffset);
@@ -120,9 +147,15 @@ private:
     void writeVRAM(uint32_t address, uint8_t value);
     
     uint8_t readROM(uint32_t address);
-
-    //FLASH!
-    Flash saveChip;
+    //tells roms apart for save states, two hacks of one game share a header so this covers every byte.
+    //worked out once in loadROM
+    static uint64_t HashRom(const uint8_t* data, size_t size);
+    uint64_t romHash = 0;
+
+    std::unique_ptr<SaveMedia> saveMedia;
+    //cached so rom reads don't ask the chip what it is every time
+    bool hasEeprom = false;
+    bool IsEepromAddress(uint32_t address) const;
 
     //buttons
     Input input;
@@ -1,6 +1,16 @@
 #include "PPU.h"
 
 #include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include "DeferredRenderer.h"
+#include "HostProfiler.h"
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PPU_USE_SSE2 1
+#endif
 
 PPU::PPU(std::array<uint8_t, 1024>& ioRegisters,
     std::array<uint8_t, 96 * 1024>& vram,
@@ -13,9 +23,19 @@ PPU::PPU(std::array<uint8_t, 1024>& ioRegisters,
 {
 }
 
+PPU::~PPU() = default;
+
 void PPU::Reset()
 {
     ppuCycleCounter = 0;
+    frameIndex = 0;
+    composingFrame = true;
+    InvalidateTileCache();
+    InvalidateLineCache();
+    if (deferred)
+        deferred->Reset();
+    affineRefX.fill(0);
+    affineRefY.fill(0);
 
     //DISPCNT
     ioRegisters[0x000] = 0x80;
@@ -75,11 +95,160 @@ PPU::TickResult PPU::Tick()
 
     //compose the line that just finished drawing, while the state it used is still live
     if (result.hblankStarted && scanline < VISIBLE_SCANLINES)
-        ComposeScanline(static_cast<int>(scanline));
+    {
+        if (scanline == 0)
+            composingFrame = ShouldComposeFrame();
+
+        //a skipped frame leaves the last composed pixels (and their line keys) alone, so the cache stays valid
+        if (composingFrame)
+        {
+            PROFILE_SCOPE(ZONE_COMPOSE);
+            if (!deferred || !deferred->CaptureLine(static_cast<int>(scanline)))
+            {
+                if (!LineUnchanged(static_cast<int>(scanline)))
+                    ComposeAndTrackLine(static_cast<int>(scanline));
+            }
+        }
+        StepAffineReferences();
+    }
+
+    if (result.vblankStarted)
+    {
+        LatchAffineReferences();
+
+        //deferred frames are handed off by whichever worker finishes them
+        if (composingFrame && !deferred)
+            PublishFrame(latchedFrame, lineVersion);
+    }
 
     return result;
 }
 
+void PPU::SetDeferredRendering(bool enabled, unsigned workerCount)
+{
+    if (enabled == (deferred != nullptr))
+        return;
+
+    if (!enabled)
+    {
+        //keep showing the last finished frame until the inline path has drawn a new one
+        deferred->Flush();
+        deferred->CopyLatestFrame(latchedFrame.data(), PixelFormat::BGR555);
+        deferred.reset();
+        InvalidateLineCache();
+
+        //the published frame just replaced ours wholesale
+        for (auto& version : lineVersion)
+            version = ++lineChangeSequence;
+        return;
+    }
+
+    if (workerCount == 0)
+    {
+        //leave a core each for the emulation and ui threads
+        unsigned cores = std::thread::hardware_concurrency();
+        workerCount = std::min(std::max(cores, 3u) - 2, 4u);
+    }
+    deferred.reset(new DeferredRenderer(*this, workerCount));
+}
+
+void PPU::SetFrameSkip(unsigned skipCount, unsigned period)
+{
+    frameSkipCount = skipCount;
+    frameSkipPeriod = period;
+}
+
+bool PPU::ShouldComposeFrame()
+{
+    uint64_t index = frameIndex++;
+    if (!frameOutputWanted)
+        return false;
+    if (frameSkipPeriod == 0 || frameSkipCount == 0)
+        return true;
+
+    //skip the first skipCount of each period, the frame right before the next period is always drawn
+    return index % frameSkipPeriod >= frameSkipCount;
+}
+
+void PPU::WriteState(SaveState& state)
+{
+    //in deferred mode the last finished frame is out with the workers
+    if (deferred)
+    {
+        deferred->Flush();
+        deferred->CopyLatestFrame(latchedFrame.data(), PixelFormat::BGR555);
+    }
+
+    state.BeginSection("PPU");
+    state.Write(ppuCycleCounter);
+    state.Write(frameIndex);
+    state.Write(composingFrame);
+    state.Write(affineRefX);
+    state.Write(affineRefY);
+    state.Write(latchedFrame);
+}
+
+void PPU::ReadState(SaveState& state)
+{
+    state.Read(ppuCycleCounter);
+    state.Read(frameIndex);
+    state.Read(composingFrame);
+    state.Read(affineRefX);
+    state.Read(affineRefY);
+    state.Read(latchedFrame);
+
+    //nothing's been read in yet on the checking pass
+    if (state.IsChecking())
+        return;
+
+    //vram, palette and oam all changed underneath every cache, and a half captured deferred frame is stale
+    InvalidateTileCache();
+    InvalidateLineCache();
+    snapshotDirtyTiles.fill(~0ull);
+    for (auto& generation : vramGeneration)
+        generation++;
+    paletteGeneration++;
+    oamGeneration++;
+    if (deferred)
+        deferred->Reset();
+
+    for (auto& version : lineVersion)
+        version = ++lineChangeSequence;
+    PublishFrame(latchedFrame, lineVersion);
+}
+
+void PPU::FlushDeferredFrames()
+{
+    if (deferred)
+        deferred->Flush();
+}
+
+void PPU::InvalidateTileCache()
+{
+    dirtyTiles.fill(~0ull);
+}
+
+const uint8_t* PPU::DecodedTile4bpp(uint32_t tileAddr)
+{
+    uint32_t tile = tileAddr / TILE_BYTES_4BPP;
+    uint64_t bit = 1ull << (tile & 63);
+    uint8_t* decoded = &decodedTiles[tile * 64];
+
+    //most tile data sits untouched for hundreds of frames, only unpack after a write
+    if (dirtyTiles[tile >> 6] & bit)
+    {
+        const uint8_t* source = &vram[tile * TILE_BYTES_4BPP];
+        for (uint32_t i = 0; i < TILE_BYTES_4BPP; i++)
+        {
+            decoded[i * 2] = static_cast<uint8_t>(source[i] & 0xF);
+            decoded[i * 2 + 1] = static_cast<uint8_t>(source[i] >> 4);
+        }
+        dirtyTiles[tile >> 6] &= ~bit;
+    }
+
+    return decoded;
+}
+
 uint32_t PPU::Bgr555ToArgb(uint16_t color)
 {
     uint8_t r5 = color & 0x1F;
@@ -93,17 +262,17 @@ uint32_t PPU::Bgr555ToArgb(uint16_t color)
     return 0xFF000000u | (static_cast<uint32_t>(r8) << 16) | (static_cast<uint32_t>(g8) << 8) | b8;
 }
 
-uint32_t PPU::PaletteColor(bool obj, int index)
+uint16_t PPU::PaletteColor(bool obj, int index)
 {
     uint32_t addr = (obj ? 0x200 : 0x000) + static_cast<uint32_t>(index) * 2;
     if (addr + 1 >= paletteRAM.size())
-        return 0xFF000000u;
+        return 0;
 
-    uint16_t color = static_cast<uint16_t>(paletteRAM[addr] | (paletteRAM[addr + 1] << 8));
-    return Bgr555ToArgb(color);
+    //bit 15 is unused, keep it clear so the frame only ever holds real colors
+    return static_cast<uint16_t>((paletteRAM[addr] | (paletteRAM[addr + 1] << 8)) & 0x7FFF);
 }
 
-bool PPU::SampleRegularBackground(int bgIndex, int screenX, int screenY, uint32_t& outColor)
+void PPU::BuildRegularBackgroundLine(int bgIndex, int screenY)
 {
     uint32_t bgCntOffset = 0x08 + bgIndex * 2;
     uint16_t bgcnt = static_cast<uint16_t>(ioRegisters[bgCntOffset] | (ioRegisters[bgCntOffset + 1] << 8));
@@ -119,165 +288,402 @@ bool PPU::SampleRegularBackground(int bgIndex, int screenX, int screenY, uint32_
     int pixelsWide = tilesWide * 8;
     int pixelsHigh = tilesHigh * 8;
 
-    int worldX = (screenX + hofs) % pixelsWide;
     int worldY = (screenY + vofs) % pixelsHigh;
-
-    int tileX = worldX / 8;
     int tileY = worldY / 8;
-    int inTileX = worldX % 8;
     int inTileY = worldY % 8;
 
     //larger BG sizes are built from multiple adjacent 32x32-tile screenblocks
-    int screenBlockIndex = 0;
-    if (sizeMode == 1 && tileX >= 32) { screenBlockIndex = 1; tileX -= 32; }
-    else if (sizeMode == 2 && tileY >= 32) { screenBlockIndex = 1; tileY -= 32; }
-    else if (sizeMode == 3)
-    {
-        int sbx = tileX >= 32 ? 1 : 0;
-        int sby = tileY >= 32 ? 1 : 0;
-        screenBlockIndex = sby * 2 + sbx;
-        tileX -= sbx * 32;
-        tileY -= sby * 32;
+    int screenBlockRow = 0;
+    if (tileY >= 32)
+    {
+        screenBlockRow = (sizeMode == 3) ? 2 : 1;
+        tileY -= 32;
     }
 
-    uint8_t screenBaseBlock = (bgcnt >> 8) & 0x1F;
-    uint32_t entryOffset = (screenBaseBlock + screenBlockIndex) * 0x800u + (tileY * 32 + tileX) * 2u;
-    if (entryOffset + 1 >= vram.size())
-        return false;
-
-    uint16_t entry = static_cast<uint16_t>(vram[entryOffset] | (vram[entryOffset + 1] << 8));
-    uint16_t tileNumber = entry & 0x3FF;
-    bool flipX = (entry & 0x400) != 0;
-    bool flipY = (entry & 0x800) != 0;
-    uint8_t paletteBank = (entry >> 12) & 0xF;
-
+    uint32_t screenBase = ((bgcnt >> 8) & 0x1F) * 0x800u;
+    uint32_t charBase = ((bgcnt >> 2) & 0x3) * 0x4000u;
     bool is8bpp = (bgcnt & 0x80) != 0;
-    uint8_t charBaseBlock = (bgcnt >> 2) & 0x3;
-    uint32_t charBase = charBaseBlock * 0x4000u;
 
-    int sx = flipX ? 7 - inTileX : inTileX;
-    int sy = flipY ? 7 - inTileY : inTileY;
+    //the map entry only changes every 8 pixels, so fetch it once per tile and walk the row
+    const uint8_t* row = nullptr;
+    bool flipX = false;
+    int paletteBase = 0;
 
-    uint8_t colorIndex;
-    if (is8bpp)
+    int worldX = hofs % pixelsWide;
+    for (int x = 0; x < 240; x++, worldX = (worldX + 1) & (pixelsWide - 1))
     {
-        uint32_t tileAddr = charBase + tileNumber * 64u + sy * 8u + sx;
-        if (tileAddr >= vram.size())
-            return false;
-        colorIndex = vram[tileAddr];
-    }
-    else
-    {
-        uint32_t tileAddr = charBase + tileNumber * 32u + sy * 4u + sx / 2u;
-        if (tileAddr >= vram.size())
-            return false;
-        uint8_t byte = vram[tileAddr];
-        colorIndex = (sx & 1) ? static_cast<uint8_t>(byte >> 4) : static_cast<uint8_t>(byte & 0xF);
-    }
+        int inTileX = worldX & 7;
+        if (x == 0 || inTileX == 0)
+        {
+            int tileX = worldX / 8;
+            int screenBlockIndex = screenBlockRow;
+            if (tileX >= 32)
+            {
+                screenBlockIndex += 1;
+                tileX -= 32;
+            }
 
-    if (colorIndex == 0)
-        return false;
+            row = nullptr;
+            uint32_t entryOffset = (screenBase + screenBlockIndex * 0x800u) + (tileY * 32 + tileX) * 2u;
+            if (entryOffset + 1 < vram.size())
+            {
+                uint16_t entry = static_cast<uint16_t>(vram[entryOffset] | (vram[entryOffset + 1] << 8));
+                uint16_t tileNumber = entry & 0x3FF;
+                flipX = (entry & 0x400) != 0;
+                int sy = (entry & 0x800) ? 7 - inTileY : inTileY;
 
-    int paletteIndex = is8bpp ? colorIndex : (paletteBank * 16 + colorIndex);
-    outColor = PaletteColor(false, paletteIndex);
-    return true;
+                if (is8bpp)
+                {
+                    uint32_t rowAddr = charBase + tileNumber * 64u + sy * 8u;
+                    if (rowAddr < vram.size())
+                        row = &vram[rowAddr];
+                    paletteBase = 0;
+                }
+                else
+                {
+                    uint32_t tileAddr = charBase + tileNumber * 32u;
+                    if (tileAddr < vram.size())
+                        row = DecodedTile4bpp(tileAddr) + sy * 8;
+                    paletteBase = ((entry >> 12) & 0xF) * 16;
+                }
+            }
+        }
+
+        backgroundOpaque[x] = false;
+        if (!row)
+            continue;
+
+        uint8_t colorIndex = row[flipX ? 7 - inTileX : inTileX];
+        if (colorIndex == 0)
+            continue;
+
+        backgroundLine[x] = PaletteColor(false, paletteBase + colorIndex);
+        backgroundOpaque[x] = true;
+    }
 }
 
-bool PPU::SampleAffineBackground(int bgIndex, int screenX, int screenY, uint32_t& outColor)
+void PPU::OnAffineReferenceWrite(int bgIndex)
 {
-    uint32_t bgCntOffset = 0x08 + bgIndex * 2;
-    uint16_t bgcnt = static_cast<uint16_t>(ioRegisters[bgCntOffset] | (ioRegisters[bgCntOffset + 1] << 8));
-
     uint32_t paramBase = (bgIndex == 2) ? 0x20 : 0x30;
-    int16_t pa = static_cast<int16_t>(ioRegisters[paramBase] | (ioRegisters[paramBase + 1] << 8));
-    int16_t pc = static_cast<int16_t>(ioRegisters[paramBase + 4] | (ioRegisters[paramBase + 5] << 8));
-    int16_t pb = static_cast<int16_t>(ioRegisters[paramBase + 2] | (ioRegisters[paramBase + 3] << 8));
-    int16_t pd = static_cast<int16_t>(ioRegisters[paramBase + 6] | (ioRegisters[paramBase + 7] << 8));
-
     uint32_t xRaw = ioRegisters[paramBase + 8] | (ioRegisters[paramBase + 9] << 8)
         | (ioRegisters[paramBase + 10] << 16) | (ioRegisters[paramBase + 11] << 24);
     uint32_t yRaw = ioRegisters[paramBase + 12] | (ioRegisters[paramBase + 13] << 8)
         | (ioRegisters[paramBase + 14] << 16) | (ioRegisters[paramBase + 15] << 24);
 
     //reference point is a signed 28-bit value stored in a 32-bit field
-    int32_t x0 = static_cast<int32_t>(xRaw << 4) >> 4;
-    int32_t y0 = static_cast<int32_t>(yRaw << 4) >> 4;
+    affineRefX[bgIndex - 2] = static_cast<int32_t>(xRaw << 4) >> 4;
+    affineRefY[bgIndex - 2] = static_cast<int32_t>(yRaw << 4) >> 4;
+}
 
-    int32_t textureX = (x0 + pa * screenX + pb * screenY) >> 8;
-    int32_t textureY = (y0 + pc * screenX + pd * screenY) >> 8;
+void PPU::LatchAffineReferences()
+{
+    OnAffineReferenceWrite(2);
+    OnAffineReferenceWrite(3);
+}
+
+void PPU::StepAffineReferences()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        uint32_t paramBase = (i == 0) ? 0x20 : 0x30;
+        int16_t pb = static_cast<int16_t>(ioRegisters[paramBase + 2] | (ioRegisters[paramBase + 3] << 8));
+        int16_t pd = static_cast<int16_t>(ioRegisters[paramBase + 6] | (ioRegisters[paramBase + 7] << 8));
+        affineRefX[i] += pb;
+        affineRefY[i] += pd;
+    }
+}
+
+void PPU::BuildAffineBackgroundLine(int bgIndex)
+{
+    uint32_t bgCntOffset = 0x08 + bgIndex * 2;
+    uint16_t bgcnt = static_cast<uint16_t>(ioRegisters[bgCntOffset] | (ioRegisters[bgCntOffset + 1] << 8));
+
+    uint32_t paramBase = (bgIndex == 2) ? 0x20 : 0x30;
+    int16_t pa = static_cast<int16_t>(ioRegisters[paramBase] | (ioRegisters[paramBase + 1] << 8));
+    int16_t pc = static_cast<int16_t>(ioRegisters[paramBase + 4] | (ioRegisters[paramBase + 5] << 8));
 
     uint8_t sizeMode = (bgcnt >> 14) & 0x3;
     int mapSizeTiles = 16 << sizeMode;
     int mapSizePixels = mapSizeTiles * 8;
-
     bool wrap = (bgcnt & 0x2000) != 0;
-    if (wrap)
+
+    uint32_t mapBase = ((bgcnt >> 8) & 0x1F) * 0x800u;
+    uint32_t charBase = ((bgcnt >> 2) & 0x3) * 0x4000u;
+
+    const int32_t startX = affineRefX[bgIndex - 2];
+    const int32_t startY = affineRefY[bgIndex - 2];
+    const int mapShift = 4 + sizeMode;
+
+    //per pixel, the map entry to read (negative where the texture is off a map that doesn't wrap) and the
+    //pixel inside the tile it points at
+    int32_t entryAddr[240];
+    int32_t tileOffset[240];
+
+#ifdef PPU_USE_SSE2
+    //eight lanes of texture coordinates in two registers, each block of pixels just steps them by 8 * PA/PC
+    const __m128i laneStepX = _mm_setr_epi32(0, pa, pa * 2, pa * 3);
+    const __m128i laneStepY = _mm_setr_epi32(0, pc, pc * 2, pc * 3);
+    __m128i laneX[2] = { _mm_add_epi32(_mm_set1_epi32(startX), laneStepX), _mm_add_epi32(_mm_set1_epi32(startX + pa * 4), laneStepX) };
+    __m128i laneY[2] = { _mm_add_epi32(_mm_set1_epi32(startY), laneStepY), _mm_add_epi32(_mm_set1_epi32(startY + pc * 4), laneStepY) };
+    const __m128i blockStepX = _mm_set1_epi32(pa * 8);
+    const __m128i blockStepY = _mm_set1_epi32(pc * 8);
+
+    const __m128i sizePixels = _mm_set1_epi32(mapSizePixels);
+    const __m128i sizeMask = _mm_set1_epi32(mapSizePixels - 1);
+    const __m128i allOnes = _mm_set1_epi32(-1);
+    const __m128i seven = _mm_set1_epi32(7);
+    const __m128i base = _mm_set1_epi32(static_cast<int>(mapBase));
+    const __m128i rowShift = _mm_cvtsi32_si128(mapShift);
+
+    for (int x0 = 0; x0 < 240; x0 += 8)
     {
-        textureX = ((textureX % mapSizePixels) + mapSizePixels) % mapSizePixels;
-        textureY = ((textureY % mapSizePixels) + mapSizePixels) % mapSizePixels;
+        for (int half = 0; half < 2; half++)
+        {
+            __m128i tx = _mm_srai_epi32(laneX[half], 8);
+            __m128i ty = _mm_srai_epi32(laneY[half], 8);
+            laneX[half] = _mm_add_epi32(laneX[half], blockStepX);
+            laneY[half] = _mm_add_epi32(laneY[half], blockStepY);
+
+            __m128i outside = _mm_setzero_si128();
+            if (wrap)
+            {
+                //map sizes are powers of two, so masking wraps negatives correctly too
+                tx = _mm_and_si128(tx, sizeMask);
+                ty = _mm_and_si128(ty, sizeMask);
+            }
+            else
+            {
+                __m128i insideX = _mm_and_si128(_mm_cmpgt_epi32(tx, allOnes), _mm_cmpgt_epi32(sizePixels, tx));
+                __m128i insideY = _mm_and_si128(_mm_cmpgt_epi32(ty, allOnes), _mm_cmpgt_epi32(sizePixels, ty));
+                outside = _mm_andnot_si128(_mm_and_si128(insideX, insideY), allOnes);
+            }
+
+            //affine tilemap entries are an 8-bit tile index, one byte per map cell
+            __m128i entry = _mm_add_epi32(base, _mm_add_epi32(_mm_sll_epi32(_mm_srai_epi32(ty, 3), rowShift), _mm_srai_epi32(tx, 3)));
+            __m128i offset = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(ty, seven), 3), _mm_and_si128(tx, seven));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&entryAddr[x0 + half * 4]), _mm_or_si128(entry, outside));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&tileOffset[x0 + half * 4]), offset);
+        }
     }
-    else if (textureX < 0 || textureX >= mapSizePixels || textureY < 0 || textureY >= mapSizePixels)
+#else
+    int32_t fixedX = startX;
+    int32_t fixedY = startY;
+    for (int x = 0; x < 240; x++, fixedX += pa, fixedY += pc)
     {
-        return false;
+        int32_t tx = fixedX >> 8;
+        int32_t ty = fixedY >> 8;
+        if (wrap)
+        {
+            tx &= mapSizePixels - 1;
+            ty &= mapSizePixels - 1;
+        }
+        else if (tx < 0 || tx >= mapSizePixels || ty < 0 || ty >= mapSizePixels)
+        {
+            entryAddr[x] = -1;
+            continue;
+        }
+
+        entryAddr[x] = static_cast<int32_t>(mapBase) + ((ty >> 3) << mapShift) + (tx >> 3);
+        tileOffset[x] = ((ty & 7) << 3) | (tx & 7);
     }
+#endif
 
-    int tileX = textureX / 8;
-    int tileY = textureY / 8;
-    int inTileX = textureX % 8;
-    int inTileY = textureY % 8;
+    //the fetches themselves stay scalar, there's no gather to do them with
+    for (int x = 0; x < 240; x++)
+    {
+        backgroundOpaque[x] = false;
+        if (entryAddr[x] < 0 || static_cast<uint32_t>(entryAddr[x]) >= vram.size())
+            continue;
 
-    uint8_t screenBaseBlock = (bgcnt >> 8) & 0x1F;
-    uint32_t mapBase = screenBaseBlock * 0x800u;
-    uint32_t entryAddr = mapBase + static_cast<uint32_t>(tileY * mapSizeTiles + tileX);
-    if (entryAddr >= vram.size())
-        return false;
+        uint32_t tileAddr = charBase + vram[entryAddr[x]] * 64u + static_cast<uint32_t>(tileOffset[x]);
+        if (tileAddr >= vram.size())
+            continue;
 
-    //affine tilemap entries are an 8-bit tile index
-    uint8_t tileNumber = vram[entryAddr];
+        uint8_t colorIndex = vram[tileAddr];
+        if (colorIndex == 0)
+            continue;
 
-    uint8_t charBaseBlock = (bgcnt >> 2) & 0x3;
-    uint32_t charBase = charBaseBlock * 0x4000u;
-    uint32_t tileAddr = charBase + tileNumber * 64u + inTileY * 8u + inTileX;
-    if (tileAddr >= vram.size())
-        return false;
+        backgroundLine[x] = PaletteColor(false, colorIndex);
+        backgroundOpaque[x] = true;
+    }
+}
 
-    uint8_t colorIndex = vram[tileAddr];
-    if (colorIndex == 0)
-        return false;
+void PPU::ConvertBgr555Line(const uint16_t* source, uint32_t* destination, int count)
+{
+    int x = 0;
+
+#ifdef PPU_USE_SSE2
+    //same expansion as Bgr555ToArgb, eight pixels at a time
+    const __m128i fiveBits = _mm_set1_epi32(0x1F);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+    const __m128i zero = _mm_setzero_si128();
+
+    auto expand = [&](__m128i color)
+    {
+        __m128i r = _mm_and_si128(color, fiveBits);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(color, 5), fiveBits);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(color, 10), fiveBits);
+        r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+        g = _mm_or_si128(_mm_slli_epi32(g, 3), _mm_srli_epi32(g, 2));
+        b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+        return _mm_or_si128(alpha, _mm_or_si128(_mm_slli_epi32(r, 16), _mm_or_si128(_mm_slli_epi32(g, 8), b)));
+    };
+
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i colors = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + x), expand(_mm_unpacklo_epi16(colors, zero)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + x + 4), expand(_mm_unpackhi_epi16(colors, zero)));
+    }
+#endif
+
+    for (; x < count; x++)
+        destination[x] = Bgr555ToArgb(source[x]);
+}
+
+void PPU::ConvertBgr555LineToRgb565(const uint16_t* source, uint16_t* destination, int count)
+{
+    int x = 0;
 
-    outColor = PaletteColor(false, colorIndex);
-    return true;
+#ifdef PPU_USE_SSE2
+    //red and blue swap ends, green gets its top bit repeated into the new low bit
+    const __m128i fiveBits = _mm_set1_epi16(0x1F);
+
+    for (; x + 8 <= count; x += 8)
+    {
+        __m128i color = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + x));
+        __m128i r = _mm_and_si128(color, fiveBits);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(color, 5), fiveBits);
+        __m128i b = _mm_and_si128(_mm_srli_epi16(color, 10), fiveBits);
+        g = _mm_or_si128(_mm_slli_epi16(g, 1), _mm_srli_epi16(g, 4));
+        __m128i packed = _mm_or_si128(_mm_slli_epi16(r, 11), _mm_or_si128(_mm_slli_epi16(g, 5), b));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + x), packed);
+    }
+#endif
+
+    for (; x < count; x++)
+    {
+        uint16_t r = source[x] & 0x1F;
+        uint16_t g = (source[x] >> 5) & 0x1F;
+        uint16_t b = (source[x] >> 10) & 0x1F;
+        destination[x] = static_cast<uint16_t>((r << 11) | (((g << 1) | (g >> 4)) << 5) | b);
+    }
 }
 
-bool PPU::SampleBitmapMode3(int screenX, int screenY, uint32_t& outColor)
+void PPU::ConvertLine(const uint16_t* frame, void* pixels, PixelFormat format, int screenY)
 {
-    uint32_t addr = static_cast<uint32_t>(screenY * 240 + screenX) * 2u;
-    uint16_t color = static_cast<uint16_t>(vram[addr] | (vram[addr + 1] << 8));
-    outColor = Bgr555ToArgb(color);
-    return true;
+    //the frame is kept as bgr555, this is the only place it ever gets widened
+    const uint16_t* source = frame + screenY * 240;
+    if (format == PixelFormat::ARGB8888)
+        ConvertBgr555Line(source, static_cast<uint32_t*>(pixels) + screenY * 240, 240);
+    else if (format == PixelFormat::RGB565)
+        ConvertBgr555LineToRgb565(source, static_cast<uint16_t*>(pixels) + screenY * 240, 240);
+    else
+        std::memcpy(static_cast<uint16_t*>(pixels) + screenY * 240, source, 240 * sizeof(uint16_t));
 }
 
-bool PPU::SampleBitmapMode4(int screenX, int screenY, uint16_t dispcnt, uint32_t& outColor)
+void PPU::ConvertFrame(const uint16_t* frame, void* pixels, PixelFormat format)
 {
-    uint32_t base = (dispcnt & 0x10) ? 0xA000u : 0u;
-    uint8_t index = vram[base + screenY * 240 + screenX];
-    if (index == 0)
-        return false;
-    outColor = PaletteColor(false, index);
-    return true;
+    for (int y = 0; y < 160; y++)
+        ConvertLine(frame, pixels, format, y);
 }
 
-bool PPU::SampleBitmapMode5(int screenX, int screenY, uint16_t dispcnt, uint32_t& outColor)
+int PPU::ConvertChangedLines(const uint16_t* frame, const uint64_t* lineVersion, void* pixels, PixelFormat format,
+    uint64_t& lastSeen, std::array<bool, 160>* changedLines)
 {
+    int written = 0;
+    uint64_t newest = lastSeen;
+
+    for (int y = 0; y < 160; y++)
+    {
+        bool changed = lastSeen == 0 || lineVersion[y] > lastSeen;
+        if (changed)
+        {
+            ConvertLine(frame, pixels, format, y);
+            written++;
+        }
+        if (changedLines)
+            (*changedLines)[y] = changed;
+        newest = std::max(newest, lineVersion[y]);
+    }
+
+    //a frame that never changed still has to count as seen
+    lastSeen = std::max<uint64_t>(newest, 1);
+    return written;
+}
+
+void PPU::BuildBitmapLine(int screenY, uint16_t dispcnt, uint16_t backdrop, uint16_t* out)
+{
+    uint8_t mode = dispcnt & 0x7;
+    uint32_t pageBase = (dispcnt & 0x10) ? 0xA000u : 0u;
+
+    if (mode == 3)
+    {
+        //one page, 240 straight halfwords per line
+        std::memcpy(out, &vram[static_cast<uint32_t>(screenY) * 480u], 240 * sizeof(uint16_t));
+        for (int x = 0; x < 240; x++)
+            out[x] &= 0x7FFF;
+        backgroundOpaque.fill(true);
+        return;
+    }
+
+    if (mode == 4)
+    {
+        const uint8_t* indices = &vram[pageBase + static_cast<uint32_t>(screenY) * 240u];
+        for (int x = 0; x < 240; x++)
+        {
+            backgroundOpaque[x] = indices[x] != 0;
+            out[x] = backgroundOpaque[x]
+                ? static_cast<uint16_t>((paletteRAM[indices[x] * 2] | (paletteRAM[indices[x] * 2 + 1] << 8)) & 0x7FFF)
+                : backdrop;
+        }
+        return;
+    }
+
     //mode 5 only covers 160x128, the rest of the screen stays backdrop
-    if (screenX >= 160 || screenY >= 128)
-        return false;
+    if (screenY >= 128)
+    {
+        std::fill(out, out + 240, backdrop);
+        backgroundOpaque.fill(false);
+        return;
+    }
+
+    std::memcpy(out, &vram[pageBase + static_cast<uint32_t>(screenY) * 320u], 160 * sizeof(uint16_t));
+    for (int x = 0; x < 160; x++)
+        out[x] &= 0x7FFF;
+    std::fill(out + 160, out + 240, backdrop);
+    std::fill(backgroundOpaque.begin(), backgroundOpaque.begin() + 160, true);
+    std::fill(backgroundOpaque.begin() + 160, backgroundOpaque.end(), false);
+}
 
-    uint32_t base = (dispcnt & 0x10) ? 0xA000u : 0u;
-    uint32_t addr = base + static_cast<uint32_t>(screenY * 160 + screenX) * 2u;
-    uint16_t color = static_cast<uint16_t>(vram[addr] | (vram[addr + 1] << 8));
-    outColor = Bgr555ToArgb(color);
-    return true;
+void PPU::StepAffineSpan(int32_t x, int32_t y, int32_t pa, int32_t pc, int count, int32_t* texX, int32_t* texY)
+{
+#ifdef PPU_USE_SSE2
+    //eight pixels per step, so the buffers have to be rounded up to a multiple of 8
+    const __m128i laneStepX = _mm_setr_epi32(0, pa, pa * 2, pa * 3);
+    const __m128i laneStepY = _mm_setr_epi32(0, pc, pc * 2, pc * 3);
+    __m128i laneX[2] = { _mm_add_epi32(_mm_set1_epi32(x), laneStepX), _mm_add_epi32(_mm_set1_epi32(x + pa * 4), laneStepX) };
+    __m128i laneY[2] = { _mm_add_epi32(_mm_set1_epi32(y), laneStepY), _mm_add_epi32(_mm_set1_epi32(y + pc * 4), laneStepY) };
+    const __m128i blockStepX = _mm_set1_epi32(pa * 8);
+    const __m128i blockStepY = _mm_set1_epi32(pc * 8);
+
+    for (int i = 0; i < count; i += 8)
+    {
+        for (int half = 0; half < 2; half++)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&texX[i + half * 4]), _mm_srai_epi32(laneX[half], 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&texY[i + half * 4]), _mm_srai_epi32(laneY[half], 8));
+            laneX[half] = _mm_add_epi32(laneX[half], blockStepX);
+            laneY[half] = _mm_add_epi32(laneY[half], blockStepY);
+        }
+    }
+#else
+    for (int i = 0; i < count; i++, x += pa, y += pc)
+    {
+        texX[i] = x >> 8;
+        texY[i] = y >> 8;
+    }
+#endif
 }
 
 void PPU::BuildSpriteLine(int screenY)
@@ -356,21 +762,27 @@ void PPU::BuildSpriteLine(int screenY)
         int by = screenY - screenY0;
         if (by >= 0 && by < boundingHeight)
         {
-            for (int bx = 0; bx < boundingWidth; bx++)
+            int bxStart = std::max(0, -screenX0);
+            int bxEnd = std::min(boundingWidth, 240 - screenX0);
+
+            //affine sprites step the texture position by PA/PC per pixel, with the sprite centre folded into the start
+            int32_t spanTexX[128], spanTexY[128];
+            if (affine)
+            {
+                int32_t affineX = pa * (bxStart - centerX) + pb * (by - centerY) + ((spriteWidth / 2) << 8);
+                int32_t affineY = pc * (bxStart - centerX) + pd * (by - centerY) + ((spriteHeight / 2) << 8);
+                StepAffineSpan(affineX, affineY, pa, pc, bxEnd - bxStart, spanTexX, spanTexY);
+            }
+
+            for (int bx = bxStart; bx < bxEnd; bx++)
             {
                 int screenX = screenX0 + bx;
-                if (screenX < 0 || screenX >= 240)
-                    continue;
 
                 int texX, texY;
                 if (affine)
                 {
-                    int relX = bx - centerX;
-                    int relY = by - centerY;
-                    int32_t tx = (pa * relX + pb * relY) >> 8;
-                    int32_t ty = (pc * relX + pd * relY) >> 8;
-                    texX = tx + spriteWidth / 2;
-                    texY = ty + spriteHeight / 2;
+                    texX = spanTexX[bx - bxStart];
+                    texY = spanTexY[bx - bxStart];
                     if (texX < 0 || texX >= spriteWidth || texY < 0 || texY >= spriteHeight)
                         continue;
                 }
@@ -399,10 +811,8 @@ void PPU::BuildSpriteLine(int screenY)
                 }
                 else
                 {
-                    uint32_t addr = tileAddr + inY * 4u + inX / 2u;
-                    if (addr >= vram.size()) continue;
-                    uint8_t byteVal = vram[addr];
-                    colorIndex = (inX & 1) ? static_cast<uint8_t>(byteVal >> 4) : static_cast<uint8_t>(byteVal & 0xF);
+                    if (tileAddr >= vram.size()) continue;
+                    colorIndex = DecodedTile4bpp(tileAddr)[inY * 8 + inX];
                 }
 
                 if (colorIndex == 0)
@@ -468,14 +878,151 @@ uint8_t PPU::GetWindowLayerMask(int x, int y)
     return ioRegisters[0x04A]; //WINOUT low byte - outside control
 }
 
+void PPU::BuildWindowLine(int screenY)
+{
+    for (int x = 0; x < 240; x++)
+        windowLine[x] = GetWindowLayerMask(x, screenY);
+}
+
 void PPU::RenderFrame(uint32_t* pixels)
 {
-    std::copy(latchedFrame.begin(), latchedFrame.end(), pixels);
+    RenderFrame(pixels, PixelFormat::ARGB8888);
+}
+
+void PPU::RenderFrame(void* pixels, PixelFormat format)
+{
+    if (deferred && deferred->CopyLatestFrame(pixels, format))
+        return;
+
+    ConvertFrame(latchedFrame.data(), pixels, format);
+}
+
+int PPU::RenderChangedLines(void* pixels, PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines)
+{
+    if (deferred)
+    {
+        int written = 0;
+        if (deferred->CopyChangedLines(pixels, format, lastSeen, changedLines, written))
+            return written;
+    }
+
+    return ConvertChangedLines(latchedFrame.data(), lineVersion.data(), pixels, format, lastSeen, changedLines);
+}
+
+int PPU::PresentChangedLines(void* pixels, PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines)
+{
+    presentedFrames.Acquire();
+
+    const PresentedFrame& frame = presentedFrames.ReadBuffer();
+    return ConvertChangedLines(frame.pixels.data(), frame.lineVersion.data(), pixels, format, lastSeen, changedLines);
+}
+
+void PPU::PublishFrame(const std::array<uint16_t, 240 * 160>& frame, const std::array<uint64_t, 160>& versions)
+{
+    PresentedFrame& slot = presentedFrames.WriteBuffer();
+    slot.pixels = frame;
+    slot.lineVersion = versions;
+    presentedFrames.Publish();
+}
+
+void PPU::ComposeAndTrackLine(int screenY)
+{
+    //keep the old pixels around so a recomposed line that came out the same isnt reported as changed
+    uint16_t* row = latchedFrame.data() + screenY * 240;
+    std::memcpy(previousLine.data(), row, sizeof(previousLine));
+
+    ComposeScanline(screenY);
+
+    if (std::memcmp(previousLine.data(), row, sizeof(previousLine)) != 0)
+        lineVersion[screenY] = ++lineChangeSequence;
+}
+
+template <size_t... Keys>
+std::array<PPU::ComposeFunction, sizeof...(Keys)> PPU::BuildComposeTable(std::index_sequence<Keys...>)
+{
+    return {{ &PPU::ComposeLine<(Keys & 0x10) != 0, (Keys & 0x08) != 0, (Keys & 0x04) != 0, static_cast<uint8_t>(Keys & 0x3)>... }};
+}
+
+const std::array<PPU::ComposeFunction, 32> PPU::composeTable = PPU::BuildComposeTable(std::make_index_sequence<32>());
+
+uint32_t PPU::VramBlocksForLine(uint16_t dispcnt)
+{
+    uint8_t mode = dispcnt & 0x7;
+
+    //obj tiles live in the top 32KB
+    uint32_t blocks = (dispcnt & 0x9000) ? 0x30u : 0u;
+
+    if (mode == 3)
+        return blocks | 0x1F;
+    if (mode == 4 || mode == 5)
+        return blocks | ((dispcnt & 0x10) ? 0x1Cu : 0x07u);
+
+    auto addRange = [&blocks](uint32_t start, uint32_t length)
+    {
+        uint32_t end = std::min<uint32_t>(start + length, 96 * 1024);
+        for (uint32_t block = start / VRAM_BLOCK_BYTES; block * VRAM_BLOCK_BYTES < end; block++)
+            blocks |= 1u << block;
+    };
+
+    for (int bg = 0; bg < 4; bg++)
+    {
+        if (!(dispcnt & (0x100 << bg)))
+            continue;
+        if ((mode == 1 && bg == 3) || (mode == 2 && bg < 2))
+            continue;
+
+        uint32_t bgCntOffset = 0x08 + bg * 2;
+        uint16_t bgcnt = static_cast<uint16_t>(ioRegisters[bgCntOffset] | (ioRegisters[bgCntOffset + 1] << 8));
+        uint32_t screenBase = ((bgcnt >> 8) & 0x1F) * 0x800u;
+        uint32_t charBase = ((bgcnt >> 2) & 0x3) * 0x4000u;
+        uint32_t sizeMode = (bgcnt >> 14) & 0x3;
+        bool affine = (mode == 1 && bg == 2) || (mode == 2 && bg >= 2);
+
+        if (affine)
+        {
+            //256 8bpp tiles and a 16 to 128 tile square byte map
+            addRange(charBase, 256 * 64);
+            addRange(screenBase, (16u << sizeMode) * (16u << sizeMode));
+        }
+        else
+        {
+            //1024 tiles and one to four 2KB screenblocks
+            addRange(charBase, (bgcnt & 0x80) ? 1024 * 64 : 1024 * 32);
+            addRange(screenBase, (sizeMode == 0 ? 1u : sizeMode == 3 ? 4u : 2u) * 0x800u);
+        }
+    }
+
+    return blocks;
+}
+
+bool PPU::LineUnchanged(int screenY)
+{
+    LineKey key;
+    std::memcpy(key.io.data(), ioRegisters.data(), DISPLAY_IO_BYTES);
+    //dispstat and vcount change by themselves and never reach the compositor
+    std::memset(&key.io[0x004], 0, 4);
+    key.affineRefX = affineRefX;
+    key.affineRefY = affineRefY;
+    key.paletteGeneration = paletteGeneration;
+    key.oamGeneration = oamGeneration;
+
+    uint16_t dispcnt = static_cast<uint16_t>(ioRegisters[0x000] | (ioRegisters[0x001] << 8));
+    uint32_t blocks = VramBlocksForLine(dispcnt);
+    for (uint32_t block = 0; block < VRAM_BLOCKS; block++)
+        key.vramGeneration[block] = (blocks & (1u << block)) ? vramGeneration[block] : 0;
+
+    //raster effects just show up as a different key on the lines they touch
+    if (lineKeyValid[screenY] && std::memcmp(&key, &lineKeys[screenY], sizeof(LineKey)) == 0)
+        return true;
+
+    lineKeys[screenY] = key;
+    lineKeyValid[screenY] = true;
+    return false;
 }
 
 void PPU::ComposeScanline(int screenY)
 {
-    uint32_t* pixels = latchedFrame.data() + screenY * 240;
+    uint16_t* pixels = latchedFrame.data() + screenY * 240;
 
     uint16_t dispcnt = static_cast<uint16_t>(ioRegisters[0x000] | (ioRegisters[0x001] << 8));
     uint8_t mode = dispcnt & 0x7;
@@ -484,44 +1031,64 @@ void PPU::ComposeScanline(int screenY)
     if (dispcnt & 0x80)
     {
         for (int x = 0; x < 240; x++)
-            pixels[x] = 0xFFFFFFFFu;
+            pixels[x] = 0x7FFF;
         return;
     }
 
-    uint32_t backdrop = PaletteColor(false, 0);
-    ResetPixelLine(backdrop);
-
+    bool bitmapMode = (mode == 3 || mode == 4 || mode == 5);
+    bool windowed = (dispcnt & 0xE000) != 0;
     bool objEnabled = (dispcnt & 0x1000) != 0;
-    bool objWinEnabled = (dispcnt & 0x8000) != 0;
-    if (objEnabled || objWinEnabled)
+    uint8_t effect = (ioRegisters[0x050] >> 6) & 0x3;
+
+    uint32_t key = (bitmapMode ? 0x10u : 0u) | (windowed ? 0x08u : 0u) | (objEnabled ? 0x04u : 0u) | effect;
+    (this->*composeTable[key])(screenY, dispcnt, PaletteColor(false, 0));
+}
+
+template <bool Bitmap, bool Windowed, bool ObjPresent, uint8_t Effect>
+void PPU::ComposeLine(int screenY, uint16_t dispcnt, uint16_t backdrop)
+{
+    uint16_t* pixels = latchedFrame.data() + screenY * 240;
+
+    //without sprites or blending the top layer is final, so layers can be painted straight into the frame
+    constexpr bool needsStack = ObjPresent || Effect != 0;
+
+    if (ObjPresent || (Windowed && (dispcnt & 0x8000)))
         BuildSpriteLine(screenY);
+    if (Windowed)
+        BuildWindowLine(screenY);
 
-    if (mode == 3 || mode == 4 || mode == 5)
+    if (Bitmap)
     {
-        for (int x = 0; x < 240; x++)
+        if (!needsStack)
         {
-            uint32_t color;
-            bool opaque = false;
-            if (mode == 3) opaque = SampleBitmapMode3(x, screenY, color);
-            else if (mode == 4) opaque = SampleBitmapMode4(x, screenY, dispcnt, color);
-            else opaque = SampleBitmapMode5(x, screenY, dispcnt, color);
-
-            //BIT MAP!
-            if (opaque)
-                PushPixel(x, color, LAYER_BG2);
+            BuildBitmapLine(screenY, dispcnt, backdrop, pixels);
+            return;
         }
 
-        if (objEnabled)
+        //BIT MAP!
+        ResetPixelLine(backdrop);
+        BuildBitmapLine(screenY, dispcnt, backdrop, backgroundLine.data());
+        for (int x = 0; x < 240; x++)
+            if (backgroundOpaque[x])
+                PushPixel(x, backgroundLine[x], LAYER_BG2);
+
+        if (ObjPresent)
         {
             for (int x = 0; x < 240; x++)
                 if (spriteLine[x].opaque)
                     PushPixel(x, spriteLine[x].color, LAYER_OBJ, spriteLine[x].semiTransparent);
         }
 
-        ApplyColorEffects(screenY);
+        ApplyColorEffects<Windowed, Effect>(pixels);
         return;
     }
 
+    if (needsStack)
+        ResetPixelLine(backdrop);
+    else
+        std::fill(pixels, pixels + 240, backdrop);
+
+    uint8_t mode = dispcnt & 0x7;
     bool bgEnabled[4] = {
         (dispcnt & 0x100) != 0, (dispcnt & 0x200) != 0, (dispcnt & 0x400) != 0, (dispcnt & 0x800) != 0
     };
@@ -547,35 +1114,40 @@ void PPU::ComposeScanline(int screenY)
             if (!bgEnabled[bg] || priority[bg] != p)
                 continue;
 
+            if (isAffine[bg])
+                BuildAffineBackgroundLine(bg);
+            else
+                BuildRegularBackgroundLine(bg, screenY);
+
+            const uint8_t layerBit = static_cast<uint8_t>(1 << bg);
             for (int x = 0; x < 240; x++)
             {
-                if (!(GetWindowLayerMask(x, screenY) & (1 << bg)))
+                if (!backgroundOpaque[x] || (Windowed && !(windowLine[x] & layerBit)))
                     continue;
 
-                uint32_t color;
-                bool opaque = isAffine[bg]
-                    ? SampleAffineBackground(bg, x, screenY, color)
-                    : SampleRegularBackground(bg, x, screenY, color);
-                if (opaque)
-                    PushPixel(x, color, static_cast<uint8_t>(LAYER_BG0 + bg));
+                if (needsStack)
+                    PushPixel(x, backgroundLine[x], static_cast<uint8_t>(LAYER_BG0 + bg));
+                else
+                    pixels[x] = backgroundLine[x];
             }
         }
 
-        if (objEnabled)
+        if (ObjPresent)
         {
             for (int x = 0; x < 240; x++)
             {
                 if (spriteLine[x].opaque && spriteLine[x].priority == p
-                    && (GetWindowLayerMask(x, screenY) & 0x10))
+                    && (!Windowed || (windowLine[x] & 0x10)))
                     PushPixel(x, spriteLine[x].color, LAYER_OBJ, spriteLine[x].semiTransparent);
             }
         }
     }
 
-    ApplyColorEffects(screenY);
+    if (needsStack)
+        ApplyColorEffects<Windowed, Effect>(pixels);
 }
 
-void PPU::ResetPixelLine(uint32_t backdrop)
+void PPU::ResetPixelLine(uint16_t backdrop)
 {
     for (auto& stack : pixelLine)
     {
@@ -587,7 +1159,7 @@ void PPU::ResetPixelLine(uint32_t backdrop)
     }
 }
 
-void PPU::PushPixel(int x, uint32_t color, uint8_t layer, bool semiTransparent)
+void PPU::PushPixel(int x, uint16_t color, uint8_t layer, bool semiTransparent)
 {
     //compositing runs bottom up, so whatever was on top is now the layer underneath
     PixelStack& stack = pixelLine[x];
@@ -598,14 +1170,24 @@ void PPU::PushPixel(int x, uint32_t color, uint8_t layer, bool semiTransparent)
     stack.topSemiTransparent = semiTransparent;
 }
 
-void PPU::ApplyColorEffects(int screenY)
+static void UnpackChannels(uint16_t color, uint32_t& r, uint32_t& g, uint32_t& b)
 {
-    uint32_t* pixels = latchedFrame.data() + screenY * 240;
+    r = color & 0x1F;
+    g = (color >> 5) & 0x1F;
+    b = (color >> 10) & 0x1F;
+}
 
+static uint16_t PackChannels(uint32_t r, uint32_t g, uint32_t b)
+{
+    return static_cast<uint16_t>(r | (g << 5) | (b << 10));
+}
+
+template <bool Windowed, uint8_t Effect>
+void PPU::ApplyColorEffects(uint16_t* pixels)
+{
     const uint16_t bldcnt = static_cast<uint16_t>(ioRegisters[0x050] | (ioRegisters[0x051] << 8));
     const uint16_t bldalpha = static_cast<uint16_t>(ioRegisters[0x052] | (ioRegisters[0x053] << 8));
 
-    const uint8_t effect = (bldcnt >> 6) & 0x3;
     const uint16_t firstTarget = bldcnt & 0x3F;
     const uint16_t secondTarget = (bldcnt >> 8) & 0x3F;
 
@@ -613,71 +1195,54 @@ void PPU::ApplyColorEffects(int screenY)
     const uint32_t evb = std::min<uint32_t>((bldalpha >> 8) & 0x1F, 16);
     const uint32_t evy = std::min<uint32_t>(ioRegisters[0x054] & 0x1F, 16);
 
-    auto channels = [](uint32_t argb, uint32_t& r, uint32_t& g, uint32_t& b)
-    {
-        r = (argb >> 19) & 0x1F;
-        g = (argb >> 11) & 0x1F;
-        b = (argb >> 3) & 0x1F;
-    };
-
-    auto pack = [](uint32_t r, uint32_t g, uint32_t b)
-    {
-        const uint32_t r8 = (r << 3) | (r >> 2);
-        const uint32_t g8 = (g << 3) | (g >> 2);
-        const uint32_t b8 = (b << 3) | (b >> 2);
-        return 0xFF000000u | (r8 << 16) | (g8 << 8) | b8;
-    };
-
     for (int x = 0; x < 240; x++)
     {
-        {
-            const PixelStack& stack = pixelLine[x];
+        const PixelStack& stack = pixelLine[x];
+
+        const bool effectAllowedHere = !Windowed || (windowLine[x] & 0x20) != 0;
 
-            const bool effectAllowedHere = (GetWindowLayerMask(x, screenY) & 0x20) != 0;
+        const bool topIsFirstTarget = (firstTarget & (1u << stack.topLayer)) != 0;
+        const bool secondIsSecondTarget = (secondTarget & (1u << stack.secondLayer)) != 0;
 
-            const bool topIsFirstTarget = (firstTarget & (1u << stack.topLayer)) != 0;
-            const bool secondIsSecondTarget = (secondTarget & (1u << stack.secondLayer)) != 0;
+        //semi transgender
+        const bool semiBlend = stack.topSemiTransparent && secondIsSecondTarget;
 
-            //semi transgender
-            const bool semiBlend = stack.topSemiTransparent && secondIsSecondTarget;
+        uint16_t result = stack.topColor;
 
-            uint32_t result = stack.topColor;
+        if (effectAllowedHere && (semiBlend || (Effect == 1 && topIsFirstTarget && secondIsSecondTarget)))
+        {
+            uint32_t r1, g1, b1, r2, g2, b2;
+            UnpackChannels(stack.topColor, r1, g1, b1);
+            UnpackChannels(stack.secondColor, r2, g2, b2);
+
+            result = PackChannels(
+                std::min<uint32_t>(31, (r1 * eva + r2 * evb) / 16),
+                std::min<uint32_t>(31, (g1 * eva + g2 * evb) / 16),
+                std::min<uint32_t>(31, (b1 * eva + b2 * evb) / 16));
+        }
+        else if (effectAllowedHere && topIsFirstTarget && (Effect == 2 || Effect == 3))
+        {
+            uint32_t r, g, b;
+            UnpackChannels(stack.topColor, r, g, b);
 
-            if (effectAllowedHere && (semiBlend || (effect == 1 && topIsFirstTarget && secondIsSecondTarget)))
+            if (Effect == 2)
             {
-                uint32_t r1, g1, b1, r2, g2, b2;
-                channels(stack.topColor, r1, g1, b1);
-                channels(stack.secondColor, r2, g2, b2);
-
-                result = pack(
-                    std::min<uint32_t>(31, (r1 * eva + r2 * evb) / 16),
-                    std::min<uint32_t>(31, (g1 * eva + g2 * evb) / 16),
-                    std::min<uint32_t>(31, (b1 * eva + b2 * evb) / 16));
+                //brightness increase, fade towards white
+                r += ((31 - r) * evy) / 16;
+                g += ((31 - g) * evy) / 16;
+                b += ((31 - b) * evy) / 16;
             }
-            else if (effectAllowedHere && topIsFirstTarget && (effect == 2 || effect == 3))
+            else
             {
-                uint32_t r, g, b;
-                channels(stack.topColor, r, g, b);
-
-                if (effect == 2)
-                {
-                    //brightness increase, fade towards white
-                    r += ((31 - r) * evy) / 16;
-                    g += ((31 - g) * evy) / 16;
-                    b += ((31 - b) * evy) / 16;
-                }
-                else
-                {
-                    //brightness decrease, fade towards black
-                    r -= (r * evy) / 16;
-                    g -= (g * evy) / 16;
-                    b -= (b * evy) / 16;
-                }
-
-                result = pack(r, g, b);
+                //brightness decrease, fade towards black
+                r -= (r * evy) / 16;
+                g -= (g * evy) / 16;
+                b -= (b * evy) / 16;
             }
 
-            pixels[x] = result;
+            result = PackChannels(r, g, b);
         }
+
+        pixels[x] = result;
     }
 }
@@ -1,6 +1,14 @@
 #pragma once
 #include <array>
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "SaveState.h"
+#include "TripleBuffer.h"
+
+class DeferredRenderer;
 
 class PPU
 {
@@ -9,9 +17,15 @@ public:
         std::array<uint8_t, 96 * 1024>& vram,
         std::array<uint8_t, 1024>& paletteRAM,
         std::array<uint8_t, 1024>& oam);
+    ~PPU();
 
     void Reset();
 
+    //the scanline position, affine reference points and the last composed frame. the caches all start over
+    //after a read and the loaded frame is handed to the presenter straight away
+    void WriteState(SaveState& state);
+    void ReadState(SaveState& state);
+
     struct TickResult
     {
         bool vblankStarted = false;
@@ -20,33 +34,192 @@ public:
 
     TickResult Tick();
 
+    //the frame is composed as bgr555 and only converted on the way out
+    enum class PixelFormat
+    {
+        ARGB8888,
+        RGB565,
+        BGR555
+    };
+
     void RenderFrame(uint32_t* pixels);
+    void RenderFrame(void* pixels, PixelFormat format);
+    static void ConvertFrame(const uint16_t* frame, void* pixels, PixelFormat format);
+
+    //every output line carries the change sequence it was last really altered at. pass the buffer that holds
+    //what you got last time and only lines newer than lastSeen get converted into it, start lastSeen at 0
+    //for a full frame. returns how many lines were written, changedLines (if given) says which
+    int RenderChangedLines(void* pixels, PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines = nullptr);
+    static int ConvertChangedLines(const uint16_t* frame, const uint64_t* lineVersion, void* pixels, PixelFormat format,
+        uint64_t& lastSeen, std::array<bool, 160>* changedLines);
+
+    //same as RenderChangedLines but reads the last frame handed off at vblank, never touches anything the
+    //emulation thread is using so a presenter can call it without holding the emulation lock.
+    //only one thread may present at a time
+    int PresentChangedLines(void* pixels, PixelFormat format, uint64_t& lastSeen, std::array<bool, 160>* changedLines = nullptr);
+
+    //called by the bus on every vram store so the tile cache knows what to re-decode
+    void MarkVramDirty(uint32_t offset)
+    {
+        uint32_t tile = offset / TILE_BYTES_4BPP;
+        dirtyTiles[tile >> 6] |= 1ull << (tile & 63);
+        snapshotDirtyTiles[tile >> 6] |= 1ull << (tile & 63);
+        vramGeneration[offset / VRAM_BLOCK_BYTES]++;
+    }
+
+    //same idea for palette and oam, lets an unchanged line skip composition entirely
+    void MarkPaletteDirty(uint32_t offset)
+    {
+        paletteGeneration++;
+        snapshotDirtyPalette |= 1u << (offset / SNAPSHOT_BLOCK_BYTES);
+    }
+    void MarkOamDirty(uint32_t offset)
+    {
+        oamGeneration++;
+        snapshotDirtyOam |= 1u << (offset / SNAPSHOT_BLOCK_BYTES);
+    }
+
+    //the line cache compares io itself, this is only for the deferred renderer's change log
+    void MarkDisplayIoDirty(uint32_t offset) { snapshotDirtyIo |= 1u << (offset / SNAPSHOT_BLOCK_BYTES); }
+
+    void InvalidateTileCache();
+
+    //a write to BGxX/BGxY reloads that background's internal reference point straight away
+    void OnAffineReferenceWrite(int bgIndex);
+
+    //in deferred mode lines are only snapshotted at hblank and whole frames get composed on worker threads,
+    //RenderFrame then hands out the newest finished frame. 0 workers picks a count from the host
+    void SetDeferredRendering(bool enabled, unsigned workerCount = 0);
+    bool IsDeferredRendering() const { return deferred != nullptr; }
+
+    //waits for the workers to catch up so RenderFrame returns the last frame the cpu finished
+    void FlushDeferredFrames();
+
+    //frame skipping only drops composition, DISPSTAT, VCOUNT, irqs and dma timing carry on exactly the same.
+    //skips skipCount out of every period frames, period 0 turns the pattern off
+    void SetFrameSkip(unsigned skipCount, unsigned period);
+
+    //nobody is going to look at the next frame, dont compose it at all. checked when a frame starts drawing
+    void SetFrameOutputWanted(bool wanted) { frameOutputWanted = wanted; }
+
+    //everything the compositor reads out of io sits below 0x058 (BLDY is the last one)
+    static constexpr size_t DISPLAY_IO_BYTES = 0x058;
+
+    //granularity the deferred renderer logs io, palette and oam writes at
+    static constexpr uint32_t SNAPSHOT_BLOCK_BYTES = 32;
 
 private:
-    std::array<uint32_t, 240 * 160> latchedFrame{};
+    friend class DeferredRenderer;
+    std::unique_ptr<DeferredRenderer> deferred;
+
+    std::array<uint16_t, 240 * 160> latchedFrame{};
     void ComposeScanline(int screenY);
 
+    struct PresentedFrame
+    {
+        std::array<uint16_t, 240 * 160> pixels;
+        std::array<uint64_t, 160> lineVersion;
+    };
+    TripleBuffer<PresentedFrame> presentedFrames;
+    void PublishFrame(const std::array<uint16_t, 240 * 160>& frame, const std::array<uint64_t, 160>& versions);
+
+    //decided once at line 0 so a frame is never half composed
+    unsigned frameSkipCount = 0;
+    unsigned frameSkipPeriod = 0;
+    uint64_t frameIndex = 0;
+    bool frameOutputWanted = true;
+    bool composingFrame = true;
+    bool ShouldComposeFrame();
+
+    //shared with the deferred workers so versions stay comparable when switching modes
+    std::atomic<uint64_t> lineChangeSequence{0};
+    std::array<uint64_t, 160> lineVersion{};
+    std::array<uint16_t, 240> previousLine;
+    void ComposeAndTrackLine(int screenY);
+
+    //vram is tracked in 16KB blocks, a line only depends on the blocks its backgrounds and sprites can reach
+    static constexpr uint32_t VRAM_BLOCK_BYTES = 16 * 1024;
+    static constexpr uint32_t VRAM_BLOCKS = 96 * 1024 / VRAM_BLOCK_BYTES;
+    std::array<uint64_t, VRAM_BLOCKS> vramGeneration{};
+    uint64_t paletteGeneration = 0;
+    uint64_t oamGeneration = 0;
+
+    //every input a line's pixels depend on, laid out without padding so it can be memcmp'd.
+    //if it matches what the line saw last frame the pixels already in latchedFrame are still right
+    struct LineKey
+    {
+        std::array<uint8_t, DISPLAY_IO_BYTES> io;
+        std::array<int32_t, 2> affineRefX;
+        std::array<int32_t, 2> affineRefY;
+        uint64_t paletteGeneration;
+        uint64_t oamGeneration;
+        std::array<uint64_t, VRAM_BLOCKS> vramGeneration;
+    };
+    std::array<LineKey, 160> lineKeys;
+    std::array<bool, 160> lineKeyValid{};
+    bool LineUnchanged(int screenY);
+    uint32_t VramBlocksForLine(uint16_t dispcnt);
+    void InvalidateLineCache() { lineKeyValid.fill(false); }
+
+    //one compositor per feature set a line can use, picked per scanline
+    //key bits: 4 = bitmap mode, 3 = any window, 2 = OBJ, 1-0 = BLDCNT effect
+    typedef void (PPU::*ComposeFunction)(int screenY, uint16_t dispcnt, uint16_t backdrop);
+    static const std::array<ComposeFunction, 32> composeTable;
+
+    template <size_t... Keys>
+    static std::array<ComposeFunction, sizeof...(Keys)> BuildComposeTable(std::index_sequence<Keys...>);
+
+    template <bool Bitmap, bool Windowed, bool ObjPresent, uint8_t Effect>
+    void ComposeLine(int screenY, uint16_t dispcnt, uint16_t backdrop);
+
     static uint32_t Bgr555ToArgb(uint16_t color);
-    uint32_t PaletteColor(bool obj, int index);
-    bool SampleRegularBackground(int bgIndex, int screenX, int screenY, uint32_t& outColor);
-    bool SampleAffineBackground(int bgIndex, int screenX, int screenY, uint32_t& outColor);
-    bool SampleBitmapMode3(int screenX, int screenY, uint32_t& outColor);
-    bool SampleBitmapMode4(int screenX, int screenY, uint16_t dispcnt, uint32_t& outColor);
-    bool SampleBitmapMode5(int screenX, int screenY, uint16_t dispcnt, uint32_t& outColor);
+    uint16_t PaletteColor(bool obj, int index);
+    void BuildRegularBackgroundLine(int bgIndex, int screenY);
+    void BuildAffineBackgroundLine(int bgIndex);
+    static void ConvertBgr555Line(const uint16_t* source, uint32_t* destination, int count);
+    static void ConvertBgr555LineToRgb565(const uint16_t* source, uint16_t* destination, int count);
+    static void ConvertLine(const uint16_t* frame, void* pixels, PixelFormat format, int screenY);
+    void BuildBitmapLine(int screenY, uint16_t dispcnt, uint16_t backdrop, uint16_t* out);
 
     //im ngl i dont know why i made this a struct, i think it was like easier or something.... idk
     struct SpritePixel
     {
-        uint32_t color = 0;
+        uint16_t color = 0;
         uint8_t priority = 0;
         bool opaque = false;
         bool semiTransparent = false;
     };
+    //integer texture coordinates for count pixels stepping by PA/PC, the buffers are filled in blocks of 8
+    static void StepAffineSpan(int32_t x, int32_t y, int32_t pa, int32_t pc, int count, int32_t* texX, int32_t* texY);
     void BuildSpriteLine(int screenY);
 
+    //internal BG2X/BG2Y and BG3X/BG3Y, latched at vblank and stepped by PB/PD after every drawn line
+    std::array<int32_t, 2> affineRefX{};
+    std::array<int32_t, 2> affineRefY{};
+    void LatchAffineReferences();
+    void StepAffineReferences();
+
+    std::array<uint16_t, 240> backgroundLine;
+    std::array<bool, 240> backgroundOpaque;
+
+    //4bpp tiles unpacked to one palette index per byte, 8bpp tiles are already laid out that way in vram
+    static constexpr uint32_t TILE_BYTES_4BPP = 32;
+    static constexpr uint32_t TILE_COUNT = 96 * 1024 / TILE_BYTES_4BPP;
+    std::array<uint8_t, TILE_COUNT * 64> decodedTiles{};
+    std::array<uint64_t, TILE_COUNT / 64> dirtyTiles{};
+    //same thing but cleared by the deferred renderer at every line it records
+    std::array<uint64_t, TILE_COUNT / 64> snapshotDirtyTiles{};
+    uint32_t snapshotDirtyIo = 0;
+    uint32_t snapshotDirtyPalette = 0;
+    uint32_t snapshotDirtyOam = 0;
+    const uint8_t* DecodedTile4bpp(uint32_t tileAddr);
+
     uint8_t GetWindowLayerMask(int x, int y);
     bool PointInWindow(int index, int x, int y);
 
+    std::array<uint8_t, 240> windowLine;
+    void BuildWindowLine(int screenY);
+
     enum LayerId : uint8_t
     {
         LAYER_BG0 = 0,
@@ -59,18 +232,19 @@ private:
     
     struct PixelStack
     {
-        uint32_t topColor = 0;
-        uint32_t secondColor = 0;
+        uint16_t topColor = 0;
+        uint16_t secondColor = 0;
         uint8_t topLayer = LAYER_BACKDROP;
         uint8_t secondLayer = LAYER_BACKDROP;
         bool topSemiTransparent = false;
     };
     std::array<PixelStack, 240> pixelLine;
 
-    void ResetPixelLine(uint32_t backdrop);
-    void PushPixel(int x, uint32_t color, uint8_t layer, bool semiTransparent = false);
+    void ResetPixelLine(uint16_t backdrop);
+    void PushPixel(int x, uint16_t color, uint8_t layer, bool semiTransparent = false);
 
-    void ApplyColorEffects(int screenY);
+    template <bool Windowed, uint8_t Effect>
+    void ApplyColorEffects(uint16_t* pixels);
 
     std::array<uint8_t, 1024>& ioRegisters;
     std::array<uint8_t, 96 * 1024>& vram;
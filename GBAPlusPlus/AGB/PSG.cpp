@@ -0,0 +1,558 @@
+#include "PSG.h"
+
+#include <algorithm>
+
+namespace
+{
+    //which of the 8 steps are high for each duty setting, 12.5% 25% 50% 75%
+    const uint8_t DUTY_PATTERNS[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+    //bits the cpu can read back from 0x060 to 0x081. lengths, frequencies and the trigger bits are write only
+    //and the gaps between registers read as zero
+    const uint8_t READ_MASKS[0x22] =
+    {
+        0x7F, 0x00, 0xC0, 0xFF, 0x00, 0x40, 0x00, 0x00, //SOUND1CNT_L, _H, _X
+        0xC0, 0xFF, 0x00, 0x00, 0x00, 0x40, 0x00, 0x00, //SOUND2CNT_L, _H
+        0xE0, 0x00, 0x00, 0xE0, 0x00, 0x40, 0x00, 0x00, //SOUND3CNT_L, _H, _X
+        0x00, 0xFF, 0x00, 0x00, 0xFF, 0x40, 0x00, 0x00, //SOUND4CNT_L, _H
+        0x77, 0xFF,                                     //SOUNDCNT_L
+    };
+}
+
+void PSG::Envelope::Load(uint8_t value)
+{
+    initialVolume = static_cast<uint8_t>(value >> 4);
+    increase = (value & 0x08) != 0;
+    period = static_cast<uint8_t>(value & 0x07);
+}
+
+void PSG::Envelope::Trigger()
+{
+    volume = initialVolume;
+    timer = period ? period : 8;
+}
+
+void PSG::Envelope::Clock()
+{
+    if (period == 0)
+        return;
+
+    if (--timer != 0)
+        return;
+
+    timer = period;
+    if (increase && volume < 15)
+        volume++;
+    else if (!increase && volume > 0)
+        volume--;
+}
+
+PSG::PSG(std::array<uint8_t, 1024>& ioRegisters, uint32_t cyclesPerSample)
+    : cyclesPerSample(cyclesPerSample)
+    , blipLeft(cyclesPerSample)
+    , blipRight(cyclesPerSample)
+    , ioRegisters(ioRegisters)
+{
+    Reset();
+}
+
+void PSG::Reset()
+{
+    square1 = Square();
+    square2 = Square();
+    wave = Wave();
+    noise = Noise();
+    waveRam.fill(0);
+
+    now = 0;
+    sequencerCountdown = SEQUENCER_PERIOD;
+    sequencerStep = 0;
+
+    blipLeft.Clear();
+    blipRight.Clear();
+    mixedLeft = 0;
+    mixedRight = 0;
+}
+
+void PSG::WriteState(SaveState& state) const
+{
+    state.Write(square1);
+    state.Write(square2);
+    state.Write(wave);
+    state.Write(noise);
+    state.Write(waveRam);
+
+    state.Write(now);
+    state.Write(sequencerCountdown);
+    state.Write(sequencerStep);
+
+    blipLeft.WriteState(state);
+    blipRight.WriteState(state);
+    state.Write(mixedLeft);
+    state.Write(mixedRight);
+}
+
+void PSG::ReadState(SaveState& state)
+{
+    //anything that indexes a table or the wave ram, gets shifted by, or would make a period of zero and have
+    //RunUntil spin forever
+    auto isValidSquare = [](const Square& square) {
+        return square.duty < 4 && square.dutyStep < 8 && square.sweepShift < 8 && square.frequency < 2048;
+    };
+    state.ReadChecked(square1, isValidSquare);
+    state.ReadChecked(square2, isValidSquare);
+    state.ReadChecked(wave, [](const Wave& saved) {
+        return saved.bank < 2 && saved.position < 64 && saved.volumeCode < 4 && saved.frequency < 2048;
+    });
+    state.ReadChecked(noise, [](const Noise& saved) { return saved.divisorCode < 8 && saved.shift < 16; });
+    state.Read(waveRam);
+
+    const uint32_t samplePeriod = cyclesPerSample;
+    state.ReadChecked(now, [samplePeriod](uint32_t time) { return time <= samplePeriod; });
+    state.Read(sequencerCountdown);
+    state.Read(sequencerStep);
+
+    blipLeft.ReadState(state);
+    blipRight.ReadState(state);
+    state.Read(mixedLeft);
+    state.Read(mixedRight);
+}
+
+bool PSG::IsPsgOffset(uint32_t offset)
+{
+    return (offset >= 0x060 && offset < 0x082) || IsWaveRamOffset(offset);
+}
+
+uint8_t PSG::ReadRegister(uint32_t offset) const
+{
+    if (IsWaveRamOffset(offset))
+        return ReadWaveRam(offset);
+
+    return static_cast<uint8_t>(ioRegisters[offset] & READ_MASKS[offset - 0x060]);
+}
+
+uint8_t PSG::ReadWaveRam(uint32_t offset) const
+{
+    //the cpu always sees the bank that isn't playing
+    return waveRam[(wave.bank ^ 1) * 16 + (offset - 0x090)];
+}
+
+void PSG::WriteRegister(uint32_t offset, uint8_t value, uint32_t time)
+{
+    RunUntil(time);
+
+    if (IsWaveRamOffset(offset))
+    {
+        waveRam[(wave.bank ^ 1) * 16 + (offset - 0x090)] = value;
+        return;
+    }
+
+    //with the master enable off the psg registers are stuck at zero
+    if (!(ioRegisters[0x084] & 0x80))
+        return;
+
+    ioRegisters[offset] = value;
+
+    switch (offset)
+    {
+        case 0x060:
+            square1.sweepShift = static_cast<uint8_t>(value & 0x07);
+            square1.sweepDecrease = (value & 0x08) != 0;
+            square1.sweepPeriod = static_cast<uint8_t>((value >> 4) & 0x07);
+            break;
+
+        case 0x062:
+        case 0x068:
+        {
+            Square& square = offset == 0x062 ? square1 : square2;
+            square.lengthCounter = static_cast<uint16_t>(64 - (value & 0x3F));
+            square.duty = static_cast<uint8_t>(value >> 6);
+            break;
+        }
+
+        case 0x063:
+        case 0x069:
+        {
+            Square& square = offset == 0x063 ? square1 : square2;
+            square.envelope.Load(value);
+            if (!square.envelope.DacEnabled())
+                square.enabled = false;
+            break;
+        }
+
+        case 0x064:
+        case 0x06C:
+        {
+            Square& square = offset == 0x064 ? square1 : square2;
+            square.frequency = static_cast<uint16_t>((square.frequency & 0x700) | value);
+            break;
+        }
+
+        case 0x065:
+        case 0x06D:
+        {
+            Square& square = offset == 0x065 ? square1 : square2;
+            square.frequency = static_cast<uint16_t>((square.frequency & 0xFF) | ((value & 0x07) << 8));
+            square.lengthEnabled = (value & 0x40) != 0;
+            if (value & 0x80)
+                TriggerSquare(square, offset == 0x065);
+            ioRegisters[offset] &= 0x7F;
+            break;
+        }
+
+        case 0x070:
+            wave.twoBanks = (value & 0x20) != 0;
+            wave.bank = static_cast<uint8_t>((value >> 6) & 0x01);
+            wave.dacEnabled = (value & 0x80) != 0;
+            if (!wave.dacEnabled)
+                wave.enabled = false;
+            break;
+
+        case 0x072:
+            wave.lengthCounter = static_cast<uint16_t>(256 - value);
+            break;
+
+        case 0x073:
+            wave.volumeCode = static_cast<uint8_t>((value >> 5) & 0x03);
+            wave.forceThreeQuarters = (value & 0x80) != 0;
+            break;
+
+        case 0x074:
+            wave.frequency = static_cast<uint16_t>((wave.frequency & 0x700) | value);
+            break;
+
+        case 0x075:
+            wave.frequency = static_cast<uint16_t>((wave.frequency & 0xFF) | ((value & 0x07) << 8));
+            wave.lengthEnabled = (value & 0x40) != 0;
+            if (value & 0x80)
+                TriggerWave();
+            ioRegisters[offset] &= 0x7F;
+            break;
+
+        case 0x078:
+            noise.lengthCounter = static_cast<uint16_t>(64 - (value & 0x3F));
+            break;
+
+        case 0x079:
+            noise.envelope.Load(value);
+            if (!noise.envelope.DacEnabled())
+                noise.enabled = false;
+            break;
+
+        case 0x07C:
+            noise.divisorCode = static_cast<uint8_t>(value & 0x07);
+            noise.sevenBit = (value & 0x08) != 0;
+            noise.shift = static_cast<uint8_t>(value >> 4);
+            break;
+
+        case 0x07D:
+            noise.lengthEnabled = (value & 0x40) != 0;
+            if (value & 0x80)
+                TriggerNoise();
+            ioRegisters[offset] &= 0x7F;
+            break;
+
+        default:
+            //SOUNDCNT_L and the unused gaps, the mix below picks SOUNDCNT_L up
+            break;
+    }
+
+    UpdateSquareOutput(square1);
+    UpdateSquareOutput(square2);
+    UpdateWaveOutput();
+    UpdateNoiseOutput();
+    Remix();
+    UpdateStatus();
+}
+
+void PSG::OnMixerWrite()
+{
+    Remix();
+}
+
+void PSG::PowerOff()
+{
+    square1 = Square();
+    square2 = Square();
+    wave = Wave();
+    noise = Noise();
+
+    std::fill(ioRegisters.begin() + 0x060, ioRegisters.begin() + 0x082, 0);
+
+    Remix();
+    UpdateStatus();
+}
+
+void PSG::TriggerSquare(Square& square, bool hasSweep)
+{
+    square.enabled = square.envelope.DacEnabled();
+    if (square.lengthCounter == 0)
+        square.lengthCounter = 64;
+    square.countdown = SquarePeriod(square);
+    square.envelope.Trigger();
+
+    if (!hasSweep)
+        return;
+
+    square.shadowFrequency = square.frequency;
+    square.sweepTimer = square.sweepPeriod ? square.sweepPeriod : 8;
+    square.sweepEnabled = square.sweepPeriod != 0 || square.sweepShift != 0;
+    if (square.sweepShift != 0)
+        NextSweepFrequency();
+}
+
+void PSG::TriggerWave()
+{
+    wave.enabled = wave.dacEnabled;
+    if (wave.lengthCounter == 0)
+        wave.lengthCounter = 256;
+    wave.countdown = WavePeriod();
+    wave.position = 0;
+}
+
+void PSG::TriggerNoise()
+{
+    noise.enabled = noise.envelope.DacEnabled();
+    if (noise.lengthCounter == 0)
+        noise.lengthCounter = 64;
+    noise.countdown = NoisePeriod();
+    noise.lfsr = noise.sevenBit ? 0x7F : 0x7FFF;
+    noise.envelope.Trigger();
+}
+
+uint32_t PSG::NoisePeriod() const
+{
+    //shifts 14 and 15 are prohibited and never clock at all
+    if (noise.shift >= 14)
+        return 0x80000000u;
+
+    uint32_t divisor = noise.divisorCode ? noise.divisorCode * 16u : 8u;
+    return (divisor << noise.shift) * 4u;
+}
+
+uint16_t PSG::NextSweepFrequency()
+{
+    uint16_t delta = static_cast<uint16_t>(square1.shadowFrequency >> square1.sweepShift);
+    int32_t next = square1.sweepDecrease ? square1.shadowFrequency - delta : square1.shadowFrequency + delta;
+    if (next > 2047)
+        square1.enabled = false;
+    return static_cast<uint16_t>(std::max(next, 0));
+}
+
+void PSG::ClockSweep()
+{
+    if (square1.sweepTimer == 0 || --square1.sweepTimer != 0)
+        return;
+
+    square1.sweepTimer = square1.sweepPeriod ? square1.sweepPeriod : 8;
+    if (!square1.sweepEnabled || square1.sweepPeriod == 0)
+        return;
+
+    uint16_t next = NextSweepFrequency();
+    if (next <= 2047 && square1.sweepShift != 0)
+    {
+        square1.shadowFrequency = next;
+        square1.frequency = next;
+        //overflow gets checked again straight away with the new value
+        NextSweepFrequency();
+    }
+}
+
+void PSG::ClockLength(Channel& channel)
+{
+    if (channel.lengthEnabled && channel.lengthCounter > 0 && --channel.lengthCounter == 0)
+        channel.enabled = false;
+}
+
+void PSG::ClockSequencer()
+{
+    //512hz, length on every other step, sweep on 2 and 6, envelopes on 7
+    if ((sequencerStep & 1) == 0)
+    {
+        ClockLength(square1);
+        ClockLength(square2);
+        ClockLength(wave);
+        ClockLength(noise);
+    }
+
+    if (sequencerStep == 2 || sequencerStep == 6)
+        ClockSweep();
+
+    if (sequencerStep == 7)
+    {
+        square1.envelope.Clock();
+        square2.envelope.Clock();
+        noise.envelope.Clock();
+    }
+
+    sequencerStep = static_cast<uint8_t>((sequencerStep + 1) & 7);
+
+    UpdateSquareOutput(square1);
+    UpdateSquareOutput(square2);
+    UpdateWaveOutput();
+    UpdateNoiseOutput();
+    UpdateStatus();
+}
+
+void PSG::UpdateSquareOutput(Square& square)
+{
+    if (!square.enabled)
+    {
+        square.output = 0;
+        return;
+    }
+
+    //centred on zero so a channel starting or stopping doesn't thump
+    int32_t level = square.envelope.volume * 4;
+    bool high = (DUTY_PATTERNS[square.duty] >> square.dutyStep) & 1;
+    square.output = high ? level : -level;
+}
+
+void PSG::UpdateWaveOutput()
+{
+    if (!wave.enabled)
+    {
+        wave.output = 0;
+        return;
+    }
+
+    //two bank mode starts on the selected bank and runs on into the other one. the wrap also covers leaving
+    //two bank mode partway through the second bank, position only goes back under 32 on the next trigger
+    uint32_t index = (wave.bank * 32u + wave.position) & 63u;
+    uint8_t packed = waveRam[index >> 1];
+    int32_t sample = (index & 1) ? (packed & 0x0F) : (packed >> 4);
+
+    //quarter steps, 100% 50% 25% or the forced 75%
+    static const int32_t volumeQuarters[4] = { 0, 4, 2, 1 };
+    int32_t quarters = wave.forceThreeQuarters ? 3 : volumeQuarters[wave.volumeCode];
+    wave.output = (sample * 2 - 15) * quarters;
+}
+
+void PSG::UpdateNoiseOutput()
+{
+    if (!noise.enabled)
+    {
+        noise.output = 0;
+        return;
+    }
+
+    int32_t level = noise.envelope.volume * 4;
+    noise.output = (noise.lfsr & 1) ? -level : level;
+}
+
+void PSG::RunUntil(uint32_t time)
+{
+    while (now < time)
+    {
+        //jump straight to whichever comes first, the next waveform step, the sequencer or the target
+        uint32_t step = std::min(time - now, sequencerCountdown);
+        if (square1.enabled) step = std::min(step, square1.countdown);
+        if (square2.enabled) step = std::min(step, square2.countdown);
+        if (wave.enabled) step = std::min(step, wave.countdown);
+        if (noise.enabled) step = std::min(step, noise.countdown);
+
+        now += step;
+        sequencerCountdown -= step;
+
+        bool changed = false;
+
+        if (square1.enabled && (square1.countdown -= step) == 0)
+        {
+            square1.countdown = SquarePeriod(square1);
+            square1.dutyStep = static_cast<uint8_t>((square1.dutyStep + 1) & 7);
+            UpdateSquareOutput(square1);
+            changed = true;
+        }
+
+        if (square2.enabled && (square2.countdown -= step) == 0)
+        {
+            square2.countdown = SquarePeriod(square2);
+            square2.dutyStep = static_cast<uint8_t>((square2.dutyStep + 1) & 7);
+            UpdateSquareOutput(square2);
+            changed = true;
+        }
+
+        if (wave.enabled && (wave.countdown -= step) == 0)
+        {
+            wave.countdown = WavePeriod();
+            wave.position = static_cast<uint8_t>((wave.position + 1) & (wave.twoBanks ? 63 : 31));
+            UpdateWaveOutput();
+            changed = true;
+        }
+
+        if (noise.enabled && (noise.countdown -= step) == 0)
+        {
+            noise.countdown = NoisePeriod();
+            uint16_t feedback = static_cast<uint16_t>((noise.lfsr ^ (noise.lfsr >> 1)) & 1);
+            noise.lfsr = static_cast<uint16_t>((noise.lfsr >> 1) | (feedback << 14));
+            if (noise.sevenBit)
+                noise.lfsr = static_cast<uint16_t>((noise.lfsr & ~0x40) | (feedback << 6));
+            UpdateNoiseOutput();
+            changed = true;
+        }
+
+        if (sequencerCountdown == 0)
+        {
+            sequencerCountdown = SEQUENCER_PERIOD;
+            ClockSequencer();
+            changed = true;
+        }
+
+        if (changed)
+            Remix();
+    }
+}
+
+void PSG::Remix()
+{
+    int32_t left = 0;
+    int32_t right = 0;
+
+    if (ioRegisters[0x084] & 0x80)
+    {
+        uint8_t volumes = ioRegisters[0x080];
+        uint8_t enables = ioRegisters[0x081];
+        const int32_t outputs[4] = { square1.output, square2.output, wave.output, noise.output };
+
+        for (int channel = 0; channel < 4; channel++)
+        {
+            if (enables & (1 << channel))
+                right += outputs[channel];
+            if (enables & (0x10 << channel))
+                left += outputs[channel];
+        }
+
+        //master volume 1 to 8, then SOUNDCNT_H's 25/50/100% (3 is prohibited, treated as 100%).
+        //channels are in quarter steps, this lands all four flat out at about what one fifo makes
+        uint32_t ratio = std::min<uint32_t>(ioRegisters[0x082] & 0x03, 2);
+        right *= ((volumes & 0x07) + 1) * (2 << ratio);
+        left *= (((volumes >> 4) & 0x07) + 1) * (2 << ratio);
+    }
+
+    if (left != mixedLeft)
+    {
+        blipLeft.AddDelta(now, left - mixedLeft);
+        mixedLeft = left;
+    }
+
+    if (right != mixedRight)
+    {
+        blipRight.AddDelta(now, right - mixedRight);
+        mixedRight = right;
+    }
+}
+
+void PSG::UpdateStatus()
+{
+    uint8_t status = static_cast<uint8_t>((square1.enabled ? 0x01 : 0) | (square2.enabled ? 0x02 : 0)
+        | (wave.enabled ? 0x04 : 0) | (noise.enabled ? 0x08 : 0));
+    ioRegisters[0x084] = static_cast<uint8_t>((ioRegisters[0x084] & 0xF0) | status);
+}
+
+void PSG::EndSample(int32_t& left, int32_t& right)
+{
+    RunUntil(cyclesPerSample);
+    left = blipLeft.ReadSample();
+    right = blipRight.ReadSample();
+    now -= cyclesPerSample;
+}
@@ -0,0 +1,147 @@
+#pragma once
+#include <array>
+#include <cstdint>
+
+#include "BlipBuffer.h"
+#include "SaveState.h"
+
+//the four game boy channels (two squares, wave, noise). nothing runs per cycle, the channels are caught up to
+//the current time whenever something could change them and only the moments their output actually changes
+//turn into steps in the blip buffers
+class PSG
+{
+public:
+    PSG(std::array<uint8_t, 1024>& ioRegisters, uint32_t cyclesPerSample);
+
+    void Reset();
+
+    void WriteState(SaveState& state) const;
+    void ReadState(SaveState& state);
+
+    //0x060 to 0x081 plus wave ram
+    static bool IsPsgOffset(uint32_t offset);
+    static bool IsWaveRamOffset(uint32_t offset) { return offset >= 0x090 && offset < 0x0A0; }
+
+    //time is in cycles since the start of the sample EndSample hands out next. anything about to change
+    //what the psg sounds like has to run it up to the moment of the change first
+    void RunUntil(uint32_t time);
+
+    //runs up to time itself
+    void WriteRegister(uint32_t offset, uint8_t value, uint32_t time);
+    //what the cpu sees, with the write only bits masked off
+    uint8_t ReadRegister(uint32_t offset) const;
+    uint8_t ReadWaveRam(uint32_t offset) const;
+
+    //SOUNDCNT_H or the master enable changed, redoes the mix from wherever RunUntil left off
+    void OnMixerWrite();
+
+    //master enable went off, every psg register clears and stays that way until it comes back
+    void PowerOff();
+
+    //runs to the end of the current sample and hands back its band-limited output,
+    //in the same x64 10-bit units the fifos are mixed in
+    void EndSample(int32_t& left, int32_t& right);
+
+private:
+    struct Envelope
+    {
+        uint8_t initialVolume = 0;
+        bool increase = false;
+        uint8_t period = 0;
+        uint8_t volume = 0;
+        uint8_t timer = 0;
+
+        void Load(uint8_t value);
+        void Trigger();
+        void Clock();
+        bool DacEnabled() const { return initialVolume != 0 || increase; }
+    };
+
+    struct Channel
+    {
+        bool enabled = false;
+        bool lengthEnabled = false;
+        uint16_t lengthCounter = 0;
+        uint16_t frequency = 0;
+        //cycles until the waveform moves on
+        uint32_t countdown = 0;
+        //-60..60 in quarter steps so the wave channel's 75% volume stays exact
+        int32_t output = 0;
+    };
+
+    struct Square : Channel
+    {
+        Envelope envelope;
+        uint8_t duty = 0;
+        uint8_t dutyStep = 0;
+
+        //channel 1 only
+        uint8_t sweepShift = 0;
+        bool sweepDecrease = false;
+        uint8_t sweepPeriod = 0;
+        uint8_t sweepTimer = 0;
+        bool sweepEnabled = false;
+        uint16_t shadowFrequency = 0;
+    };
+
+    struct Wave : Channel
+    {
+        bool dacEnabled = false;
+        bool twoBanks = false;
+        uint8_t bank = 0;
+        uint8_t volumeCode = 0;
+        bool forceThreeQuarters = false;
+        uint8_t position = 0;
+    };
+
+    struct Noise : Channel
+    {
+        Envelope envelope;
+        uint8_t divisorCode = 0;
+        bool sevenBit = false;
+        uint8_t shift = 0;
+        uint16_t lfsr = 0x7FFF;
+    };
+
+    static constexpr uint32_t SEQUENCER_PERIOD = 32768;
+
+    void ClockSequencer();
+    void ClockLength(Channel& channel);
+    void ClockSweep();
+    uint16_t NextSweepFrequency();
+
+    void TriggerSquare(Square& square, bool hasSweep);
+    void TriggerWave();
+    void TriggerNoise();
+
+    static uint32_t SquarePeriod(const Square& square) { return (2048u - square.frequency) * 16u; }
+    uint32_t WavePeriod() const { return (2048u - wave.frequency) * 8u; }
+    uint32_t NoisePeriod() const;
+
+    void UpdateSquareOutput(Square& square);
+    void UpdateWaveOutput();
+    void UpdateNoiseOutput();
+
+    //recomputes both sides from the channel outputs and pushes any change into the blip buffers
+    void Remix();
+    void UpdateStatus();
+
+    Square square1;
+    Square square2;
+    Wave wave;
+    Noise noise;
+
+    std::array<uint8_t, 32> waveRam{};
+
+    uint32_t now = 0;
+    uint32_t sequencerCountdown = SEQUENCER_PERIOD;
+    uint8_t sequencerStep = 0;
+
+    const uint32_t cyclesPerSample;
+    BlipBuffer blipLeft;
+    BlipBuffer blipRight;
+    int32_t mixedLeft = 0;
+    int32_t mixedRight = 0;
+
+    std::array<uint8_t, 1024>& ioRegisters;
+};
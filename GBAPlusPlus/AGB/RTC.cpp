@@ -30,6 +30,38 @@ void RTC::Reset()
     statusRegister = 0x40;
 }
 
+void RTC::WriteState(SaveState& state) const
+{
+    state.BeginSection("RTC");
+    state.Write(gpioData);
+    state.Write(gpioDirection);
+    state.Write(gpioReadEnable);
+    state.Write(phase);
+    state.Write(bitCount);
+    state.Write(shiftRegister);
+    state.Write(activeCommand);
+    state.Write(activeRegister);
+    state.Write(dataBuffer);
+    state.Write(dataLength);
+    state.Write(statusRegister);
+}
+
+void RTC::ReadState(SaveState& state)
+{
+    state.Read(gpioData);
+    state.Read(gpioDirection);
+    state.Read(gpioReadEnable);
+    //a negative bit count would write in front of dataBuffer
+    state.ReadChecked(phase, [](Phase saved) { return saved >= Phase::Idle && saved <= Phase::Done; });
+    state.ReadChecked(bitCount, [](int count) { return count >= 0 && count <= 7 * 8; });
+    state.Read(shiftRegister);
+    state.Read(activeCommand);
+    state.Read(activeRegister);
+    state.Read(dataBuffer);
+    state.ReadChecked(dataLength, [](int length) { return length >= 0 && length <= 7; });
+    state.Read(statusRegister);
+}
+
 bool RTC::IsReadEnabled() const
 {
     return (gpioReadEnable & 0x1) != 0;
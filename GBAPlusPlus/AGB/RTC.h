@@ -1,6 +1,8 @@
 #pragma once
 #include <cstdint>
 
+#include "SaveState.h"
+
 //Seiko S-3511A or something
 class RTC
 {
@@ -9,6 +11,10 @@ public:
 
     void Reset();
 
+    //the gpio pins and wherever the serial transfer was. the time itself is always read from the host
+    void WriteState(SaveState& state) const;
+    void ReadState(SaveState& state);
+
     uint8_t ReadRegister(uint32_t address) const;
     void WriteRegister(uint32_t address, uint8_t value);
 
@@ -0,0 +1,328 @@
+#include "Resampler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+
+//sse2 is always there on x64, avx only when the compiler was told it can use it (/arch:AVX)
+#if defined(__AVX__)
+#define RESAMPLER_USE_AVX
+#include <immintrin.h>
+#elif defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define RESAMPLER_USE_SSE
+#include <emmintrin.h>
+#endif
+
+constexpr size_t Resampler::MAX_BLOCK_FRAMES;
+
+namespace
+{
+    const double PI = 3.14159265358979323846;
+
+    //modified bessel function of the first kind, order 0. the series is done long before 30 terms
+    double BesselI0(double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int k = 1; k < 30; k++)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    double Sinc(double x)
+    {
+        return std::fabs(x) < 1e-9 ? 1.0 : std::sin(PI * x) / (PI * x);
+    }
+
+    int16_t ToSample(float value)
+    {
+        long scaled = std::lrint(value * 32768.0f);
+        return static_cast<int16_t>(std::max(-32768L, std::min(scaled, 32767L)));
+    }
+
+#if defined(RESAMPLER_USE_AVX) || defined(RESAMPLER_USE_SSE)
+    float HorizontalSum(__m128 value)
+    {
+        __m128 high = _mm_movehl_ps(value, value);
+        __m128 pair = _mm_add_ps(value, high);
+        __m128 odd = _mm_shuffle_ps(pair, pair, 0x55);
+        return _mm_cvtss_f32(_mm_add_ss(pair, odd));
+    }
+#endif
+}
+
+Resampler::Resampler()
+{
+    Configure(1.0, 1.0, Quality::Balanced);
+}
+
+size_t Resampler::TapsFor(Quality quality)
+{
+    //multiples of 8 so the simd loops never need a tail
+    switch (quality)
+    {
+        case Quality::Fast: return 8;
+        case Quality::High: return 32;
+        default: return 16;
+    }
+}
+
+size_t Resampler::PhasesFor(Quality quality)
+{
+    //the position snaps to the nearest phase, more of them means less timing jitter on the output
+    switch (quality)
+    {
+        case Quality::Fast: return 64;
+        case Quality::High: return 1024;
+        default: return 256;
+    }
+}
+
+void Resampler::Configure(double inputRate, double outputRate, Quality quality)
+{
+    this->inputRate = inputRate;
+    this->outputRate = outputRate;
+    this->quality = quality;
+    step = inputRate / outputRate;
+    taps = TapsFor(quality);
+    phases = PhasesFor(quality);
+
+    BuildFilter();
+
+    capacity = taps + MAX_BLOCK_FRAMES;
+    left.assign(capacity * 2, 0.0f);
+    right.assign(capacity * 2, 0.0f);
+    Reset();
+}
+
+void Resampler::BuildFilter()
+{
+    //short filters get a wider transition band, otherwise the stopband goes to pieces
+    double rolloff;
+    double beta;
+    switch (quality)
+    {
+        case Quality::Fast: rolloff = 0.80; beta = 5.0; break;
+        case Quality::High: rolloff = 0.92; beta = 9.0; break;
+        default: rolloff = 0.88; beta = 7.0; break;
+    }
+
+    //cut at whichever nyquist is lower, relative to the input rate
+    double cutoff = std::min(1.0, outputRate / inputRate) * rolloff;
+    double half = static_cast<double>(taps / 2);
+    double windowScale = 1.0 / BesselI0(beta);
+
+    coefficients.assign((phases + 1) * taps, 0.0f);
+    for (size_t phase = 0; phase <= phases; phase++)
+    {
+        double fraction = static_cast<double>(phase) / phases;
+        float* row = &coefficients[phase * taps];
+
+        double sum = 0.0;
+        std::vector<double> values(taps);
+        for (size_t k = 0; k < taps; k++)
+        {
+            //distance from the output position to the input sample this tap lands on
+            double x = static_cast<double>(k) - (half - 1.0) - fraction;
+            double u = x / half;
+            double window = std::fabs(u) < 1.0 ? BesselI0(beta * std::sqrt(1.0 - u * u)) * windowScale : 0.0;
+            values[k] = cutoff * Sinc(cutoff * x) * window;
+            sum += values[k];
+        }
+
+        //unity gain at dc for every phase, otherwise the phase steps show up as a faint buzz
+        for (size_t k = 0; k < taps; k++)
+            row[k] = static_cast<float>(values[k] / sum);
+    }
+}
+
+void Resampler::Reset()
+{
+    //enough silence in front that the first real frame can sit in the middle of the filter
+    size_t history = taps / 2 - 1;
+    std::fill(left.begin(), left.end(), 0.0f);
+    std::fill(right.begin(), right.end(), 0.0f);
+    front = 0;
+    count = history;
+    position = static_cast<double>(history);
+}
+
+size_t Resampler::InputFramesNeeded(size_t outputFrames, double ratio) const
+{
+    if (outputFrames == 0)
+        return 0;
+
+    //one spare frame so rounding in the running position can't leave the last output short
+    double last = position + (outputFrames - 1) * step * ratio;
+    size_t required = static_cast<size_t>(last) + taps / 2 + 2;
+    if (required <= count)
+        return 0;
+    return std::min(required - count, capacity - count);
+}
+
+void Resampler::Push(const int16_t* frames, size_t frameCount)
+{
+    frameCount = std::min(frameCount, capacity - count);
+
+    size_t slot = front + count;
+    if (slot >= capacity)
+        slot -= capacity;
+
+    for (size_t i = 0; i < frameCount; i++)
+    {
+        float leftSample = frames[i * 2] * (1.0f / 32768.0f);
+        float rightSample = frames[i * 2 + 1] * (1.0f / 32768.0f);
+        left[slot] = left[slot + capacity] = leftSample;
+        right[slot] = right[slot + capacity] = rightSample;
+        if (++slot == capacity)
+            slot = 0;
+    }
+    count += frameCount;
+}
+
+void Resampler::Convolve(const float* leftSamples, const float* rightSamples, const float* filter, float& outLeft, float& outRight) const
+{
+#if defined(RESAMPLER_USE_AVX)
+    __m256 sumLeft = _mm256_setzero_ps();
+    __m256 sumRight = _mm256_setzero_ps();
+    for (size_t k = 0; k < taps; k += 8)
+    {
+        __m256 weights = _mm256_loadu_ps(filter + k);
+        sumLeft = _mm256_add_ps(sumLeft, _mm256_mul_ps(_mm256_loadu_ps(leftSamples + k), weights));
+        sumRight = _mm256_add_ps(sumRight, _mm256_mul_ps(_mm256_loadu_ps(rightSamples + k), weights));
+    }
+    outLeft = HorizontalSum(_mm_add_ps(_mm256_castps256_ps128(sumLeft), _mm256_extractf128_ps(sumLeft, 1)));
+    outRight = HorizontalSum(_mm_add_ps(_mm256_castps256_ps128(sumRight), _mm256_extractf128_ps(sumRight, 1)));
+#elif defined(RESAMPLER_USE_SSE)
+    __m128 sumLeft = _mm_setzero_ps();
+    __m128 sumRight = _mm_setzero_ps();
+    for (size_t k = 0; k < taps; k += 4)
+    {
+        __m128 weights = _mm_loadu_ps(filter + k);
+        sumLeft = _mm_add_ps(sumLeft, _mm_mul_ps(_mm_loadu_ps(leftSamples + k), weights));
+        sumRight = _mm_add_ps(sumRight, _mm_mul_ps(_mm_loadu_ps(rightSamples + k), weights));
+    }
+    outLeft = HorizontalSum(sumLeft);
+    outRight = HorizontalSum(sumRight);
+#else
+    float sumLeft = 0.0f;
+    float sumRight = 0.0f;
+    for (size_t k = 0; k < taps; k++)
+    {
+        sumLeft += leftSamples[k] * filter[k];
+        sumRight += rightSamples[k] * filter[k];
+    }
+    outLeft = sumLeft;
+    outRight = sumRight;
+#endif
+}
+
+size_t Resampler::Process(int16_t* destination, size_t maxFrames, double ratio)
+{
+    const size_t half = taps / 2;
+    const double increment = step * ratio;
+
+    size_t produced = 0;
+    while (produced < maxFrames)
+    {
+        size_t index = static_cast<size_t>(position);
+        if (index + half >= count)
+            break;
+
+        size_t phase = static_cast<size_t>((position - index) * phases + 0.5);
+        size_t first = (front + index + 1 - half) % capacity;
+
+        float outLeft, outRight;
+        Convolve(&left[first], &right[first], &coefficients[phase * taps], outLeft, outRight);
+        destination[produced * 2] = ToSample(outLeft);
+        destination[produced * 2 + 1] = ToSample(outRight);
+
+        position += increment;
+        produced++;
+    }
+
+    //keep just enough behind the position for the next filter window
+    size_t consumed = static_cast<size_t>(position) - (half - 1);
+    if (consumed > 0)
+    {
+        consumed = std::min(consumed, count);
+        front = (front + consumed) % capacity;
+        count -= consumed;
+        position -= static_cast<double>(consumed);
+    }
+
+    return produced;
+}
+
+Resampler::Measurement Resampler::Measure(Quality quality, double inputRate, double outputRate)
+{
+    Resampler resampler;
+    resampler.Configure(inputRate, outputRate, quality);
+
+    //a tone the filter has to keep, and where its image lands. when going down in rate the tone is one
+    //the filter has to throw away instead, and the alias is where it would fold back to
+    double tone;
+    double alias;
+    if (outputRate >= inputRate)
+    {
+        tone = 0.35 * inputRate;
+        alias = inputRate - tone;
+    }
+    else
+    {
+        tone = 0.25 * (inputRate + outputRate);
+        alias = outputRate - tone;
+    }
+
+    const double amplitude = 0.5;
+    const size_t chunkFrames = 512;
+    const size_t outputFrames = static_cast<size_t>(outputRate * 2.0);
+
+    std::vector<int16_t> input(chunkFrames * 2);
+    std::vector<int16_t> chunk(chunkFrames * 4);
+    std::vector<int16_t> output;
+    output.reserve(outputFrames * 2 + chunk.size());
+
+    uint64_t inputFrame = 0;
+    std::chrono::steady_clock::duration elapsed{};
+    while (output.size() / 2 < outputFrames)
+    {
+        for (size_t i = 0; i < chunkFrames; i++, inputFrame++)
+        {
+            int16_t value = static_cast<int16_t>(std::lrint(amplitude * 32767.0 * std::sin(2.0 * PI * tone * inputFrame / inputRate)));
+            input[i * 2] = value;
+            input[i * 2 + 1] = value;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        resampler.Push(input.data(), chunkFrames);
+        size_t produced = resampler.Process(chunk.data(), chunk.size() / 2, 1.0);
+        elapsed += std::chrono::steady_clock::now() - start;
+
+        output.insert(output.end(), chunk.begin(), chunk.begin() + produced * 2);
+    }
+
+    Measurement measurement;
+    measurement.nanosecondsPerFrame = std::chrono::duration<double, std::nano>(elapsed).count() / (output.size() / 2);
+
+    //hann windowed dft at the one bin we care about, over the second half so the filter has settled
+    size_t count = outputFrames / 2;
+    size_t offset = outputFrames - count;
+    std::complex<double> sum;
+    for (size_t n = 0; n < count; n++)
+    {
+        double window = 0.5 - 0.5 * std::cos(2.0 * PI * n / (count - 1));
+        double sample = output[(offset + n) * 2] / 32768.0;
+        sum += sample * window * std::polar(1.0, -2.0 * PI * alias * n / outputRate);
+    }
+
+    //a tone of this amplitude with nothing lost would come out at amplitude * count / 4 through the window
+    double reference = amplitude * count / 4.0;
+    double level = std::max(std::abs(sum), 1e-12);
+    measurement.aliasRejectionDb = 20.0 * std::log10(reference / level);
+    return measurement;
+}
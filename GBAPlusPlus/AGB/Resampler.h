@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//windowed-sinc polyphase resampler for the apu's stereo output. the filter for every fractional position is
+//worked out up front, each output frame is then one table lookup and a dot product per channel. input is
+//pushed in whatever chunks are to hand, output comes out at the configured rate times a fine ratio that
+//rate control can move around freely
+class Resampler
+{
+public:
+    enum class Quality : uint8_t
+    {
+        Fast,
+        Balanced,
+        High
+    };
+
+    struct Measurement
+    {
+        double nanosecondsPerFrame = 0.0;
+        //how far the image of a tone near the input's nyquist sits below the tone itself
+        double aliasRejectionDb = 0.0;
+    };
+
+    //the most input that can be waiting at once besides the filter's own history. InputFramesNeeded never asks
+    //for more, anything pushed past it is dropped
+    static constexpr size_t MAX_BLOCK_FRAMES = 8192;
+
+    Resampler();
+
+    //drops anything buffered. the only call that allocates, the audio callback can push and process freely
+    void Configure(double inputRate, double outputRate, Quality quality);
+    Quality GetQuality() const { return quality; }
+    double GetOutputRate() const { return outputRate; }
+
+    void Reset();
+
+    //input frames Push still needs before Process can make outputFrames at this ratio
+    size_t InputFramesNeeded(size_t outputFrames, double ratio) const;
+
+    void Push(const int16_t* frames, size_t frameCount);
+
+    //ratio above 1 eats input faster than nominal. stops early once the pushed input runs out
+    size_t Process(int16_t* destination, size_t maxFrames, double ratio);
+
+    //runs a tone through a throwaway resampler, for the debug menu
+    static Measurement Measure(Quality quality, double inputRate, double outputRate);
+
+private:
+    static size_t TapsFor(Quality quality);
+    static size_t PhasesFor(Quality quality);
+
+    void BuildFilter();
+    //both channels share every coefficient load
+    void Convolve(const float* leftSamples, const float* rightSamples, const float* filter, float& outLeft, float& outRight) const;
+
+    Quality quality = Quality::Balanced;
+    double inputRate = 1.0;
+    double outputRate = 1.0;
+    //input frames per output frame at ratio 1
+    double step = 1.0;
+
+    size_t taps = 0;
+    size_t phases = 0;
+    //phases + 1 rows of taps, the extra one saves a wrap when the position rounds up
+    std::vector<float> coefficients;
+
+    //planar ring of capacity frames, each written twice (capacity apart) so any filter window is one contiguous
+    //run wherever it wraps and the dot products read straight through. position is in frames from front
+    std::vector<float> left;
+    std::vector<float> right;
+    size_t capacity = 0;
+    size_t front = 0;
+    size_t count = 0;
+    double position = 0.0;
+};
@@ -0,0 +1,290 @@
+#include "SaveFile.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "HostProfiler.h"
+
+constexpr size_t SaveFile::BLOCK_SIZE;
+
+namespace
+{
+    std::chrono::steady_clock::duration ToDuration(double seconds)
+    {
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+
+    //a flushed stream only means the os has the bytes. they have to actually be on the disk before the rename,
+    //otherwise a power cut can leave the new name pointing at an empty or half written file
+    bool WriteDurably(const std::string& path, const uint8_t* data, size_t size)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        bool ok = true;
+        while (ok && size > 0)
+        {
+            DWORD written = 0;
+            DWORD chunk = static_cast<DWORD>(std::min<size_t>(size, 0x40000000));
+            ok = WriteFile(file, data, chunk, &written, nullptr) != 0 && written > 0;
+            data += written;
+            size -= written;
+        }
+        ok = ok && FlushFileBuffers(file) != 0;
+        return CloseHandle(file) != 0 && ok;
+#else
+        int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (file < 0)
+            return false;
+
+        bool ok = true;
+        while (ok && size > 0)
+        {
+            ssize_t written = write(file, data, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+            ok = written > 0;
+            if (ok)
+            {
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+        }
+        ok = ok && fsync(file) == 0;
+        return close(file) == 0 && ok;
+#endif
+    }
+
+    //replaces the destination in one step, there's never a moment without a complete save on disk
+    bool ReplaceAtomically(const std::string& from, const std::string& to)
+    {
+#ifdef _WIN32
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        if (std::rename(from.c_str(), to.c_str()) != 0)
+            return false;
+
+        //the rename itself lives in the directory, which has to be synced separately
+        size_t slash = to.find_last_of('/');
+        std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : to.substr(0, slash));
+        int handle = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (handle < 0)
+            return false;
+        bool ok = fsync(handle) == 0;
+        return close(handle) == 0 && ok;
+#endif
+    }
+}
+
+SaveFile::~SaveFile()
+{
+    Close();
+}
+
+bool SaveFile::Open(const std::string& path, uint8_t* data, size_t size)
+{
+    Close();
+
+    bool ok = true;
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (file.is_open())
+    {
+        //a save from another emulator can be padded or short, take what lines up
+        std::streamsize fileSize = file.tellg();
+        size_t count = std::min(static_cast<size_t>(std::max<std::streamsize>(fileSize, 0)), size);
+        file.seekg(0, std::ios::beg);
+        ok = static_cast<bool>(file.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(count)));
+    }
+
+    this->path = path;
+    source = data;
+    this->size = size;
+    carriedBlocks = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shadow.assign(data, data + size);
+        pending = false;
+        flushRequested = false;
+        stopRequested = false;
+        generation = 0;
+        writtenGeneration = 0;
+    }
+
+    writerThread = std::thread(&SaveFile::WriterLoop, this);
+    open = true;
+    return ok;
+}
+
+void SaveFile::Close()
+{
+    if (!open)
+        return;
+
+    //the writer doesn't wait for things to settle once it's told to stop, whatever's pending goes out now
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        CopyBlocks(carriedBlocks);
+        carriedBlocks = 0;
+        stopRequested = true;
+    }
+    wake.notify_one();
+    writerThread.join();
+    open = false;
+}
+
+void SaveFile::Update(uint32_t dirtyBlocks)
+{
+    dirtyBlocks |= carriedBlocks;
+    if (!open || dirtyBlocks == 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        carriedBlocks = dirtyBlocks;
+        return;
+    }
+
+    //a writer that's already waiting on a deadline picks the later one up by itself when it wakes
+    bool wasIdle = !pending;
+    CopyBlocks(dirtyBlocks);
+    carriedBlocks = 0;
+    lock.unlock();
+    if (wasIdle)
+        wake.notify_one();
+}
+
+void SaveFile::CopyBlocks(uint32_t blocks)
+{
+    if (blocks == 0)
+        return;
+
+    for (size_t block = 0; block * BLOCK_SIZE < size; block++)
+    {
+        if (!(blocks & (1u << block)))
+            continue;
+
+        size_t offset = block * BLOCK_SIZE;
+        std::memcpy(&shadow[offset], source + offset, std::min(BLOCK_SIZE, size - offset));
+    }
+
+    Clock::time_point now = Clock::now();
+    if (!pending)
+        firstChange = now;
+    lastChange = now;
+    pending = true;
+    generation++;
+}
+
+void SaveFile::Flush()
+{
+    if (!open)
+        return;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!pending)
+        return;
+
+    uint64_t target = generation;
+    flushRequested = true;
+    wake.notify_one();
+    flushed.wait(lock, [this, target] { return writtenGeneration >= target; });
+}
+
+uint64_t SaveFile::GetWrites() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return writes;
+}
+
+uint64_t SaveFile::GetFailedWrites() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return failedWrites;
+}
+
+void SaveFile::WriterLoop()
+{
+    TraceRecorder::SetThreadName("Save writer");
+
+    std::vector<uint8_t> contents;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        if (pending)
+        {
+            //an erase and rewrite comes in over several frames, wait for the game to finish before writing
+            Clock::time_point due = std::min(lastChange + ToDuration(SETTLE_SECONDS), firstChange + ToDuration(MAX_DELAY_SECONDS));
+            if (!flushRequested && !stopRequested && Clock::now() < due)
+            {
+                wake.wait_until(lock, due);
+                continue;
+            }
+
+            contents = shadow;
+            uint64_t written = generation;
+            pending = false;
+            flushRequested = false;
+
+            lock.unlock();
+            bool ok = WriteContents(contents);
+            lock.lock();
+
+            writes++;
+            if (!ok)
+            {
+                failedWrites++;
+                //try again later unless something newer is already on its way
+                if (!pending && !stopRequested)
+                {
+                    pending = true;
+                    firstChange = lastChange = Clock::now();
+                }
+            }
+
+            writtenGeneration = std::max(writtenGeneration, written);
+            flushed.notify_all();
+            continue;
+        }
+
+        if (stopRequested)
+            return;
+
+        wake.wait(lock);
+    }
+}
+
+bool SaveFile::WriteContents(const std::vector<uint8_t>& contents)
+{
+    TRACE_SCOPE("Write save");
+
+    std::string temporary = path + ".tmp";
+    if (!WriteDurably(temporary, contents.data(), contents.size()))
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+
+    if (!ReplaceAtomically(temporary, path))
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//keeps a .sav on disk in step with the cartridge's save memory. the emulation thread only copies the blocks
+//that changed into a shadow copy, a writer thread turns that into a file once the game has stopped writing
+//for a moment (or it's been dirty too long). each write goes to a temp file that's renamed over the old one,
+//so a crash mid write leaves the previous save intact
+class SaveFile
+{
+public:
+    //the granularity changes are tracked at, one bit per block
+    static constexpr size_t BLOCK_SIZE = 0x1000;
+
+    SaveFile() = default;
+    ~SaveFile();
+
+    SaveFile(const SaveFile&) = delete;
+    SaveFile& operator=(const SaveFile&) = delete;
+
+    //fills data from the file if there is one, otherwise leaves it alone. false only if an existing file
+    //couldn't be read. size is at most 32 blocks, and data has to stay put until Close
+    bool Open(const std::string& path, uint8_t* data, size_t size);
+    //writes anything still pending and stops the writer. call from the thread that calls Update, or with it stopped
+    void Close();
+    bool IsOpen() const { return open; }
+    const std::string& GetPath() const { return path; }
+
+    //emulation thread. copies just the blocks in dirtyBlocks, the file gets written later. never waits, if the
+    //writer happens to be taking its copy right now the blocks go over with the next call instead
+    void Update(uint32_t dirtyBlocks);
+
+    //writes now instead of waiting for things to settle, and waits until it's on disk
+    void Flush();
+
+    uint64_t GetWrites() const;
+    uint64_t GetFailedWrites() const;
+
+private:
+    //how long the game has to leave the save alone before it gets written
+    static constexpr double SETTLE_SECONDS = 0.5;
+    //a game that never stops writing still gets saved this often
+    static constexpr double MAX_DELAY_SECONDS = 5.0;
+
+    typedef std::chrono::steady_clock Clock;
+
+    void WriterLoop();
+    bool WriteContents(const std::vector<uint8_t>& contents);
+
+    void CopyBlocks(uint32_t blocks);
+
+    bool open = false;
+    std::string path;
+    const uint8_t* source = nullptr;
+    size_t size = 0;
+    //blocks an Update couldn't hand over yet
+    uint32_t carriedBlocks = 0;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable flushed;
+
+    //everything below is under mutex
+    std::vector<uint8_t> shadow;
+    bool pending = false;
+    bool flushRequested = false;
+    bool stopRequested = false;
+    uint64_t generation = 0;
+    uint64_t writtenGeneration = 0;
+    Clock::time_point firstChange;
+    Clock::time_point lastChange;
+    uint64_t writes = 0;
+    uint64_t failedWrites = 0;
+
+    std::thread writerThread;
+};
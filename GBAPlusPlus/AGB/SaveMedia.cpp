@@ -0,0 +1,175 @@
+#include "SaveMedia.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Eeprom.h"
+#include "Flash.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define SAVEMEDIA_USE_SSE
+#include <emmintrin.h>
+#endif
+
+constexpr size_t SaveMedia::SECTOR_SIZE;
+constexpr size_t Sram::SIZE;
+constexpr SaveMedia::Type SaveMedia::FALLBACK_TYPE;
+
+namespace
+{
+    struct LibraryString
+    {
+        const char* text;
+        size_t length;
+        SaveMedia::Type type;
+    };
+
+    //every one of them ends in _V and a three digit version, that's what the scan keys on
+    const LibraryString LIBRARY_STRINGS[] = {
+        {"EEPROM_V", 8, SaveMedia::Type::Eeprom},
+        {"SRAM_V", 6, SaveMedia::Type::Sram},
+        {"SRAM_F_V", 8, SaveMedia::Type::Sram},
+        {"FLASH_V", 7, SaveMedia::Type::Flash64K},
+        {"FLASH512_V", 10, SaveMedia::Type::Flash64K},
+        {"FLASH1M_V", 9, SaveMedia::Type::Flash128K},
+    };
+
+    //underscore is the byte at position, V the one after it
+    bool MatchAt(const uint8_t* rom, size_t position, SaveMedia::Type& type)
+    {
+        for (const LibraryString& library : LIBRARY_STRINGS)
+        {
+            size_t prefix = library.length - 2;
+            if (position < prefix)
+                continue;
+
+            if (std::memcmp(rom + position - prefix, library.text, library.length) == 0)
+            {
+                type = library.type;
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+std::unique_ptr<SaveMedia> SaveMedia::Create(Type type)
+{
+    switch (type)
+    {
+        case Type::Sram: return std::unique_ptr<SaveMedia>(new Sram());
+        case Type::Eeprom: return std::unique_ptr<SaveMedia>(new Eeprom());
+        case Type::Flash64K: return std::unique_ptr<SaveMedia>(new Flash(Flash::Chip::Macronix64K));
+        case Type::Flash128K: return std::unique_ptr<SaveMedia>(new Flash(Flash::Chip::Sanyo128K));
+        default: return std::unique_ptr<SaveMedia>(new NoSaveMedia());
+    }
+}
+
+SaveMedia::Type SaveMedia::Detect(const uint8_t* rom, size_t size)
+{
+    Type type = Type::None;
+    if (size < 2)
+        return type;
+
+    //a 32mb rom is a lot of bytes to look at one by one, so look for "_V" sixteen places at a time and only
+    //compare the names where that turns up
+    size_t position = 0;
+#ifdef SAVEMEDIA_USE_SSE
+    const __m128i underscore = _mm_set1_epi8('_');
+    const __m128i letterV = _mm_set1_epi8('V');
+    for (; position + 17 <= size; position += 16)
+    {
+        __m128i here = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rom + position));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rom + position + 1));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(here, underscore), _mm_cmpeq_epi8(next, letterV)));
+        if (mask == 0)
+            continue;
+
+        for (int bit = 0; bit < 16; bit++)
+        {
+            if ((mask & (1 << bit)) && MatchAt(rom, position + bit, type))
+                return type;
+        }
+    }
+#endif
+
+    for (; position + 2 <= size; position++)
+    {
+        if (rom[position] == '_' && rom[position + 1] == 'V' && MatchAt(rom, position, type))
+            return type;
+    }
+    return type;
+}
+
+const char* SaveMedia::GetTypeName(Type type)
+{
+    switch (type)
+    {
+        case Type::Sram: return "SRAM";
+        case Type::Eeprom: return "EEPROM";
+        case Type::Flash64K: return "Flash 64K";
+        case Type::Flash128K: return "Flash 128K";
+        default: return "no save";
+    }
+}
+
+SaveMedia::SaveMedia(size_t size)
+    : data(size, 0xFF)
+{
+}
+
+void SaveMedia::Erase()
+{
+    std::fill(data.begin(), data.end(), 0xFF);
+    dirtySectors = 0;
+}
+
+void SaveMedia::WriteState(SaveState& state) const
+{
+    state.BeginSection("Save media");
+    state.Write(GetType());
+    std::copy(data.begin(), data.end(), state.Extend(data.size()));
+}
+
+void SaveMedia::ReadState(SaveState& state)
+{
+    Type type = Type::None;
+    state.Inspect(type);
+    if (type != GetType())
+    {
+        state.Fail();
+        return;
+    }
+
+    state.ReadBytes(data.data(), data.size());
+    if (!state.IsChecking())
+        dirtySectors = 0xFFFFFFFF;
+}
+
+uint8_t SaveMedia::Read(uint32_t /*address*/)
+{
+    return 0xFF;
+}
+
+void SaveMedia::Write(uint32_t /*address*/, uint8_t /*value*/)
+{
+}
+
+uint32_t SaveMedia::ConsumeDirtySectors()
+{
+    const uint32_t was = dirtySectors;
+    dirtySectors = 0;
+    return was;
+}
+
+uint8_t Sram::Read(uint32_t address)
+{
+    return data[address & (SIZE - 1)];
+}
+
+void Sram::Write(uint32_t address, uint8_t value)
+{
+    const uint32_t offset = address & (SIZE - 1);
+    data[offset] = value;
+    MarkDirty(offset);
+}
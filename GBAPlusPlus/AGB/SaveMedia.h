@@ -0,0 +1,96 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "SaveState.h"
+
+//whatever a cartridge keeps its save in. sram and flash sit at 0x0E, eeprom is a serial chip hanging off the
+//top of the rom bus instead. the bytes themselves live here so the .sav code doesn't care which one it is
+class SaveMedia
+{
+public:
+    enum class Type
+    {
+        None,
+        Sram,
+        //the library string doesn't say which, the first dma the game does gives the size away
+        Eeprom,
+        Flash64K,
+        Flash128K
+    };
+
+    static std::unique_ptr<SaveMedia> Create(Type type);
+
+    //looks for the save library's version string nintendo's sdk leaves in every rom, None when there isn't one
+    static Type Detect(const uint8_t* rom, size_t size);
+    //what a rom without the string gets, the 128k flash every rom had before detection so old .sav files still load
+    static constexpr Type FALLBACK_TYPE = Type::Flash128K;
+    static const char* GetTypeName(Type type);
+
+    virtual ~SaveMedia() = default;
+
+    virtual Type GetType() const = 0;
+
+    //only the command state, the save itself is battery backed and survives a reset
+    virtual void Reset() {}
+    //back to a blank chip, for a cartridge with no save yet
+    virtual void Erase();
+
+    //the contents and whatever command the chip was in the middle of. the save on disk follows a loaded
+    //state, so a read marks every sector dirty
+    virtual void WriteState(SaveState& state) const;
+    virtual void ReadState(SaveState& state);
+
+    //the 0x0E region, byte wide
+    virtual uint8_t Read(uint32_t address);
+    virtual void Write(uint32_t address, uint8_t value);
+
+    //eeprom only, one bit per halfword at the top of the rom
+    virtual uint16_t ReadSerial() { return 1; }
+    virtual void WriteSerial(uint16_t /*value*/) {}
+    //a whole dma worth of bits at once. false leaves it to the serial path one halfword at a time
+    virtual bool ReadStream(uint16_t* /*destination*/, size_t /*count*/) { return false; }
+    virtual bool WriteStream(const uint16_t* /*source*/, size_t /*count*/) { return false; }
+
+    const uint8_t* Data() const { return data.data(); }
+    uint8_t* Data() { return data.data(); }
+    size_t Size() const { return data.size(); }
+
+    //one bit per 4kb sector written or erased since the last call
+    uint32_t ConsumeDirtySectors();
+
+protected:
+    static constexpr size_t SECTOR_SIZE = 0x1000;
+
+    explicit SaveMedia(size_t size);
+
+    std::vector<uint8_t> data;
+
+    uint32_t dirtySectors = 0;
+    void MarkDirty(uint32_t index) { dirtySectors |= 1u << (index / SECTOR_SIZE); }
+};
+
+//no save chip, reads float high
+class NoSaveMedia : public SaveMedia
+{
+public:
+    NoSaveMedia() : SaveMedia(0) {}
+
+    Type GetType() const override { return Type::None; }
+};
+
+//32kb of plain battery backed ram, mirrored through the whole region
+class Sram : public SaveMedia
+{
+public:
+    static constexpr size_t SIZE = 32 * 1024;
+
+    Sram() : SaveMedia(SIZE) {}
+
+    Type GetType() const override { return Type::Sram; }
+
+    uint8_t Read(uint32_t address) override;
+    void Write(uint32_t address, uint8_t value) override;
+};
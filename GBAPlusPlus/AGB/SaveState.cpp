@@ -0,0 +1,180 @@
+#include "SaveState.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "ARM7TDMI.h"
+#include "MemoryBus.h"
+
+constexpr uint32_t SaveState::VERSION;
+
+namespace
+{
+    const char MAGIC[8] = {'G', 'B', 'A', '+', '+', 'S', 'T', '\0'};
+
+    //fnv-1a a word at a time, enough to catch a file that got damaged on disk
+    uint64_t Checksum(const uint8_t* data, size_t size)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash ^= word;
+            hash *= 1099511628211ull;
+        }
+        for (; i < size; i++)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+}
+
+void SaveState::Capture(ARM7TDMI& cpu, MemoryBus& memoryBus)
+{
+    //clear keeps the capacity, a state that gets captured over and over only allocates the first time
+    bytes.clear();
+    sections.clear();
+    capturing = true;
+
+    Header header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    Write(header);
+
+    //the bus goes first so a state from another rom is turned away before anything has been touched
+    memoryBus.WriteState(*this);
+    cpu.WriteState(*this);
+
+    capturing = false;
+    header.payloadSize = static_cast<uint32_t>(bytes.size() - sizeof(Header));
+    header.checksum = Checksum(bytes.data() + sizeof(Header), header.payloadSize);
+    std::memcpy(bytes.data(), &header, sizeof(Header));
+}
+
+bool SaveState::Restore(ARM7TDMI& cpu, MemoryBus& memoryBus)
+{
+    Header header;
+    if (bytes.size() < sizeof(Header))
+        return false;
+    std::memcpy(&header, bytes.data(), sizeof(Header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+        || header.payloadSize != bytes.size() - sizeof(Header)
+        || header.checksum != Checksum(bytes.data() + sizeof(Header), header.payloadSize))
+        return false;
+
+    //the checksum only says the bytes are the ones that were written. the rest (a different rom or save chip, an
+    //index out of range from a state that was built wrong) only shows up partway through, so everything gets walked once without storing anything. the real pass after that can't fail
+    checking = true;
+    ReadInto(cpu, memoryBus);
+    checking = false;
+    if (!good)
+        return false;
+
+    ReadInto(cpu, memoryBus);
+    return good;
+}
+
+void SaveState::ReadInto(ARM7TDMI& cpu, MemoryBus& memoryBus)
+{
+    readOffset = sizeof(Header);
+    good = true;
+
+    memoryBus.ReadState(*this);
+    if (good)
+        cpu.ReadState(*this);
+
+    if (readOffset != bytes.size())
+        good = false;
+}
+
+bool SaveState::SaveToFile(const std::string& path) const
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+        return false;
+
+    file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return file.good();
+}
+
+bool SaveState::LoadFromFile(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open())
+        return false;
+
+    std::streamsize size = file.tellg();
+    if (size < static_cast<std::streamsize>(sizeof(Header)))
+        return false;
+
+    file.seekg(0, std::ios::beg);
+    bytes.resize(static_cast<size_t>(size));
+    sections.clear();
+    if (!file.read(reinterpret_cast<char*>(bytes.data()), size))
+    {
+        bytes.clear();
+        return false;
+    }
+    return true;
+}
+
+const char* SaveState::FindFirstDifference(const SaveState& other) const
+{
+    if (bytes == other.bytes)
+        return nullptr;
+
+    //both came from the same code, so the sections line up unless one of them is from a file. the checksum
+    //differs whenever anything after it does, so the header only counts if the payloads match
+    size_t length = std::min(bytes.size(), other.bytes.size());
+    size_t offset = std::min(sizeof(Header), length);
+    while (offset < length && bytes[offset] == other.bytes[offset])
+        offset++;
+    if (offset == length && bytes.size() == other.bytes.size())
+        return "header";
+
+    const char* name = "header";
+    for (const Section& section : sections)
+    {
+        if (section.offset > offset)
+            break;
+        name = section.name;
+    }
+    return name;
+}
+
+void SaveState::BeginSection(const char* name)
+{
+    if (capturing)
+        sections.push_back(Section{name, bytes.size()});
+}
+
+uint8_t* SaveState::Extend(size_t size)
+{
+    size_t offset = bytes.size();
+    bytes.resize(offset + size);
+    return bytes.data() + offset;
+}
+
+void SaveState::ReadBytes(void* destination, size_t size)
+{
+    const uint8_t* source = Consume(size);
+    if (source && !checking)
+        std::memcpy(destination, source, size);
+}
+
+const uint8_t* SaveState::Consume(size_t size)
+{
+    if (!good || size > bytes.size() - readOffset)
+    {
+        good = false;
+        return nullptr;
+    }
+
+    const uint8_t* data = bytes.data() + readOffset;
+    readOffset += size;
+    return data;
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class ARM7TDMI;
+class MemoryBus;
+
+//the whole machine in one flat buffer. every component copies its plain structs and arrays straight in and
+//out, nothing gets converted field by field, so a capture or restore is a few hundred kb of memcpy.
+//the layout is whatever the compiler made of those structs, so a state only loads into a build with the same
+//VERSION, bump it whenever anything that gets written changes shape
+class SaveState
+{
+public:
+    static constexpr uint32_t VERSION = 4;
+
+    void Capture(ARM7TDMI& cpu, MemoryBus& memoryBus);
+    //false leaves the machine exactly as it was: a different version or rom, a damaged file, or an index that
+    //would point outside its array. the whole state is checked before anything gets touched, so nothing has to
+    //be put back
+    bool Restore(ARM7TDMI& cpu, MemoryBus& memoryBus);
+
+    bool SaveToFile(const std::string& path) const;
+    bool LoadFromFile(const std::string& path);
+
+    bool IsEmpty() const { return bytes.empty(); }
+    size_t GetSize() const { return bytes.size(); }
+
+    //for checking two captures against each other. the name of the first section that isn't byte for byte
+    //the same, null if they match
+    const char* FindFirstDifference(const SaveState& other) const;
+
+    //everything below is for the components' WriteState and ReadState
+
+    //marks where the next component starts, only used to say where two captures differ
+    void BeginSection(const char* name);
+
+    template <typename T>
+    void Write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "save states only hold plain data");
+        std::memcpy(Extend(sizeof(T)), &value, sizeof(T));
+    }
+
+    //restores read every component twice. the first pass only checks, Read moves past the value without
+    //storing it, so the machine isn't touched until the whole state is known to be good
+    bool IsChecking() const { return checking; }
+
+    template <typename T>
+    void Read(T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "save states only hold plain data");
+        const uint8_t* source = Consume(sizeof(T));
+        if (source && !checking)
+            std::memcpy(&value, source, sizeof(T));
+    }
+
+    //same as Read but stored in both passes, for something a component has to look at before it lets it in.
+    //only ever into a local
+    template <typename T>
+    void Inspect(T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "save states only hold plain data");
+        if (const uint8_t* source = Consume(sizeof(T)))
+            std::memcpy(&value, source, sizeof(T));
+    }
+
+    //Inspect, then stored on the real pass only if isValid says so. the state fails otherwise. for anything
+    //that gets used as an index or a count, which the checksum can't vouch for
+    template <typename T, typename Check>
+    void ReadChecked(T& value, Check isValid)
+    {
+        T saved;
+        Inspect(saved);
+        if (!good)
+            return;
+        if (!isValid(saved))
+            good = false;
+        else if (!checking)
+            value = saved;
+    }
+
+    //Read for a run of bytes whose length is only known at runtime
+    void ReadBytes(void* destination, size_t size);
+
+    //room for size more bytes, only good until the next write
+    uint8_t* Extend(size_t size);
+
+    //a component that finds something it can't take calls this, only ever while checking
+    void Fail() { good = false; }
+    bool IsGood() const { return good; }
+
+private:
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t payloadSize;
+        uint64_t checksum;
+    };
+
+    void ReadInto(ARM7TDMI& cpu, MemoryBus& memoryBus);
+    //the next size bytes, null (and the whole read failed) if the state is shorter than that
+    const uint8_t* Consume(size_t size);
+
+    std::vector<uint8_t> bytes;
+    size_t readOffset = 0;
+    bool good = true;
+    bool checking = false;
+
+    struct Section
+    {
+        const char* name;
+        size_t offset;
+    };
+    std::vector<Section> sections;
+    bool capturing = false;
+};
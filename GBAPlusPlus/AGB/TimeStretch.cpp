@@ -0,0 +1,204 @@
+#include "TimeStretch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+constexpr double TimeStretch::MIN_SPEED;
+constexpr double TimeStretch::MAX_SPEED;
+constexpr size_t TimeStretch::MAX_BUFFERED_FRAMES;
+
+namespace
+{
+    int16_t ToSample(float value)
+    {
+        long scaled = std::lrint(value);
+        return static_cast<int16_t>(std::max(-32768L, std::min(scaled, 32767L)));
+    }
+}
+
+TimeStretch::TimeStretch()
+{
+    const double pi = 3.14159265358979323846;
+
+    fadeIn.resize(HOP);
+    fadeOut.resize(HOP);
+    for (size_t n = 0; n < HOP; n++)
+    {
+        //periodic hann, so w[n] + w[n + HOP] is exactly one
+        fadeIn[n] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * pi * n / WINDOW));
+        fadeOut[n] = 1.0f - fadeIn[n];
+    }
+
+    left.resize(MAX_BUFFERED_FRAMES);
+    right.resize(MAX_BUFFERED_FRAMES);
+    mono.resize(MAX_BUFFERED_FRAMES);
+    tailLeft.resize(HOP);
+    tailRight.resize(HOP);
+    ready.resize(HOP * 2);
+
+    Reset();
+}
+
+void TimeStretch::Reset()
+{
+    count = 0;
+    position = 0.0;
+    previous = 0;
+    havePrevious = false;
+
+    std::fill(tailLeft.begin(), tailLeft.end(), 0.0f);
+    std::fill(tailRight.begin(), tailRight.end(), 0.0f);
+
+    readyOffset = HOP;
+}
+
+void TimeStretch::SetSpeed(double speed)
+{
+    this->speed = std::max(MIN_SPEED, std::min(speed, MAX_SPEED));
+}
+
+size_t TimeStretch::InputFramesNeeded(size_t outputFrames) const
+{
+    size_t waiting = HOP - readyOffset;
+    if (outputFrames <= waiting)
+        return 0;
+
+    //every hop needs a whole window past the furthest place the search could move it to
+    size_t steps = (outputFrames - waiting + HOP - 1) / HOP;
+    double last = position + (steps - 1) * HOP * speed;
+    size_t required = static_cast<size_t>(std::lround(last)) + SEEK + WINDOW + 1;
+    if (required <= count)
+        return 0;
+    return std::min(required - count, MAX_BUFFERED_FRAMES - count);
+}
+
+void TimeStretch::Push(const int16_t* frames, size_t frameCount)
+{
+    frameCount = std::min(frameCount, MAX_BUFFERED_FRAMES - count);
+    for (size_t i = 0; i < frameCount; i++)
+    {
+        left[count + i] = frames[i * 2];
+        right[count + i] = frames[i * 2 + 1];
+        mono[count + i] = left[count + i] + right[count + i];
+    }
+    count += frameCount;
+
+    statInputFrames.fetch_add(frameCount, std::memory_order_relaxed);
+}
+
+size_t TimeStretch::FindBestOffset(size_t nominal) const
+{
+    //the first grain has nothing to line up with
+    if (!havePrevious)
+        return nominal;
+
+    //where the previous grain would have carried on if nothing had been skipped
+    const float* continuation = &mono[previous + HOP];
+
+    size_t first = nominal > SEEK ? nominal - SEEK : 0;
+    size_t last = nominal + SEEK;
+
+    size_t best = nominal;
+    float bestScore = -1e30f;
+    for (size_t candidate = first; candidate <= last; candidate++)
+    {
+        const float* grain = &mono[candidate];
+        float dot = 0.0f;
+        float energy = 0.0f;
+        for (size_t n = 0; n < HOP; n += CORRELATION_STEP)
+        {
+            dot += grain[n] * continuation[n];
+            energy += grain[n] * grain[n];
+        }
+
+        //normalised so a loud stretch doesn't win just for being loud
+        float score = dot / std::sqrt(energy + 1.0f);
+        if (score > bestScore)
+        {
+            bestScore = score;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+void TimeStretch::Step()
+{
+    size_t nominal = static_cast<size_t>(std::lround(position));
+    size_t offset = FindBestOffset(nominal);
+
+    for (size_t n = 0; n < HOP; n++)
+    {
+        ready[n * 2] = ToSample(tailLeft[n] + fadeIn[n] * left[offset + n]);
+        ready[n * 2 + 1] = ToSample(tailRight[n] + fadeIn[n] * right[offset + n]);
+        tailLeft[n] = fadeOut[n] * left[offset + HOP + n];
+        tailRight[n] = fadeOut[n] * right[offset + HOP + n];
+    }
+
+    previous = offset;
+    havePrevious = true;
+    position += HOP * speed;
+    readyOffset = 0;
+}
+
+void TimeStretch::Compact()
+{
+    //keep the previous grain's continuation and the next search window, nothing before either
+    double nextFirst = position - SEEK;
+    size_t keepFrom = nextFirst > 0.0 ? std::min(previous, static_cast<size_t>(nextFirst)) : 0;
+    keepFrom = std::min(keepFrom, count);
+    if (keepFrom > 0)
+    {
+        std::copy(left.begin() + keepFrom, left.begin() + count, left.begin());
+        std::copy(right.begin() + keepFrom, right.begin() + count, right.begin());
+        std::copy(mono.begin() + keepFrom, mono.begin() + count, mono.begin());
+        count -= keepFrom;
+        position -= static_cast<double>(keepFrom);
+        previous -= keepFrom;
+    }
+}
+
+size_t TimeStretch::Process(int16_t* destination, size_t maxFrames)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    size_t produced = 0;
+    while (produced < maxFrames)
+    {
+        size_t waiting = HOP - readyOffset;
+        if (waiting == 0)
+        {
+            //not enough input for the whole search window yet
+            size_t nominal = static_cast<size_t>(std::lround(position));
+            if (nominal + SEEK + WINDOW > count)
+                break;
+
+            Step();
+            continue;
+        }
+
+        size_t frames = std::min(waiting, maxFrames - produced);
+        std::copy(ready.begin() + readyOffset * 2, ready.begin() + (readyOffset + frames) * 2, destination + produced * 2);
+        readyOffset += frames;
+        produced += frames;
+    }
+
+    //once a callback rather than once a hop, so the shuffle down stays small
+    Compact();
+
+    statOutputFrames.fetch_add(produced, std::memory_order_relaxed);
+    statNanoseconds.fetch_add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count()), std::memory_order_relaxed);
+
+    return produced;
+}
+
+TimeStretch::Stats TimeStretch::TakeStats()
+{
+    Stats stats;
+    stats.inputFrames = statInputFrames.exchange(0, std::memory_order_relaxed);
+    stats.outputFrames = statOutputFrames.exchange(0, std::memory_order_relaxed);
+    stats.nanoseconds = statNanoseconds.exchange(0, std::memory_order_relaxed);
+    return stats;
+}
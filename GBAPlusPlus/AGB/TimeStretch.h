@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//wsola time stretch for fast forward. plays speed times as much input in the same time without the chipmunk
+//pitch: short hann windowed grains are overlap-added at a fixed output hop, while the input position moves
+//speed times faster, and each grain is nudged a few ms to wherever it lines up best with the end of the
+//previous one. the search window never depends on speed, so the cost per output frame is the same at 2x and 8x
+class TimeStretch
+{
+public:
+    static constexpr double MIN_SPEED = 1.0;
+    static constexpr double MAX_SPEED = 8.0;
+    //most input that can be held at once, a whole callback's worth at MAX_SPEED with room to spare.
+    //InputFramesNeeded never asks for more and Push drops anything past it
+    static constexpr size_t MAX_BUFFERED_FRAMES = 49152;
+
+    struct Stats
+    {
+        uint64_t inputFrames = 0;
+        uint64_t outputFrames = 0;
+        uint64_t nanoseconds = 0;
+    };
+
+    //allocates everything up front, nothing after this does
+    TimeStretch();
+
+    //drops anything buffered
+    void Reset();
+
+    //clamped to MIN_SPEED..MAX_SPEED, picked up at the next grain
+    void SetSpeed(double speed);
+    double GetSpeed() const { return speed; }
+
+    //input frames Push still needs before Process can make outputFrames
+    size_t InputFramesNeeded(size_t outputFrames) const;
+
+    void Push(const int16_t* frames, size_t frameCount);
+
+    //stops early once the pushed input runs out
+    size_t Process(int16_t* destination, size_t maxFrames);
+
+    //any thread, totals since the last call
+    Stats TakeStats();
+
+private:
+    //about 20ms grains at the apu's rate, half of each overlaps the next
+    static constexpr size_t WINDOW = 640;
+    static constexpr size_t HOP = WINDOW / 2;
+    //how far a grain may move to line up, about 5ms either way
+    static constexpr size_t SEEK = 160;
+    //the similarity only looks at every other frame, plenty at these lengths
+    static constexpr size_t CORRELATION_STEP = 2;
+
+    //makes one hop of output into ready
+    void Step();
+    size_t FindBestOffset(size_t nominal) const;
+    //drops the input no grain can reach any more
+    void Compact();
+
+    double speed = 1.0;
+
+    //first and second half of the hann window, they add up to one everywhere
+    std::vector<float> fadeIn;
+    std::vector<float> fadeOut;
+
+    //planar input, plus a mono sum for the search, the first count frames are in use. positions are in
+    //frames from the front of these
+    std::vector<float> left;
+    std::vector<float> right;
+    std::vector<float> mono;
+    size_t count = 0;
+    double position = 0.0;
+    size_t previous = 0;
+    bool havePrevious = false;
+
+    //second half of the last grain, waiting for the next one to fade in over it
+    std::vector<float> tailLeft;
+    std::vector<float> tailRight;
+
+    //the last hop of finished frames, Process hands them out from readyOffset on
+    std::vector<int16_t> ready;
+    size_t readyOffset = HOP;
+
+    std::atomic<uint64_t> statInputFrames{0};
+    std::atomic<uint64_t> statOutputFrames{0};
+    std::atomic<uint64_t> statNanoseconds{0};
+};
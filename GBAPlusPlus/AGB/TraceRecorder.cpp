@@ -0,0 +1,237 @@
+#include "TraceRecorder.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "HostProfiler.h"
+
+std::atomic<bool> TraceRecorder::recording{false};
+
+namespace
+{
+    struct TraceEvent
+    {
+        const char* name;
+        uint64_t startTicks;
+        uint64_t endTicks;
+        bool instant;
+    };
+
+    //one per thread that ever recorded. the thread is the only producer and the writer the only consumer,
+    //the writer keeps draining it for the whole window so it never has to hold more than a few milliseconds
+    struct ThreadBuffer
+    {
+        static constexpr size_t CAPACITY = 1 << 15;
+
+        std::vector<TraceEvent> events;
+        std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> tail{0};
+        std::atomic<size_t> dropped{0};
+        std::string name;
+        uint32_t id = 0;
+    };
+
+    struct CollectedEvent
+    {
+        uint32_t threadId;
+        TraceEvent event;
+    };
+
+    //how often the writer empties the rings, a ring holds far more than a thread records in this long
+    const std::chrono::milliseconds DRAIN_INTERVAL(2);
+
+    std::mutex registryMutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> threadBuffers;
+
+    thread_local ThreadBuffer* threadBuffer = nullptr;
+    thread_local const char* threadName = nullptr;
+
+    std::thread writerThread;
+    std::atomic<bool> writing{false};
+    std::atomic<uint32_t> framesLeft{0};
+
+    //only touched between Start and the writer finishing
+    std::string outputPath;
+    TraceRecorder::FinishedCallback onFinished;
+    uint64_t captureStartTicks = 0;
+    std::chrono::steady_clock::time_point captureStartTime;
+
+    ThreadBuffer* BufferForThisThread()
+    {
+        if (threadBuffer)
+            return threadBuffer;
+
+        std::unique_ptr<ThreadBuffer> buffer(new ThreadBuffer());
+        buffer->events.resize(ThreadBuffer::CAPACITY);
+        buffer->name = threadName ? threadName : "Thread";
+
+        std::lock_guard<std::mutex> lock(registryMutex);
+        buffer->id = static_cast<uint32_t>(threadBuffers.size() + 1);
+        threadBuffer = buffer.get();
+        threadBuffers.push_back(std::move(buffer));
+        return threadBuffer;
+    }
+
+    void Append(const TraceEvent& event)
+    {
+        ThreadBuffer* buffer = BufferForThisThread();
+
+        //only full if the writer has stalled for a good while, the count ends up in the finished callback
+        uint64_t head = buffer->head.load(std::memory_order_relaxed);
+        if (head - buffer->tail.load(std::memory_order_acquire) >= ThreadBuffer::CAPACITY)
+        {
+            buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        buffer->events[head % ThreadBuffer::CAPACITY] = event;
+        buffer->head.store(head + 1, std::memory_order_release);
+    }
+
+    //moves whatever every thread recorded since the last pass out of its ring
+    void Drain(std::vector<CollectedEvent>& collected)
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (auto& buffer : threadBuffers)
+        {
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+            for (; tail < head; tail++)
+                collected.push_back({ buffer->id, buffer->events[tail % ThreadBuffer::CAPACITY] });
+            buffer->tail.store(tail, std::memory_order_release);
+        }
+    }
+}
+
+bool TraceRecorder::Start(const std::string& path, uint32_t frames, FinishedCallback finished)
+{
+    if (recording.load() || writing.load(std::memory_order_acquire) || frames == 0)
+        return false;
+
+    if (writerThread.joinable())
+        writerThread.join();
+
+    {
+        //anything a thread was still finishing when the last capture stopped isn't part of this one
+        std::lock_guard<std::mutex> lock(registryMutex);
+        for (auto& buffer : threadBuffers)
+        {
+            buffer->tail.store(buffer->head.load(std::memory_order_acquire), std::memory_order_release);
+            buffer->dropped.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    outputPath = path;
+    framesLeft.store(frames, std::memory_order_relaxed);
+    onFinished = std::move(finished);
+    captureStartTicks = HostProfiler::Now();
+    captureStartTime = std::chrono::steady_clock::now();
+
+    writing.store(true);
+    recording.store(true, std::memory_order_release);
+    writerThread = std::thread(&TraceRecorder::WriteTrace);
+    return true;
+}
+
+void TraceRecorder::EndFrame()
+{
+    //the acquire pairs with Start, so the count it set is the one being taken from
+    if (!recording.load(std::memory_order_acquire) || framesLeft.fetch_sub(1, std::memory_order_relaxed) > 1)
+        return;
+
+    //the writer notices, takes what's left in the rings and writes the file
+    recording.store(false, std::memory_order_release);
+}
+
+void TraceRecorder::Shutdown()
+{
+    recording.store(false);
+    if (writerThread.joinable())
+        writerThread.join();
+}
+
+void TraceRecorder::SetThreadName(const char* name)
+{
+    threadName = name;
+    if (threadBuffer)
+        threadBuffer->name = name;
+}
+
+void TraceRecorder::RecordSlice(const char* name, uint64_t startTicks, uint64_t endTicks)
+{
+    Append({ name, startTicks, endTicks, false });
+}
+
+void TraceRecorder::RecordInstant(const char* name)
+{
+    uint64_t now = HostProfiler::Now();
+    Append({ name, now, now, true });
+}
+
+void TraceRecorder::WriteTrace()
+{
+    //collected grows on this thread, so the rings stay small and nobody recording ever waits on an allocation
+    std::vector<CollectedEvent> collected;
+    while (recording.load(std::memory_order_acquire))
+    {
+        Drain(collected);
+        std::this_thread::sleep_for(DRAIN_INTERVAL);
+    }
+    Drain(collected);
+
+    //work out the tick rate over the capture itself so it's right even before the profiler has calibrated
+    uint64_t endTicks = HostProfiler::Now();
+    double elapsedUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - captureStartTime).count();
+    double ticksPerUs = elapsedUs > 0.0 ? static_cast<double>(endTicks - captureStartTicks) / elapsedUs : 1.0;
+
+    auto toUs = [&](uint64_t ticks) {
+        return ticks > captureStartTicks ? static_cast<double>(ticks - captureStartTicks) / ticksPerUs : 0.0;
+    };
+
+    size_t dropped = 0;
+    std::ofstream out(outputPath, std::ios::out | std::ios::trunc);
+    if (out.is_open())
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        for (auto& buffer : threadBuffers)
+        {
+            dropped += buffer->dropped.load(std::memory_order_relaxed);
+            out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->id
+                << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+            first = false;
+        }
+
+        for (const CollectedEvent& collectedEvent : collected)
+        {
+            const TraceEvent& event = collectedEvent.event;
+            out << (first ? "" : ",\n") << "{\"name\":\"" << event.name << "\",\"pid\":1,\"tid\":" << collectedEvent.threadId
+                << ",\"ts\":" << toUs(event.startTicks);
+            if (event.instant)
+                out << ",\"ph\":\"i\",\"s\":\"t\"}";
+            else
+                out << ",\"ph\":\"X\",\"dur\":" << (toUs(event.endTicks) - toUs(event.startTicks)) << "}";
+            first = false;
+        }
+        out << "\n]}\n";
+    }
+    size_t written = collected.size();
+
+    bool ok = out.is_open() && out.good();
+    out.close();
+
+    FinishedCallback finished = std::move(onFinished);
+    onFinished = nullptr;
+    writing.store(false, std::memory_order_release);
+
+    if (finished)
+        finished(ok, written, dropped);
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+//records a bounded window of frames as chrome trace-event json, open it in ui.perfetto.dev or chrome://tracing.
+//every thread appends to its own fixed ring without locking and a writer thread drains the rings for as long as
+//the window runs, the json gets built once it's over. use the TRACE_ macros in HostProfiler.h rather than
+//calling this directly
+class TraceRecorder
+{
+public:
+    typedef std::function<void(bool written, size_t events, size_t dropped)> FinishedCallback;
+
+    //false if a capture is already running or still being written out. onFinished runs on the writer thread
+    static bool Start(const std::string& path, uint32_t frames, FinishedCallback onFinished);
+    static bool IsRecording() { return recording.load(std::memory_order_relaxed); }
+
+    //emulation thread, once a frame. the last frame of the window hands everything to the writer
+    static void EndFrame();
+
+    //waits for a write that's still going, call before exit
+    static void Shutdown();
+
+    //names the track this thread's events land on
+    static void SetThreadName(const char* name);
+
+    //ticks are HostProfiler::Now(). names must be string literals, only the pointer is kept
+    static void RecordSlice(const char* name, uint64_t startTicks, uint64_t endTicks);
+    static void RecordInstant(const char* name);
+
+private:
+    static std::atomic<bool> recording;
+
+    static void WriteTrace();
+};
@@ -0,0 +1,44 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+//one producer and one consumer swap whole buffers through a single atomic index, nobody ever waits.
+//the producer fills WriteBuffer() then Publish()es it, the consumer Acquire()s and reads ReadBuffer()
+//until it acquires again. if the producer laps the consumer the older unread buffer just gets reused
+template <typename T>
+class TripleBuffer
+{
+public:
+    T& WriteBuffer() { return buffers[writeIndex]; }
+
+    void Publish()
+    {
+        uint8_t previous = middle.exchange(static_cast<uint8_t>(writeIndex | FRESH_BIT), std::memory_order_acq_rel);
+        writeIndex = previous & INDEX_MASK;
+    }
+
+    //false if nothing new was published since the last acquire, ReadBuffer() stays as it was
+    bool Acquire()
+    {
+        if (!(middle.load(std::memory_order_acquire) & FRESH_BIT))
+            return false;
+
+        uint8_t previous = middle.exchange(readIndex, std::memory_order_acq_rel);
+        readIndex = previous & INDEX_MASK;
+        return true;
+    }
+
+    const T& ReadBuffer() const { return buffers[readIndex]; }
+
+private:
+    static constexpr uint8_t INDEX_MASK = 0x03;
+    static constexpr uint8_t FRESH_BIT = 0x04;
+
+    std::array<T, 3> buffers{};
+
+    //each index is only ever touched by its own side, the middle one is the handoff
+    uint8_t writeIndex = 0;
+    uint8_t readIndex = 1;
+    std::atomic<uint8_t> middle{2};
+};
@@ -0,0 +1,65 @@
+#include "AudioRateControl.h"
+
+#include <algorithm>
+#include <cmath>
+
+void AudioRateControl::Reset()
+{
+    smoothedFill = -1.0;
+    currentPpb.store(0, std::memory_order_relaxed);
+}
+
+double AudioRateControl::Update(double bufferedSeconds)
+{
+    double target = GetTargetLatency();
+    if (target <= 0.0)
+        return 1.0;
+
+    //one callback's worth of samples coming or going makes the raw fill jumpy, only react to the trend
+    if (smoothedFill < 0.0)
+        smoothedFill = bufferedSeconds;
+    else
+        smoothedFill += (bufferedSeconds - smoothedFill) * FILL_SMOOTHING;
+
+    //full correction once the buffer is empty or twice the target, linear in between
+    double error = std::max(-1.0, std::min((smoothedFill - target) / target, 1.0));
+    double adjustment = error * MAX_ADJUSTMENT;
+
+    int64_t ppb = static_cast<int64_t>(std::lround(adjustment * 1e9));
+    currentPpb.store(ppb, std::memory_order_relaxed);
+    statPpbSum.fetch_add(ppb, std::memory_order_relaxed);
+    statFillUsSum.fetch_add(static_cast<uint64_t>(std::max(bufferedSeconds, 0.0) * 1e6), std::memory_order_relaxed);
+
+    int64_t seen = statPpbMin.load(std::memory_order_relaxed);
+    while (ppb < seen && !statPpbMin.compare_exchange_weak(seen, ppb, std::memory_order_relaxed)) {}
+    seen = statPpbMax.load(std::memory_order_relaxed);
+    while (ppb > seen && !statPpbMax.compare_exchange_weak(seen, ppb, std::memory_order_relaxed)) {}
+
+    //a TakeStats landing halfway through here can split one update across two windows, it's only stats
+    statUpdates.fetch_add(1, std::memory_order_relaxed);
+    return 1.0 + adjustment;
+}
+
+AudioRateControl::Stats AudioRateControl::TakeStats()
+{
+    Stats stats;
+    stats.updates = statUpdates.exchange(0, std::memory_order_relaxed);
+    int64_t sum = statPpbSum.exchange(0, std::memory_order_relaxed);
+    int64_t min = statPpbMin.exchange(INT64_MAX, std::memory_order_relaxed);
+    int64_t max = statPpbMax.exchange(INT64_MIN, std::memory_order_relaxed);
+    uint64_t fillUs = statFillUsSum.exchange(0, std::memory_order_relaxed);
+
+    int64_t current = currentPpb.load(std::memory_order_relaxed);
+    stats.ratioPpm = current / static_cast<double>(PPB_PER_PPM);
+    if (stats.updates == 0)
+        return stats;
+
+    if (min > max)
+        min = max = current;
+
+    stats.averagePpm = sum / static_cast<double>(stats.updates) / PPB_PER_PPM;
+    stats.minPpm = min / static_cast<double>(PPB_PER_PPM);
+    stats.maxPpm = max / static_cast<double>(PPB_PER_PPM);
+    stats.averageFillSeconds = fillUs / static_cast<double>(stats.updates) / 1e6;
+    return stats;
+}
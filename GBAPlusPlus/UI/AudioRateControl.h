@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+//the apu makes samples at exactly its rate in emulated time, the frame limiter and the sound card each have
+//their own idea of what a second is. this nudges how fast the device side eats samples, never more than
+//MAX_ADJUSTMENT either way, so the buffer hovers around the target instead of slowly filling up or running dry
+class AudioRateControl
+{
+public:
+    //half a percent is about 8 cents, nobody hears that
+    static constexpr double MAX_ADJUSTMENT = 0.005;
+
+    struct Stats
+    {
+        uint64_t updates = 0;
+        //all as parts per million off 1.0, positive means the device side is eating faster
+        double ratioPpm = 0.0;
+        double averagePpm = 0.0;
+        double minPpm = 0.0;
+        double maxPpm = 0.0;
+        double averageFillSeconds = 0.0;
+    };
+
+    //any thread
+    void SetTargetLatency(double seconds) { targetSeconds.store(seconds, std::memory_order_relaxed); }
+    double GetTargetLatency() const { return targetSeconds.load(std::memory_order_relaxed); }
+
+    //audio thread. starts the smoothing over, use after the buffer got flushed
+    void Reset();
+
+    //audio thread, every time the device asks for more. returns the ratio to consume input at
+    double Update(double bufferedSeconds);
+
+    //any thread, stats since the last call. averagePpm is the best guess at how far the two clocks drift apart
+    Stats TakeStats();
+
+private:
+    //how much of each new fill reading goes into the smoothed one, a callback is every 10ms or so
+    static constexpr double FILL_SMOOTHING = 0.05;
+    static constexpr int64_t PPB_PER_PPM = 1000;
+
+    std::atomic<double> targetSeconds{0.05};
+
+    //audio thread only
+    double smoothedFill = -1.0;
+
+    //parts per billion so the sums stay integers and can be atomic
+    std::atomic<int64_t> currentPpb{0};
+    std::atomic<uint64_t> statUpdates{0};
+    std::atomic<int64_t> statPpbSum{0};
+    std::atomic<int64_t> statPpbMin{INT64_MAX};
+    std::atomic<int64_t> statPpbMax{INT64_MIN};
+    std::atomic<uint64_t> statFillUsSum{0};
+};
@@ -4,6 +4,7 @@
 #include "MemoryViewerFrame.h"
 #include "InputSettingsDialog.h"
 #include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <vector>
 #include <wx/config.h>
@@ -11,11 +12,35 @@
 #include <wx/stdpaths.h>
 #define NOMINMAX
 #include <Windows.h>
-#pragma comment(lib, "Winmm.lib")
 
 namespace {
     const wxString kBiosPathConfigKey = "/LastBiosPath";
     const wxString kRomPathConfigKey = "/LastRomPath";
+    const wxString kThreadedRenderingConfigKey = "/ThreadedRendering";
+    const wxString kPacingModeConfigKey = "/PacingMode";
+    const wxString kAudioLatencyConfigKey = "/AudioLatencyMs";
+    const wxString kAudioQualityConfigKey = "/AudioQuality";
+
+    const long kAudioLatencyChoicesMs[] = { 30, 50, 80, 120 };
+
+    //cocoa only draws from the main thread, everywhere else the renderer gets a thread of its own
+#ifdef __WXMAC__
+    const bool kPresentOnUiThread = true;
+#else
+    const bool kPresentOnUiThread = false;
+#endif
+
+    void WriteSummaryJson(std::ostream& out, const char* name, const LatencyHistogram::Summary& summary) {
+        out << ",\"" << name << "\":{\"count\":" << summary.count
+            << ",\"p50\":" << summary.p50
+            << ",\"p90\":" << summary.p90
+            << ",\"p99\":" << summary.p99
+            << ",\"p999\":" << summary.p999
+            << ",\"mean\":" << summary.mean
+            << ",\"jitter\":" << summary.jitter
+            << ",\"max\":" << summary.max
+            << "}";
+    }
 }
 
 enum {
@@ -25,13 +50,34 @@ enum {
     ID_Run,
     ID_Pause,
     ID_Reset,
+    ID_SaveState,
+    ID_LoadState,
     ID_ShowRegisters,
     ID_ShowMemory,
     ID_ToggleTrace,
     ID_DumpPPUState,
     ID_DumpFrameImage,
+    ID_RecordPerfTrace,
+    ID_ToggleAudioCapture,
     ID_ToggleFpsCounter,
-    ID_ConfigureInput
+    ID_TogglePerfOverlay,
+    ID_ToggleThreadedRendering,
+    ID_ConfigureInput,
+    //keep these three together and in FrameLimiter::Mode order
+    ID_PacingExact,
+    ID_PacingAudio,
+    ID_PacingUnthrottled,
+    //one per kAudioLatencyChoicesMs entry, same order
+    ID_AudioLatency30,
+    ID_AudioLatency50,
+    ID_AudioLatency80,
+    ID_AudioLatency120,
+    //keep these three together and in Resampler::Quality order
+    ID_AudioQualityFast,
+    ID_AudioQualityBalanced,
+    ID_AudioQualityHigh,
+    ID_MeasureResampler,
+    ID_VerifySaveState
 };
 
 wxBEGIN_EVENT_TABLE(EmulatorFrame, wxFrame)
@@ -43,13 +89,24 @@ wxBEGIN_EVENT_TABLE(EmulatorFrame, wxFrame)
     EVT_MENU(ID_Run, EmulatorFrame::OnRun)
     EVT_MENU(ID_Pause, EmulatorFrame::OnPause)
     EVT_MENU(ID_Reset, EmulatorFrame::OnReset)
+    EVT_MENU(ID_SaveState, EmulatorFrame::OnSaveState)
+    EVT_MENU(ID_LoadState, EmulatorFrame::OnLoadState)
     EVT_MENU(ID_ShowRegisters, EmulatorFrame::OnShowRegisters)
     EVT_MENU(ID_ShowMemory, EmulatorFrame::OnShowMemory)
     EVT_MENU(ID_ToggleTrace, EmulatorFrame::OnToggleTrace)
     EVT_MENU(ID_DumpPPUState, EmulatorFrame::OnDumpPPUState)
     EVT_MENU(ID_DumpFrameImage, EmulatorFrame::OnDumpFrameImage)
+    EVT_MENU(ID_RecordPerfTrace, EmulatorFrame::OnRecordPerfTrace)
+    EVT_MENU(ID_ToggleAudioCapture, EmulatorFrame::OnToggleAudioCapture)
     EVT_MENU(ID_ToggleFpsCounter, EmulatorFrame::OnToggleFpsCounter)
+    EVT_MENU(ID_TogglePerfOverlay, EmulatorFrame::OnTogglePerfOverlay)
+    EVT_MENU(ID_ToggleThreadedRendering, EmulatorFrame::OnToggleThreadedRendering)
     EVT_MENU(ID_ConfigureInput, EmulatorFrame::OnConfigureInput)
+    EVT_MENU_RANGE(ID_PacingExact, ID_PacingUnthrottled, EmulatorFrame::OnSelectPacingMode)
+    EVT_MENU_RANGE(ID_AudioLatency30, ID_AudioLatency120, EmulatorFrame::OnSelectAudioLatency)
+    EVT_MENU_RANGE(ID_AudioQualityFast, ID_AudioQualityHigh, EmulatorFrame::OnSelectAudioQuality)
+    EVT_MENU(ID_MeasureResampler, EmulatorFrame::OnMeasureResampler)
+    EVT_MENU(ID_VerifySaveState, EmulatorFrame::OnVerifySaveState)
 wxEND_EVENT_TABLE()
 
 bool EmulatorApp::OnInit() {
@@ -109,6 +166,26 @@ EmulatorFrame::EmulatorFrame()
     emuMenu->Append(ID_Pause, "&Pause\tF6",      "Pause emulation");
     emuMenu->AppendSeparator();
     emuMenu->Append(ID_Reset, "R&eset\tCtrl-R", "Reset emulator");
+    emuMenu->Append(ID_SaveState, "Sa&ve State\tShift-F1", "Save the whole machine to a .state file next to the ROM");
+    emuMenu->Append(ID_LoadState, "Loa&d State\tF1", "Go back to the last saved state");
+    emuMenu->AppendSeparator();
+    emuMenu->AppendRadioItem(ID_PacingExact, "Pace to &59.73 Hz",
+        "Run at the GBA's exact refresh rate");
+    emuMenu->AppendRadioItem(ID_PacingAudio, "Pace to &Audio",
+        "Let the audio device set the speed, no crackles if its clock drifts from ours");
+    emuMenu->AppendRadioItem(ID_PacingUnthrottled, "&Unthrottled",
+        "Run as fast as the host allows");
+    wxMenu* latencyMenu = new wxMenu();
+    for (size_t i = 0; i < WXSIZEOF(kAudioLatencyChoicesMs); i++)
+        latencyMenu->AppendRadioItem(ID_AudioLatency30 + static_cast<int>(i), wxString::Format("%ld ms", kAudioLatencyChoicesMs[i]));
+    emuMenu->AppendSubMenu(latencyMenu, "Audio &Latency",
+        "How much audio is kept queued ahead of the sound card, less is snappier but crackles sooner");
+    wxMenu* qualityMenu = new wxMenu();
+    qualityMenu->AppendRadioItem(ID_AudioQualityFast, "&Fast", "8 tap resampling filter");
+    qualityMenu->AppendRadioItem(ID_AudioQualityBalanced, "&Balanced", "16 tap resampling filter");
+    qualityMenu->AppendRadioItem(ID_AudioQualityHigh, "&High", "32 tap resampling filter");
+    emuMenu->AppendSubMenu(qualityMenu, "Audio &Quality",
+        "How hard the resampler works to keep aliasing out of the output");
     emuMenu->AppendSeparator();
     emuMenu->Append(ID_ConfigureInput, "Configure &Input...\tCtrl-I",
         "Choose which keys drive the GBA buttons");
@@ -118,6 +195,10 @@ EmulatorFrame::EmulatorFrame()
     wxMenuItem* fpsCounterItem = viewMenu->AppendCheckItem(ID_ToggleFpsCounter, "Show &FPS Counter",
         "Overlay the current framerate in the top-right corner of the display");
     fpsCounterItem->Check(true);
+    viewMenu->AppendCheckItem(ID_TogglePerfOverlay, "Show &Performance Overlay",
+        "Break each frame's host time down into CPU, PPU, DMA, APU and presentation");
+    wxMenuItem* threadedRenderingItem = viewMenu->AppendCheckItem(ID_ToggleThreadedRendering, "&Threaded Rendering",
+        "Compose frames on worker threads instead of on the emulation thread (shows frames one behind)");
     menuBar->Append(viewMenu, "&View");
 
     wxMenu* debugMenu = new wxMenu();
@@ -130,6 +211,15 @@ EmulatorFrame::EmulatorFrame()
         "Write DISPCNT/window/BG registers and OAM sprite entries to a text file");
     debugMenu->Append(ID_DumpFrameImage, "Dump Frame as &Image\tCtrl-Shift-I",
         "Save the current rendered frame as a BMP for visual inspection");
+    debugMenu->AppendSeparator();
+    debugMenu->Append(ID_RecordPerfTrace, "Record Performance T&race...",
+                      "Record the next few seconds as a timeline for ui.perfetto.dev");
+    debugMenu->Append(ID_ToggleAudioCapture, "Start &Audio Capture...",
+                      "Write the APU's output to a WAV or raw file, with a hash of it logged every frame");
+    debugMenu->Append(ID_MeasureResampler, "Measure Audio Re&sampler",
+                      "Time every resampler quality and check how well it keeps images out");
+    debugMenu->Append(ID_VerifySaveState, "&Verify Save State",
+                      "Check a save state restores the machine exactly and replays the same frames twice");
     menuBar->Append(debugMenu, "&Debug");
 
     SetMenuBar(menuBar);
@@ -149,6 +239,33 @@ EmulatorFrame::EmulatorFrame()
 
     InitializeEmulator();
 
+    bool threadedRendering = false;
+    wxConfigBase::Get()->Read(kThreadedRenderingConfigKey, &threadedRendering, false);
+    threadedRenderingItem->Check(threadedRendering);
+    memoryBus->SetDeferredRendering(threadedRendering);
+
+    long pacingMode = static_cast<long>(FrameLimiter::Mode::Exact);
+    wxConfigBase::Get()->Read(kPacingModeConfigKey, &pacingMode, pacingMode);
+    pacingMode = std::min(std::max(pacingMode, 0L), static_cast<long>(FrameLimiter::Mode::Unthrottled));
+    emuMenu->Check(ID_PacingExact + static_cast<int>(pacingMode), true);
+    frameLimiter.SetMode(static_cast<FrameLimiter::Mode>(pacingMode));
+
+    long audioLatencyMs = DEFAULT_AUDIO_LATENCY_MS;
+    wxConfigBase::Get()->Read(kAudioLatencyConfigKey, &audioLatencyMs, audioLatencyMs);
+    audioLatencyMs = std::min(std::max(audioLatencyMs, 10L), 500L);
+    for (size_t i = 0; i < WXSIZEOF(kAudioLatencyChoicesMs); i++) {
+        if (kAudioLatencyChoicesMs[i] == audioLatencyMs)
+            latencyMenu->Check(ID_AudioLatency30 + static_cast<int>(i), true);
+    }
+    audioRateControl.SetTargetLatency(audioLatencyMs / 1000.0);
+    frameLimiter.SetAudioTarget(audioLatencyMs / 1000.0);
+
+    long audioQuality = static_cast<long>(Resampler::Quality::Balanced);
+    wxConfigBase::Get()->Read(kAudioQualityConfigKey, &audioQuality, audioQuality);
+    audioQuality = std::min(std::max(audioQuality, 0L), static_cast<long>(Resampler::Quality::High));
+    qualityMenu->Check(ID_AudioQualityFast + static_cast<int>(audioQuality), true);
+    SetResamplerQuality(static_cast<Resampler::Quality>(audioQuality));
+
     wxString savedBiosPath, savedRomPath;
     wxConfigBase* config = wxConfigBase::Get();
     bool haveBios = config->Read(kBiosPathConfigKey, &savedBiosPath) && wxFileExists(savedBiosPath);
@@ -169,9 +286,22 @@ EmulatorFrame::~EmulatorFrame() {
     if (emuThread.joinable())
         emuThread.join();
 
+    TraceRecorder::Shutdown();
+
+    if (memoryBus) {
+        memoryBus->GetAPU().SetCapture(nullptr);
+
+        std::lock_guard<std::mutex> lock(emuMutex);
+        CloseSaveFile();
+    }
+    audioCapture.Stop();
+
     registerWindow = nullptr;
     memoryWindow   = nullptr;
 
+    //the present thread reads frames out of the bus, it and the renderer have to be gone before the bus is
+    sdlPanel->StopPresenting();
+
     ShutdownAudio();
 
     delete cpu;
@@ -188,18 +318,20 @@ void EmulatorFrame::InitializeEmulator() {
     memoryBus = new MemoryBus();
     cpu = new ARM7TDMI(memoryBus, registers);
 
-    sdlPanel->SetSource(memoryBus, &emuMutex);
+    sdlPanel->SetSource(memoryBus);
     sdlPanel->SetFpsSource(&emulationFps);
 
     InitAudio();
 
     wxString perfLogPath = wxStandardPaths::Get().GetDocumentsDir()
-        + wxFileName::GetPathSeparator() + "gbaplusplus_perf.log";
+        + wxFileName::GetPathSeparator() + "gbaplusplus_perf.jsonl";
     perfLog.open(perfLogPath.ToStdString(), std::ios::out | std::ios::trunc);
     if (perfLog.is_open())
-        perfLog << "budget per frame = " << (FRAME_TIME * 1000.0) << "ms ("
-                << CYCLES_PER_FRAME << " cycles @ " << TARGET_FPS << " fps)\n";
-    perfWindowStart = std::chrono::steady_clock::now();
+        perfLog << "{\"budget_us\":" << (FRAME_TIME * 1e6)
+                << ",\"cycles_per_frame\":" << CYCLES_PER_FRAME
+                << ",\"target_fps\":" << TARGET_FPS << "}\n";
+    perfLogStart = std::chrono::steady_clock::now();
+    perfWindowStart = perfLogStart;
 }
 
 void EmulatorFrame::OnLoadBIOS(wxCommandEvent& event) {
@@ -260,13 +392,29 @@ void EmulatorFrame::LoadROMFile(const wxString& path) {
 
     std::vector<uint8_t> buffer(size);
     if (file.read(reinterpret_cast<char*>(buffer.data()), size)) {
+        wxFileName savePath(path);
+        savePath.SetExt("sav");
+        bool saveRead = true;
+        SaveMedia::Type saveType;
         {
             std::lock_guard<std::mutex> lock(emuMutex);
+            CloseSaveFile();
+
+            //a different cartridge, its own save (or a blank chip) replaces whatever the last one left behind
             memoryBus->loadROM(buffer.data(), size);
+            SaveMedia& saveMedia = memoryBus->GetSaveMedia();
+            saveType = saveMedia.GetType();
+            if (saveMedia.Size() > 0)
+                saveRead = saveFile.Open(savePath.GetFullPath().ToStdString(), saveMedia.Data(), saveMedia.Size());
         }
+        if (!saveRead)
+            wxLogWarning("Could not read the save file %s, starting from a blank save", savePath.GetFullPath());
         romLoaded = true;
+        wxFileName statePath(path);
+        statePath.SetExt("state");
+        saveStatePath = statePath.GetFullPath();
         wxConfigBase::Get()->Write(kRomPathConfigKey, path);
-        SetStatusText("ROM loaded: " + path, 0);
+        SetStatusText("ROM loaded: " + path + " (" + SaveMedia::GetTypeName(saveType) + ")", 0);
         if (biosLoaded) {
             ResetEmulatorState();
             SetStatusText("Ready to run", 0);
@@ -291,9 +439,11 @@ void EmulatorFrame::OnUnloadROM(wxCommandEvent& event) {
 
     {
         std::lock_guard<std::mutex> lock(emuMutex);
+        CloseSaveFile();
         memoryBus->unloadROM();
     }
     romLoaded = false;
+    saveStatePath.clear();
     wxConfigBase::Get()->DeleteEntry(kRomPathConfigKey);
 
     ResetEmulatorState();
@@ -393,6 +543,11 @@ void EmulatorFrame::ResetEmulatorState() {
     cpu->InitializeCpuForExecution();
 }
 
+void EmulatorFrame::CloseSaveFile() {
+    saveFile.Update(memoryBus->GetSaveMedia().ConsumeDirtySectors());
+    saveFile.Close();
+}
+
 void EmulatorFrame::OnShowRegisters(wxCommandEvent& event) {
     if (!registerWindow) {
         registerWindow = new RegisterFrame(this, registers, memoryBus, &emuMutex);
@@ -465,93 +620,451 @@ void EmulatorFrame::OnDumpFrameImage(wxCommandEvent& event) {
     SetStatusText("Frame image saved to " + path, 0);
 }
 
+void EmulatorFrame::OnRecordPerfTrace(wxCommandEvent& event) {
+    if (TraceRecorder::IsRecording()) return;
+
+    wxFileDialog dlg(this, "Save Performance Trace", "", "gbaplusplus_trace.json",
+                     "Trace files (*.json)|*.json|All files (*.*)|*.*",
+                     wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (dlg.ShowModal() == wxID_CANCEL) return;
+
+    wxString path = dlg.GetPath();
+    bool started = TraceRecorder::Start(path.ToStdString(), PERF_TRACE_FRAMES,
+        [this, path, alive = aliveFlag](bool written, size_t events, size_t dropped) {
+            wxTheApp->CallAfter([this, path, alive, written, events, dropped]() {
+                if (!alive->load()) return;
+                if (!written) {
+                    wxMessageBox("Could not write the trace to " + path, "Trace Not Saved", wxICON_ERROR);
+                    return;
+                }
+                wxString status = wxString::Format("Trace saved to %s (%zu events", path, events);
+                if (dropped)
+                    status += wxString::Format(", %zu dropped", dropped);
+                SetStatusText(status + ")", 0);
+            });
+        });
+
+    if (!started) {
+        wxMessageBox("A trace is already being recorded.", "Trace Not Started", wxICON_WARNING);
+        return;
+    }
+
+    SetStatusText(isRunning ? "Recording performance trace..." : "Trace starts when emulation runs", 0);
+}
+
+void EmulatorFrame::OnToggleAudioCapture(wxCommandEvent& event) {
+    if (!memoryBus) return;
+
+    wxMenuItem* item = GetMenuBar()->FindItem(ID_ToggleAudioCapture);
+
+    if (audioCapture.IsCapturing()) {
+        uint64_t frames;
+        {
+            //the emulation thread ends capture frames under the lock too, so the last block is handed over here.
+            //waiting on the disk happens after, the emulation thread shouldn't sit behind it
+            std::lock_guard<std::mutex> lock(emuMutex);
+            memoryBus->GetAPU().SetCapture(nullptr);
+            frames = audioCapture.GetFramesWritten();
+            audioCapture.RequestStop();
+        }
+        audioCapture.Stop();
+        item->SetItemLabel("Start &Audio Capture...");
+
+        if (audioCapture.HasFailed()) {
+            SetStatusText("Audio capture failed", 0);
+            wxMessageBox("Writing the audio capture failed partway through, the file is incomplete.", "Audio Capture Failed", wxICON_ERROR);
+            return;
+        }
+
+        SetStatusText(wxString::Format("Audio capture stopped, %.1f seconds", static_cast<double>(frames) / APU::OUTPUT_SAMPLE_RATE), 0);
+        return;
+    }
+
+    wxFileDialog dlg(this, "Save Audio Capture", "", "gbaplusplus_audio.wav",
+                     "WAV files (*.wav)|*.wav|Raw PCM, 16 bit stereo (*.raw)|*.raw|All files (*.*)|*.*",
+                     wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (dlg.ShowModal() == wxID_CANCEL) return;
+
+    //running hash per frame next to it, diff two of these to find where the audio first went different
+    wxString path = dlg.GetPath();
+    wxFileName hashName(path);
+    hashName.SetExt("audiohash.txt");
+
+    bool started;
+    {
+        std::lock_guard<std::mutex> lock(emuMutex);
+        started = audioCapture.Start(path.ToStdString(), AudioCapture::FormatForPath(path.ToStdString()),
+                                     APU::OUTPUT_SAMPLE_RATE, hashName.GetFullPath().ToStdString());
+        if (started)
+            memoryBus->GetAPU().SetCapture(&audioCapture);
+    }
+
+    if (!started) {
+        wxMessageBox("Could not open that file for writing.", "Audio Capture Not Started", wxICON_ERROR);
+        return;
+    }
+
+    item->SetItemLabel("Stop &Audio Capture");
+    SetStatusText("Capturing audio to " + path, 0);
+}
+
 void EmulatorFrame::OnToggleFpsCounter(wxCommandEvent& event) {
     sdlPanel->SetShowFps(event.IsChecked());
 }
 
+void EmulatorFrame::OnTogglePerfOverlay(wxCommandEvent& event) {
+    sdlPanel->SetShowPerfOverlay(event.IsChecked());
+}
+
+void EmulatorFrame::OnToggleThreadedRendering(wxCommandEvent& event) {
+    if (memoryBus) {
+        std::lock_guard<std::mutex> lock(emuMutex);
+        memoryBus->SetDeferredRendering(event.IsChecked());
+    }
+    wxConfigBase::Get()->Write(kThreadedRenderingConfigKey, event.IsChecked());
+}
+
+void EmulatorFrame::OnSelectPacingMode(wxCommandEvent& event) {
+    int mode = event.GetId() - ID_PacingExact;
+    frameLimiter.SetMode(static_cast<FrameLimiter::Mode>(mode));
+    wxConfigBase::Get()->Write(kPacingModeConfigKey, mode);
+}
+
+void EmulatorFrame::OnSelectAudioLatency(wxCommandEvent& event) {
+    long ms = kAudioLatencyChoicesMs[event.GetId() - ID_AudioLatency30];
+    audioRateControl.SetTargetLatency(ms / 1000.0);
+    frameLimiter.SetAudioTarget(ms / 1000.0);
+    wxConfigBase::Get()->Write(kAudioLatencyConfigKey, ms);
+}
+
+void EmulatorFrame::OnSelectAudioQuality(wxCommandEvent& event) {
+    int quality = event.GetId() - ID_AudioQualityFast;
+    SetResamplerQuality(static_cast<Resampler::Quality>(quality));
+    wxConfigBase::Get()->Write(kAudioQualityConfigKey, quality);
+}
+
+void EmulatorFrame::SetResamplerQuality(Resampler::Quality quality) {
+    //the callback owns the resampler, the stream lock keeps it out while it's rebuilt
+    if (audioStream)
+        SDL_LockAudioStream(audioStream);
+    resampler.Configure(APU::OUTPUT_SAMPLE_RATE, audioDeviceRate, quality);
+    if (audioStream)
+        SDL_UnlockAudioStream(audioStream);
+}
+
+void EmulatorFrame::OnMeasureResampler(wxCommandEvent& event) {
+    static const char* const names[] = { "Fast", "Balanced", "High" };
+
+    wxBusyCursor busy;
+    wxString report = wxString::Format("%u Hz to %d Hz\n\n", APU::OUTPUT_SAMPLE_RATE, audioDeviceRate);
+    for (int quality = 0; quality < 3; quality++) {
+        Resampler::Measurement result = Resampler::Measure(static_cast<Resampler::Quality>(quality),
+            APU::OUTPUT_SAMPLE_RATE, audioDeviceRate);
+        report += wxString::Format("%s: %.1f ns per frame, images %.1f dB down\n",
+            names[quality], result.nanosecondsPerFrame, result.aliasRejectionDb);
+    }
+    wxMessageBox(report, "Audio Resampler", wxICON_INFORMATION);
+}
+
+void EmulatorFrame::OnSaveState(wxCommandEvent& event) {
+    if (!biosLoaded || !romLoaded) return;
+
+    double captureMs;
+    {
+        std::lock_guard<std::mutex> lock(emuMutex);
+        auto start = std::chrono::steady_clock::now();
+        saveState.Capture(*cpu, *memoryBus);
+        captureMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (!saveState.SaveToFile(saveStatePath.ToStdString())) {
+        wxMessageBox("Could not write the save state to " + saveStatePath, "State Not Saved", wxICON_ERROR);
+        return;
+    }
+    SetStatusText(wxString::Format("State saved (%.2f ms)", captureMs), 0);
+}
+
+void EmulatorFrame::OnLoadState(wxCommandEvent& event) {
+    if (!biosLoaded || !romLoaded) return;
+
+    if (!saveState.LoadFromFile(saveStatePath.ToStdString())) {
+        wxMessageBox("Could not read a save state from " + saveStatePath, "State Not Loaded", wxICON_WARNING);
+        return;
+    }
+
+    bool restored;
+    double restoreMs;
+    {
+        std::lock_guard<std::mutex> lock(emuMutex);
+        auto start = std::chrono::steady_clock::now();
+        restored = saveState.Restore(*cpu, *memoryBus);
+        restoreMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        //states don't carry audio, whatever's queued belongs to the moment before the load. still under the
+        //lock so the emulation thread can't slip in samples from the old moment first
+        if (restored)
+            FlushAudio();
+    }
+
+    if (!restored) {
+        wxMessageBox("That save state is from a different ROM or a different version of the emulator.",
+                     "State Not Loaded", wxICON_WARNING);
+        return;
+    }
+
+    sdlPanel->NotifyFrameReady();
+    UpdateDebugWindows();
+    SetStatusText(wxString::Format("State loaded (%.2f ms)", restoreMs), 0);
+}
+
+void EmulatorFrame::OnVerifySaveState(wxCommandEvent& event) {
+    if (!biosLoaded) return;
+    if (isRunning) {
+        wxMessageBox("Pause emulation first, the check runs the same frames twice.", "Save State Check", wxICON_INFORMATION);
+        return;
+    }
+
+    wxBusyCursor busy;
+    SaveState start;
+    SaveState check;
+    SaveState first;
+    SaveState second;
+    double captureMs = 0.0;
+    double restoreMs = 0.0;
+    wxString problem;
+    std::string error;
+
+    //with emulation paused the audio device is stopped, so nothing drains the ring between the two runs
+    FlushAudio();
+    {
+        std::lock_guard<std::mutex> lock(emuMutex);
+        //a running audio capture shouldn't get the replayed second twice
+        memoryBus->GetAPU().SetCapture(nullptr);
+
+        auto startTime = std::chrono::steady_clock::now();
+        start.Capture(*cpu, *memoryBus);
+        captureMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+        startTime = std::chrono::steady_clock::now();
+        bool restored = start.Restore(*cpu, *memoryBus);
+        restoreMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+
+        check.Capture(*cpu, *memoryBus);
+        const char* difference = check.FindFirstDifference(start);
+
+        if (!restored) {
+            problem = "The state could not be restored onto the machine it came from.";
+        } else if (difference) {
+            problem = wxString::Format("Restoring the state changed the %s section.", difference);
+        } else if (!RunFrames(SAVE_STATE_CHECK_FRAMES, error)) {
+            problem = "The CPU stopped during the first run: " + error;
+        } else {
+            first.Capture(*cpu, *memoryBus);
+            FlushAudio();
+            start.Restore(*cpu, *memoryBus);
+
+            if (!RunFrames(SAVE_STATE_CHECK_FRAMES, error)) {
+                problem = "The CPU stopped during the second run: " + error;
+            } else {
+                second.Capture(*cpu, *memoryBus);
+                difference = second.FindFirstDifference(first);
+                if (difference)
+                    problem = wxString::Format("Two runs of %d frames from the same state ended up different, first in the %s section.",
+                                               SAVE_STATE_CHECK_FRAMES, difference);
+            }
+        }
+
+        //leave everything where it was before the check
+        FlushAudio();
+        start.Restore(*cpu, *memoryBus);
+        if (audioCapture.IsCapturing())
+            memoryBus->GetAPU().SetCapture(&audioCapture);
+    }
+    UpdateDebugWindows();
+
+    if (!problem.empty()) {
+        wxMessageBox(problem, "Save State Check Failed", wxICON_ERROR);
+        return;
+    }
+
+    wxMessageBox(wxString::Format("%zu KB per state, captured in %.3f ms and restored in %.3f ms.\n\n"
+                                  "Restoring gave back the same bytes, and %d frames run twice from it came out identical.",
+                                  start.GetSize() / 1024, captureMs, restoreMs, SAVE_STATE_CHECK_FRAMES),
+                 "Save State Check", wxICON_INFORMATION);
+}
+
+bool EmulatorFrame::RunFrames(int count, std::string& error) {
+    try
+    {
+        for (int frame = 0; frame < count; frame++)
+        {
+            uint64_t targetCycles = cpu->GetTotalCycles() + CYCLES_PER_FRAME;
+            while (cpu->GetTotalCycles() < targetCycles)
+                cpu->runCpuStep();
+            memoryBus->SyncAudio();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
 void EmulatorFrame::InitAudio() {
     audioScratch.resize(AUDIO_SCRATCH_FRAMES * 2);
+    resamplerInput.resize(AUDIO_SCRATCH_FRAMES * 2);
+    //at top speed one callback can eat this many apu frames, plus the stretch's search window
+    static_assert(APU::FRAME_RING_CAPACITY >= AUDIO_SCRATCH_FRAMES * TimeStretch::MAX_SPEED, "the apu ring can't cover a callback at top speed");
+    stretchInput.resize(static_cast<size_t>(AUDIO_SCRATCH_FRAMES * (TimeStretch::MAX_SPEED + 1.0)) * 2);
+
+    //ask for the device's own rate so the only conversion is ours
+    SDL_AudioSpec deviceSpec{};
+    if (SDL_GetAudioDeviceFormat(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &deviceSpec, nullptr) && deviceSpec.freq > 0)
+        audioDeviceRate = deviceSpec.freq;
+    resampler.Configure(APU::OUTPUT_SAMPLE_RATE, audioDeviceRate, resampler.GetQuality());
 
     SDL_AudioSpec spec{};
     spec.format = SDL_AUDIO_S16;
     spec.channels = 2;
-    spec.freq = static_cast<int>(APU::OUTPUT_SAMPLE_RATE);
+    spec.freq = audioDeviceRate;
 
-    audioStream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, nullptr, nullptr);
+    //opens paused, the emulation thread resumes it while it runs so a paused emulator isn't one long underrun
+    audioStream = SDL_OpenAudioDeviceStream(SDL_AUDIO_DEVICE_DEFAULT_PLAYBACK, &spec, &EmulatorFrame::AudioStreamCallback, this);
     if (!audioStream) {
         wxLogWarning("Could not open an audio device, running silent: %s", SDL_GetError());
         return;
     }
 
-    SDL_ResumeAudioStreamDevice(audioStream);
+    frameLimiter.SetAudioClock([this]() { return GetQueuedAudioSeconds(); }, audioRateControl.GetTargetLatency());
 }
 
 void EmulatorFrame::ShutdownAudio() {
     if (!audioStream) return;
 
+    frameLimiter.SetAudioClock(nullptr, 0.0);
+
     SDL_DestroyAudioStream(audioStream);
     audioStream = nullptr;
 }
 
 void EmulatorFrame::FlushAudio() {
-    if (!audioStream) return;
+    if (!audioStream || !memoryBus) return;
 
+    //holding the stream lock keeps the callback out, so this is the ring's only consumer for the moment
+    SDL_LockAudioStream(audioStream);
     SDL_ClearAudioStream(audioStream);
+    memoryBus->GetAPU().DiscardSamples();
+    audioRateControl.Reset();
+    resampler.Reset();
+    timeStretch.Reset();
+    SDL_UnlockAudioStream(audioStream);
+}
 
-    if (!memoryBus) return;
-    std::lock_guard<std::mutex> lock(emuMutex);
-    memoryBus->GetAPU().ReadSamples(audioScratch.data(), AUDIO_SCRATCH_FRAMES);
+void SDLCALL EmulatorFrame::AudioStreamCallback(void* userdata, SDL_AudioStream* stream, int additionalAmount, int totalAmount) {
+    static_cast<EmulatorFrame*>(userdata)->PumpAudio(stream, additionalAmount);
 }
 
-void EmulatorFrame::PumpAudio() {
-    if (!audioStream || !memoryBus) return;
+void EmulatorFrame::PumpAudio(SDL_AudioStream* stream, int requestedBytes) {
+    static thread_local bool threadNamed = false;
+    if (!threadNamed) {
+        TraceRecorder::SetThreadName("Audio");
+        threadNamed = true;
+    }
 
-    size_t frames;
-    {
-        std::lock_guard<std::mutex> lock(emuMutex);
-        frames = memoryBus->GetAPU().ReadSamples(audioScratch.data(), AUDIO_SCRATCH_FRAMES);
+    TRACE_SCOPE("Audio pump");
+
+    size_t wanted = std::min(static_cast<size_t>(std::max(requestedBytes, 0)) / (2 * sizeof(int16_t)), AUDIO_SCRATCH_FRAMES);
+    if (wanted == 0) return;
+
+    double queuedSeconds = GetQueuedAudioSeconds();
+    audioQueueDepth.RecordSeconds(queuedSeconds);
+
+    //above 1 the resampler eats apu samples faster than the device plays them back, which drains the buffer
+    double ratio = audioRateControl.Update(queuedSeconds);
+
+    //a short read is counted as an underrun by the ring, sdl pads the rest with silence
+    size_t needed = std::min(resampler.InputFramesNeeded(wanted, ratio), AUDIO_SCRATCH_FRAMES);
+    size_t read;
+    double speed = audioSpeed.load(std::memory_order_relaxed);
+    if (speed > TimeStretch::MIN_SPEED) {
+        //a fresh start rather than whatever was left from the last time, that audio is long stale
+        if (!stretchActive) {
+            timeStretch.Reset();
+            stretchActive = true;
+        }
+        timeStretch.SetSpeed(speed);
+
+        size_t raw = std::min(timeStretch.InputFramesNeeded(needed), stretchInput.size() / 2);
+        timeStretch.Push(stretchInput.data(), memoryBus->GetAPU().ReadSamples(stretchInput.data(), raw));
+        read = timeStretch.Process(resamplerInput.data(), needed);
+    } else {
+        stretchActive = false;
+        read = memoryBus->GetAPU().ReadSamples(resamplerInput.data(), needed);
     }
+    resampler.Push(resamplerInput.data(), read);
 
+    size_t frames = resampler.Process(audioScratch.data(), wanted, ratio);
     if (frames == 0) return;
 
-    const int maxQueuedBytes = static_cast<int>(APU::OUTPUT_SAMPLE_RATE / 4) * 2 * sizeof(int16_t);
-    if (SDL_GetAudioStreamQueued(audioStream) > maxQueuedBytes)
-        return;
+    SDL_PutAudioStreamData(stream, audioScratch.data(), static_cast<int>(frames * 2 * sizeof(int16_t)));
+}
+
+double EmulatorFrame::GetQueuedAudioSeconds() const {
+    //whatever's still in the ring plus whatever sdl is already holding on to. while stretching the ring
+    //plays speed times faster than its rate says
+    size_t frames = memoryBus ? memoryBus->GetAPU().GetQueuedFrames() : 0;
+    double seconds = frames / (APU::OUTPUT_SAMPLE_RATE * audioSpeed.load(std::memory_order_relaxed));
 
-    SDL_PutAudioStreamData(audioStream, audioScratch.data(),
-        static_cast<int>(frames * 2 * sizeof(int16_t)));
+    int queuedBytes = audioStream ? SDL_GetAudioStreamQueued(audioStream) : 0;
+    return seconds + std::max(queuedBytes, 0) / (audioDeviceRate * 2.0 * sizeof(int16_t));
 }
 
 void EmulatorFrame::EmulationThreadFunc() {
     //different thread, avoid ui lag
-    //windows fucking SUCKS so i have to call ts
-    timeBeginPeriod(1);
+    TraceRecorder::SetThreadName("Emulation");
 
-    auto lastTime = std::chrono::steady_clock::now();
-    double accumulator = 0.0;
+    frameLimiter.SetSpeed(1.0);
+    frameLimiter.Start();
+
+    if (audioStream)
+        SDL_ResumeAudioStreamDevice(audioStream);
 
     fpsWindowStart = std::chrono::steady_clock::now();
     fpsFrameCount = 0;
 
     while (!stopRequested.load(std::memory_order_relaxed)) {
-        auto   currentTime = std::chrono::steady_clock::now();
-        double deltaTime    = std::chrono::duration<double>(currentTime - lastTime).count();
-        lastTime = currentTime;
-
-        //if we dont do this we FUCKING DIE.
-        if (deltaTime > 0.1) deltaTime = 0.1;
-        accumulator += deltaTime;
+        bool fastForwarding = fastForward.load(std::memory_order_relaxed);
+        frameLimiter.SetSpeed(fastForwarding ? FAST_FORWARD_SPEED : 1.0);
+
+        //unthrottled runs as fast as it can, the measured rate is the best guess at how much to squeeze.
+        //anything close to real time is left to rate control rather than stretched
+        double speed = fastForwarding ? FAST_FORWARD_SPEED : 1.0;
+        if (frameLimiter.GetMode() == FrameLimiter::Mode::Unthrottled)
+            speed = std::max(speed, emulationFps.load(std::memory_order_relaxed) / TARGET_FPS);
+        if (speed < 1.1)
+            speed = 1.0;
+        audioSpeed.store(std::min(std::max(speed, TimeStretch::MIN_SPEED), TimeStretch::MAX_SPEED), std::memory_order_relaxed);
 
-        bool ranAFrame = false;
         bool hadError = false;
         std::string errorMessage;
 
-        while (accumulator >= FRAME_TIME) {
-            auto stepStart = std::chrono::steady_clock::now();
+        auto stepStart = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(emuMutex);
+
+            //when we're behind only the end of the catch up reaches the screen. a frame straddles two steps
+            //so the last two get composed, everything before that is skipped outright
+            memoryBus->SetFrameOutputWanted(frameLimiter.FramesBehind() < 2);
+            memoryBus->SetFrameSkip(fastForwarding ? FAST_FORWARD_SKIP : 0, FAST_FORWARD_SKIP + 1);
+
+            PROFILE_SCOPE(ZONE_FRAME);
+
+            //use real cycle cost. compose, dma and irq slices land inside this one, the gaps between them are the cpu
+            uint64_t targetCycles = cpu->GetTotalCycles() + CYCLES_PER_FRAME;
             {
-                std::lock_guard<std::mutex> lock(emuMutex);
-                //use real cycle cost
-                uint64_t targetCycles = cpu->GetTotalCycles() + CYCLES_PER_FRAME;
+                TRACE_SCOPE("Run CPU");
                 while (cpu->GetTotalCycles() < targetCycles)
                 {
                     try
@@ -566,26 +1079,26 @@ void EmulatorFrame::EmulationThreadFunc() {
                     }
                 }
             }
-            auto stepEnd = std::chrono::steady_clock::now();
-            LogFrameTiming(std::chrono::duration<double>(stepEnd - stepStart).count());
-
-            PumpAudio();
-
-            fpsFrameCount++;
-            double fpsElapsed = std::chrono::duration<double>(
-                std::chrono::steady_clock::now() - fpsWindowStart).count();
-            if (fpsElapsed >= 0.25) {
-                emulationFps.store(fpsFrameCount / fpsElapsed, std::memory_order_relaxed);
-                fpsFrameCount = 0;
-                fpsWindowStart = std::chrono::steady_clock::now();
-            }
 
-            accumulator -= FRAME_TIME;
-            ranAFrame = true;
-            if (hadError) break;
+            //the apu only makes samples when something asks, this hands the callback the rest of the frame
+            memoryBus->SyncAudio();
+            audioCapture.EndFrame();
 
-            //let the mutex like actually fucking work... please
-            std::this_thread::yield();
+            //only copies the sectors the game touched, the writer thread does the disk part later
+            saveFile.Update(memoryBus->GetSaveMedia().ConsumeDirtySectors());
+        }
+        auto stepEnd = std::chrono::steady_clock::now();
+        HostProfiler::EndFrame();
+        TraceRecorder::EndFrame();
+        LogFrameTiming(std::chrono::duration<double>(stepEnd - stepStart).count());
+
+        fpsFrameCount++;
+        double fpsElapsed = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - fpsWindowStart).count();
+        if (fpsElapsed >= 0.25) {
+            emulationFps.store(fpsFrameCount / fpsElapsed, std::memory_order_relaxed);
+            fpsFrameCount = 0;
+            fpsWindowStart = std::chrono::steady_clock::now();
         }
 
         if (hadError) {
@@ -600,8 +1113,10 @@ void EmulatorFrame::EmulationThreadFunc() {
             break;
         }
 
+        sdlPanel->NotifyFrameReady();
+
         //skip if we dont care yet
-        if (ranAFrame && !framePending.exchange(true)) {
+        if (!framePending.exchange(true)) {
             wxTheApp->CallAfter([this, alive = aliveFlag]() {
                 if (!alive->load()) return;
                 framePending.store(false);
@@ -609,47 +1124,84 @@ void EmulatorFrame::EmulationThreadFunc() {
             });
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        //let the mutex like actually fucking work... please (catch up and unthrottled never sleep)
+        std::this_thread::yield();
+
+        frameLimiter.WaitForNextFrame();
     }
 
     //nothing running, dont keep showing
     emulationFps.store(0.0, std::memory_order_relaxed);
 
-    timeEndPeriod(1);
+    if (audioStream)
+        SDL_PauseAudioStreamDevice(audioStream);
+
+    //stepping and frame dumps want every frame again
+    {
+        std::lock_guard<std::mutex> lock(emuMutex);
+        memoryBus->SetFrameOutputWanted(true);
+        memoryBus->SetFrameSkip(0, 0);
+    }
+
+    frameLimiter.Stop();
 }
 
 void EmulatorFrame::LogFrameTiming(double stepSeconds) {
-    perfFrameCount++;
-    perfBusyTimeSum += stepSeconds;
-    if (stepSeconds > perfMaxStepSeconds)
-        perfMaxStepSeconds = stepSeconds;
-    if (stepSeconds > FRAME_TIME)
-        perfOverBudgetCount++;
+    stepTimes.RecordSeconds(stepSeconds);
 
     auto now = std::chrono::steady_clock::now();
     double windowElapsed = std::chrono::duration<double>(now - perfWindowStart).count();
-    if (windowElapsed < 0.5 || perfFrameCount == 0)
+    if (windowElapsed < 0.5)
         return;
 
+    FrameLimiter::Stats pacing = frameLimiter.TakeStats();
+    const APU::OutputRing& audioRing = memoryBus->GetAPU().GetOutputRing();
+    uint64_t audioUnderruns = audioRing.GetUnderruns();
+    uint64_t audioOverrunFrames = audioRing.GetOverrunFrames();
+    AudioRateControl::Stats rateControl = audioRateControl.TakeStats();
+    TimeStretch::Stats stretch = timeStretch.TakeStats();
+    double stretchSpeed = audioSpeed.load(std::memory_order_relaxed);
+
+    //diffing against the last dump gives just this window without ever stopping the recorders
+    LatencyHistogram::Snapshot stepSnapshot = stepTimes.TakeSnapshot();
+    LatencyHistogram::Snapshot presentSnapshot = sdlPanel->GetPresentIntervals().TakeSnapshot();
+    LatencyHistogram::Snapshot audioSnapshot = audioQueueDepth.TakeSnapshot();
+    LatencyHistogram::Snapshot stepWindow = stepSnapshot.Since(lastStepSnapshot);
+
     if (perfLog.is_open()) {
-        double budgetMs = FRAME_TIME * 1000.0;
-        double avgMs = (perfBusyTimeSum / static_cast<double>(perfFrameCount)) * 1000.0;
-        double maxMs = perfMaxStepSeconds * 1000.0;
-        double achievedFps = static_cast<double>(perfFrameCount) / windowElapsed;
-
-        perfLog << "frames=" << perfFrameCount
-                << " avg=" << avgMs << "ms (" << (avgMs / budgetMs * 100.0) << "% of " << budgetMs << "ms budget)"
-                << " max=" << maxMs << "ms"
-                << " over_budget=" << perfOverBudgetCount << "/" << perfFrameCount
-                << " ~fps=" << achievedFps
-                << "\n";
+        perfLog << "{\"t\":" << std::chrono::duration<double>(now - perfLogStart).count()
+                << ",\"fps\":" << (stepWindow.Count() / windowElapsed)
+                << ",\"over_budget\":" << stepWindow.CountAbove(static_cast<uint32_t>(FRAME_TIME * 1e6));
+        WriteSummaryJson(perfLog, "step_us", stepWindow.Summarize());
+        WriteSummaryJson(perfLog, "present_us", presentSnapshot.Since(lastPresentSnapshot).Summarize());
+        WriteSummaryJson(perfLog, "audio_queue_us", audioSnapshot.Since(lastAudioSnapshot).Summarize());
+        perfLog << ",\"vsync\":" << (sdlPanel->IsVsyncEnabled() ? "true" : "false")
+                << ",\"pacing\":{\"frames\":" << pacing.frames
+                << ",\"late\":" << pacing.lateFrames
+                << ",\"avg_error_us\":" << pacing.averageErrorUs
+                << ",\"max_error_us\":" << pacing.maxErrorUs
+                << "},\"audio\":{\"underruns\":" << (audioUnderruns - lastAudioUnderruns)
+                << ",\"overrun_frames\":" << (audioOverrunFrames - lastAudioOverrunFrames)
+                << ",\"target_ms\":" << (audioRateControl.GetTargetLatency() * 1000.0)
+                << ",\"fill_ms\":" << (rateControl.averageFillSeconds * 1000.0)
+                << ",\"drift_ppm\":" << rateControl.averagePpm
+                << ",\"ratio_ppm\":" << rateControl.ratioPpm
+                << ",\"ratio_min_ppm\":" << rateControl.minPpm
+                << ",\"ratio_max_ppm\":" << rateControl.maxPpm
+                << ",\"stretch\":{\"speed\":" << stretchSpeed
+                << ",\"in_frames\":" << stretch.inputFrames
+                << ",\"out_frames\":" << stretch.outputFrames
+                << ",\"ns_per_frame\":" << (stretch.outputFrames ? static_cast<double>(stretch.nanoseconds) / stretch.outputFrames : 0.0)
+                << ",\"cpu_pct\":" << (stretch.nanoseconds / 1e9 / windowElapsed * 100.0)
+                << "}}}\n";
         perfLog.flush();
     }
 
-    perfFrameCount = 0;
-    perfBusyTimeSum = 0.0;
-    perfMaxStepSeconds = 0.0;
-    perfOverBudgetCount = 0;
+    lastStepSnapshot = std::move(stepSnapshot);
+    lastPresentSnapshot = std::move(presentSnapshot);
+    lastAudioSnapshot = std::move(audioSnapshot);
+    lastAudioUnderruns = audioUnderruns;
+    lastAudioOverrunFrames = audioOverrunFrames;
     perfWindowStart = now;
 }
 
@@ -662,9 +1214,12 @@ void EmulatorFrame::PollInput() {
     //get input from OS rather than wx.... because idk its probably better?
     if (!IsActive()) {
         input.ReleaseAll();
+        fastForward.store(false, std::memory_order_relaxed);
         return;
     }
 
+    fastForward.store(wxGetKeyState(static_cast<wxKeyCode>(FAST_FORWARD_KEY)), std::memory_order_relaxed);
+
     uint16_t mask = 0;
     for (GbaButton button : InputMap::AllButtons()) {
         const int keyCode = inputMap.GetKeyFor(button);
@@ -688,7 +1243,6 @@ void EmulatorFrame::OnConfigureInput(wxCommandEvent& event) {
 void EmulatorFrame::OnFrameComplete() {
     //runs on the UI thread via CallAfter.
     PollInput();
-    sdlPanel->Render();
 
     static int frameCount = 0;
     if (++frameCount >= 10) {
@@ -719,16 +1273,15 @@ SDLPanel::SDLPanel(wxWindow* parent)
     , sdlRenderer(nullptr)
     , gbaTexture(nullptr)
     , memoryBus(nullptr)
-    , memoryMutex(nullptr)
 {
     SetBackgroundStyle(wxBG_STYLE_PAINT);
     SetBackgroundColour(*wxBLACK);
 
     Bind(wxEVT_SIZE, [this](wxSizeEvent& event) {
-        if (sdlWindow) {
-            wxSize size = GetSize();
-            SDL_SetWindowSize(sdlWindow, size.GetWidth(), size.GetHeight());
-        }
+        //the present applies it, sdl is never touched from here while the renderer could be drawing
+        wxSize size = GetSize();
+        pendingSize.store((static_cast<uint64_t>(std::max(size.GetWidth(), 1)) << 32) | static_cast<uint32_t>(std::max(size.GetHeight(), 1)));
+        NotifyFrameReady();
         event.Skip();
     });
 
@@ -736,24 +1289,46 @@ SDLPanel::SDLPanel(wxWindow* parent)
 }
 
 SDLPanel::~SDLPanel() {
-    if (fpsTexture)  SDL_DestroyTexture(fpsTexture);
+    StopPresenting();
     if (fpsFont)     TTF_CloseFont(fpsFont);
-    if (gbaTexture)  SDL_DestroyTexture(gbaTexture);
-    if (sdlRenderer) SDL_DestroyRenderer(sdlRenderer);
     if (sdlWindow)   SDL_DestroyWindow(sdlWindow);
 }
 
+void SDLPanel::StopPresenting() {
+    if (presentThread.joinable()) {
+        presentStopRequested.store(true);
+        frameReadyCondition.notify_one();
+        presentThread.join();
+    }
+
+    //the present thread destroys its own renderer on the way out, this is for the ui thread path. a present
+    //that was already queued finds nothing to draw with
+    DestroyRenderer();
+    memoryBus = nullptr;
+}
+
+void SDLPanel::NotifyFrameReady() {
+    //no lock on purpose, a missed wakeup just costs the present thread one wait timeout
+    frameReady.store(true, std::memory_order_release);
+    frameReadyCondition.notify_one();
+}
+
 void SDLPanel::SetShowFps(bool show) {
     showFps = show;
 }
 
+void SDLPanel::SetShowPerfOverlay(bool show) {
+    showPerfOverlay = show;
+}
+
 void SDLPanel::SetFpsSource(const std::atomic<double>* fps) {
     fpsSource = fps;
 }
 
-void SDLPanel::SetSource(MemoryBus* bus, std::mutex* mutex) {
+void SDLPanel::SetSource(MemoryBus* bus) {
     memoryBus = bus;
-    memoryMutex = mutex;
+    //a fresh bus starts its line versions over
+    lastSeenLine = 0;
 }
 
 void SDLPanel::InitSDL() {
@@ -784,38 +1359,159 @@ void SDLPanel::InitSDL() {
         return;
     }
 
+    const char* basePath = SDL_GetBasePath();
+    wxString fontPath = wxString(basePath ? basePath : "") + "Assets" + wxFileName::GetPathSeparator() + "NotoSans-Regular.ttf";
+    fpsFont = TTF_OpenFont(fontPath.ToStdString().c_str(), 18.0f);
+    if (!fpsFont)
+        wxLogError("Failed to load FPS counter font (%s): %s", fontPath, SDL_GetError());
+
+    const SDL_DisplayMode* mode = SDL_GetCurrentDisplayMode(SDL_GetDisplayForWindow(sdlWindow));
+    if (mode && mode->refresh_rate > 0.0f)
+        refreshInterval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 / mode->refresh_rate));
+
+    if (kPresentOnUiThread && !CreateRenderer()) {
+        DestroyRenderer();
+        return;
+    }
+
+    TraceRecorder::SetThreadName("UI");
+    lastPresent = std::chrono::steady_clock::now();
+    presentStopRequested.store(false);
+    presentThread = std::thread(&SDLPanel::PresentLoop, this);
+}
+
+bool SDLPanel::CreateRenderer() {
     sdlRenderer = SDL_CreateRenderer(sdlWindow, nullptr);
     if (!sdlRenderer) {
-        wxLogError("Failed to create SDL renderer: %s", SDL_GetError());
-        return;
+        wxString error = SDL_GetError();
+        wxTheApp->CallAfter([error]() { wxLogError("Failed to create SDL renderer: %s", error); });
+        return false;
     }
 
-    gbaTexture = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888,
+    //16 bit upload, half the bytes of argb and every gba color still fits exactly
+    gbaTexture = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_RGB565,
         SDL_TEXTUREACCESS_STREAMING, 240, 160);
     if (!gbaTexture) {
-        wxLogError("Failed to create GBA framebuffer texture: %s", SDL_GetError());
-        return;
+        wxString error = SDL_GetError();
+        wxTheApp->CallAfter([error]() { wxLogError("Failed to create GBA framebuffer texture: %s", error); });
+        return false;
     }
     SDL_SetTextureScaleMode(gbaTexture, SDL_SCALEMODE_NEAREST);
+    lastSeenLine = 0;
 
-    const char* basePath = SDL_GetBasePath();
-    wxString fontPath = wxString(basePath ? basePath : "") + "Assets" + wxFileName::GetPathSeparator() + "NotoSans-Regular.ttf";
-    fpsFont = TTF_OpenFont(fontPath.ToStdString().c_str(), 18.0f);
-    if (!fpsFont)
-        wxLogError("Failed to load FPS counter font (%s): %s", fontPath, SDL_GetError());
+    //a vsynced present blocks until the display takes it, fine on the present thread but never on the ui
+    //thread. not every driver can do it, without it the loop's deadline is all that keeps presents in step
+    vsyncEnabled.store(!kPresentOnUiThread && SDL_SetRenderVSync(sdlRenderer, 1));
+    return true;
 }
 
-void SDLPanel::Render() {
-    if (!sdlRenderer || !gbaTexture) return;
+void SDLPanel::DestroyRenderer() {
+    if (fpsTexture)  SDL_DestroyTexture(fpsTexture);
+    if (perfTexture) SDL_DestroyTexture(perfTexture);
+    if (gbaTexture)  SDL_DestroyTexture(gbaTexture);
+    if (sdlRenderer) SDL_DestroyRenderer(sdlRenderer);
+    fpsTexture = nullptr;
+    perfTexture = nullptr;
+    gbaTexture = nullptr;
+    sdlRenderer = nullptr;
+}
+
+void SDLPanel::PresentLoop() {
+    TraceRecorder::SetThreadName("Present");
+
+    if (!kPresentOnUiThread && !CreateRenderer()) {
+        DestroyRenderer();
+        return;
+    }
+
+    auto nextPresent = std::chrono::steady_clock::now();
+    while (!presentStopRequested.load()) {
+        //sleep until the emulator hands off a frame or the panel resizes, the timeout keeps the overlays
+        //drawing while paused
+        {
+            std::unique_lock<std::mutex> lock(presentMutex);
+            frameReadyCondition.wait_for(lock, std::chrono::milliseconds(50), [this] {
+                return frameReady.load(std::memory_order_acquire) || presentStopRequested.load();
+            });
+        }
+        if (presentStopRequested.load())
+            break;
+
+        //fast forward hands off frames far quicker than the display shows them, one present per refresh is
+        //plenty. with vsync the present itself waits that out
+        if (!vsyncEnabled.load(std::memory_order_relaxed)) {
+            std::this_thread::sleep_until(nextPresent);
+            nextPresent += refreshInterval;
+            auto now = std::chrono::steady_clock::now();
+            if (nextPresent < now)
+                nextPresent = now;
+        }
+
+        frameReady.store(false, std::memory_order_relaxed);
+        if (kPresentOnUiThread)
+            RequestPresent();
+        else
+            Present();
+    }
+
+    if (!kPresentOnUiThread)
+        DestroyRenderer();
+}
+
+void SDLPanel::RequestPresent() {
+    //thread safe, the event just lands in the ui thread's queue
+    if (!presentPending.exchange(true))
+        CallAfter(&SDLPanel::Present);
+}
 
-    static uint32_t pixels[240 * 160];
+void SDLPanel::ApplyPendingSize() {
+    uint64_t size = pendingSize.exchange(0);
+    if (size && sdlWindow)
+        SDL_SetWindowSize(sdlWindow, static_cast<int>(size >> 32), static_cast<int>(size & 0xFFFFFFFF));
+}
+
+void SDLPanel::Present() {
+    presentPending.store(false);
+    if (!sdlRenderer) return;
 
-    if (memoryBus && memoryMutex) {
-        std::lock_guard<std::mutex> lock(*memoryMutex);
-        memoryBus->RenderFrame(pixels);
+    ApplyPendingSize();
+
+    {
+        PROFILE_SCOPE(ZONE_PRESENT);
+        Render();
     }
 
-    SDL_UpdateTexture(gbaTexture, nullptr, pixels, 240 * sizeof(uint32_t));
+    auto now = std::chrono::steady_clock::now();
+    presentIntervals.RecordSeconds(std::chrono::duration<double>(now - lastPresent).count());
+    lastPresent = now;
+}
+
+void SDLPanel::Render() {
+    if (!sdlRenderer || !gbaTexture) return;
+
+    std::array<bool, 160> changedLines{};
+    int changedCount = 0;
+
+    if (memoryBus)
+        changedCount = memoryBus->PresentChangedLines(framePixels.data(), PPU::PixelFormat::RGB565, lastSeenLine, &changedLines);
+
+    //static screens upload nothing, otherwise just the band between the first and last changed line
+    if (changedCount > 0) {
+        int first = 0;
+        while (!changedLines[first]) first++;
+        int last = 159;
+        while (!changedLines[last]) last--;
+
+        SDL_Rect band = { 0, first, 240, last - first + 1 };
+        void* texturePixels;
+        int texturePitch;
+        if (SDL_LockTexture(gbaTexture, &band, &texturePixels, &texturePitch)) {
+            for (int y = first; y <= last; y++)
+                std::memcpy(static_cast<uint8_t*>(texturePixels) + (y - first) * texturePitch,
+                    framePixels.data() + y * 240, 240 * sizeof(uint16_t));
+            SDL_UnlockTexture(gbaTexture);
+        }
+    }
 
     SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 255);
     SDL_RenderClear(sdlRenderer);
@@ -835,9 +1531,13 @@ void SDLPanel::Render() {
 
     SDL_RenderTexture(sdlRenderer, gbaTexture, nullptr, &destRect);
 
-    if (showFps)
+    bool fpsShown = showFps.load(std::memory_order_relaxed);
+    if (fpsShown)
         RenderFpsCounter(panelWidth);
 
+    if (showPerfOverlay.load(std::memory_order_relaxed))
+        RenderPerfOverlay(panelWidth, fpsShown && fpsTexture ? 6.0f + fpsTextureHeight + 8.0f : 6.0f);
+
     SDL_RenderPresent(sdlRenderer);
 }
 
@@ -867,11 +1567,46 @@ void SDLPanel::RenderFpsCounter(int panelWidth) {
     if (!fpsTexture) return;
 
     const float margin = 6.0f;
+    DrawOverlayText(fpsTexture, fpsTextureWidth, fpsTextureHeight, panelWidth - fpsTextureWidth - margin, margin);
+}
+
+void SDLPanel::RenderPerfOverlay(int panelWidth, float top) {
+    if (!fpsFont) return;
+
+    auto now = std::chrono::steady_clock::now();
+    if (!perfTexture || now - perfTextureTime >= std::chrono::milliseconds(250)) {
+        perfTextureTime = now;
+
+        HostProfiler::FrameTimes times = HostProfiler::GetLastFrame();
+
+        char text[128];
+        snprintf(text, sizeof(text), "CPU %.2f  PPU %.2f  DMA %.2f  APU %.2f  Present %.2f ms",
+            times.cpuUs / 1000.0, times.composeUs / 1000.0, times.dmaUs / 1000.0,
+            times.apuUs / 1000.0, times.presentUs / 1000.0);
+
+        SDL_Color color{255, 255, 0, 255};
+        SDL_Surface* surface = TTF_RenderText_Blended(fpsFont, text, 0, color);
+        if (!surface) return;
+
+        if (perfTexture) SDL_DestroyTexture(perfTexture);
+        perfTexture = SDL_CreateTextureFromSurface(sdlRenderer, surface);
+        perfTextureWidth = surface->w;
+        perfTextureHeight = surface->h;
+        SDL_DestroySurface(surface);
+    }
+
+    if (!perfTexture) return;
+
+    const float margin = 6.0f;
+    DrawOverlayText(perfTexture, perfTextureWidth, perfTextureHeight, panelWidth - perfTextureWidth - margin, top);
+}
+
+void SDLPanel::DrawOverlayText(SDL_Texture* texture, int width, int height, float x, float y) {
     SDL_FRect dest;
-    dest.w = static_cast<float>(fpsTextureWidth);
-    dest.h = static_cast<float>(fpsTextureHeight);
-    dest.x = panelWidth - dest.w - margin;
-    dest.y = margin;
+    dest.w = static_cast<float>(width);
+    dest.h = static_cast<float>(height);
+    dest.x = x;
+    dest.y = y;
 
     //dark backing rect so the yellow text stays legible over bright backgrounds
     SDL_FRect backing = dest;
@@ -880,5 +1615,5 @@ void SDLPanel::RenderFpsCounter(int panelWidth) {
     SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 140);
     SDL_RenderFillRect(sdlRenderer, &backing);
 
-    SDL_RenderTexture(sdlRenderer, fpsTexture, nullptr, &dest);
+    SDL_RenderTexture(sdlRenderer, texture, nullptr, &dest);
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <SDL3/SDL.h>
 #include <SDL3_ttf/SDL_ttf.h>
 #include <chrono>
+#include <condition_variable>
 #include <thread>
 #include <mutex>
 #include <atomic>
@@ -14,7 +15,16 @@
 #include "../AGB/ARM7TDMI.h"
 #include "../AGB/MemoryBus.h"
 #include "../AGB/ARMRegisters.h"
+#include "../AGB/AudioCapture.h"
+#include "../AGB/HostProfiler.h"
+#include "../AGB/Resampler.h"
+#include "../AGB/SaveFile.h"
+#include "../AGB/SaveState.h"
+#include "../AGB/TimeStretch.h"
+#include "AudioRateControl.h"
+#include "FrameLimiter.h"
 #include "InputMap.h"
+#include "LatencyHistogram.h"
 
 class SDLPanel;
 class RegisterFrame;
@@ -24,6 +34,10 @@ class EmulatorFrame : public wxFrame {
 public:
     EmulatorFrame();
     ~EmulatorFrame();
+
+    //everything since the emulator started, in microseconds. safe to read from any thread
+    const LatencyHistogram& GetStepTimes() const { return stepTimes; }
+    const LatencyHistogram& GetAudioQueueDepth() const { return audioQueueDepth; }
     
 private:
     void OnOpen(wxCommandEvent& event);
@@ -39,8 +53,19 @@ private:
     void OnToggleTrace(wxCommandEvent& event);
     void OnDumpPPUState(wxCommandEvent& event);
     void OnDumpFrameImage(wxCommandEvent& event);
+    void OnRecordPerfTrace(wxCommandEvent& event);
+    void OnToggleAudioCapture(wxCommandEvent& event);
     void OnToggleFpsCounter(wxCommandEvent& event);
+    void OnTogglePerfOverlay(wxCommandEvent& event);
+    void OnToggleThreadedRendering(wxCommandEvent& event);
     void OnConfigureInput(wxCommandEvent& event);
+    void OnSelectPacingMode(wxCommandEvent& event);
+    void OnSelectAudioLatency(wxCommandEvent& event);
+    void OnSelectAudioQuality(wxCommandEvent& event);
+    void OnMeasureResampler(wxCommandEvent& event);
+    void OnSaveState(wxCommandEvent& event);
+    void OnLoadState(wxCommandEvent& event);
+    void OnVerifySaveState(wxCommandEvent& event);
     
     void PollInput();
     InputMap inputMap;
@@ -51,19 +76,42 @@ private:
     void UpdateDebugWindows();
     
     void ResetEmulatorState();
+
+    //emuMutex held. hands over whatever the last frames wrote and waits for it to reach the disk
+    void CloseSaveFile();
+
+    //emuMutex held. whole frames the same way the emulation thread runs them, false if the cpu threw
+    bool RunFrames(int count, std::string& error);
     
     void EmulationThreadFunc();
 
     void InitAudio();
     void ShutdownAudio();
-    void PumpAudio();
     void FlushAudio();
 
+    //sdl's audio thread asks for more whenever the device runs low, it drains the apu's ring without the bus lock
+    static void SDLCALL AudioStreamCallback(void* userdata, SDL_AudioStream* stream, int additionalAmount, int totalAmount);
+    void PumpAudio(SDL_AudioStream* stream, int requestedBytes);
+    double GetQueuedAudioSeconds() const;
+    void SetResamplerQuality(Resampler::Quality quality);
+
     SDL_AudioStream* audioStream = nullptr;
+    //whatever the device runs at natively, the resampler goes straight there so sdl has nothing left to convert
+    int audioDeviceRate = 48000;
 
-    //one emulated frame is about 549 stereo frames at the apus output rate
+    //one emulated frame is about 549 stereo frames at the apus output rate. the callback owns both of these
+    //and the resampler, anyone else has to hold the stream lock
     static constexpr size_t AUDIO_SCRATCH_FRAMES = 4096;
     std::vector<int16_t> audioScratch;
+    std::vector<int16_t> resamplerInput;
+    Resampler resampler;
+
+    //faster than real time the ring fills speed times quicker than it plays, the stretch squeezes that back
+    //down to real time without shifting the pitch. the emulation thread sets the speed, the callback owns the rest
+    std::atomic<double> audioSpeed{1.0};
+    bool stretchActive = false;
+    std::vector<int16_t> stretchInput;
+    TimeStretch timeStretch;
 
     void OnFrameComplete();
     
@@ -75,12 +123,17 @@ private:
 
     std::atomic<bool> framePending{false};
 
+    //one json object per line, each covering just the window since the previous line
     std::ofstream perfLog;
+    std::chrono::steady_clock::time_point perfLogStart;
     std::chrono::steady_clock::time_point perfWindowStart;
-    uint64_t perfFrameCount = 0;
-    uint64_t perfOverBudgetCount = 0;
-    double perfBusyTimeSum = 0.0;
-    double perfMaxStepSeconds = 0.0;
+    LatencyHistogram stepTimes;
+    LatencyHistogram audioQueueDepth;
+    LatencyHistogram::Snapshot lastStepSnapshot;
+    LatencyHistogram::Snapshot lastPresentSnapshot;
+    LatencyHistogram::Snapshot lastAudioSnapshot;
+    uint64_t lastAudioUnderruns = 0;
+    uint64_t lastAudioOverrunFrames = 0;
 
     SDLPanel* sdlPanel;
 
@@ -112,6 +165,36 @@ private:
     static constexpr double TARGET_FPS = 59.73;
     static constexpr double FRAME_TIME = 1.0 / TARGET_FPS;
 
+    //hold to fast forward, only one frame in FAST_FORWARD_SKIP + 1 gets composed while it's down
+    static constexpr int FAST_FORWARD_KEY = WXK_TAB;
+    static constexpr double FAST_FORWARD_SPEED = 4.0;
+    static constexpr unsigned FAST_FORWARD_SKIP = 3;
+    std::atomic<bool> fastForward{false};
+
+    FrameLimiter frameLimiter{FRAME_TIME};
+
+    //how much audio should sit between the apu and the device, rate control steers towards it and
+    //audio pacing waits on it. the default is about three frames
+    static constexpr long DEFAULT_AUDIO_LATENCY_MS = 50;
+    AudioRateControl audioRateControl;
+
+    //the cartridge's .sav next to the rom. opened, updated and closed under emuMutex
+    SaveFile saveFile;
+
+    //Emulation > Save/Load State, one slot next to the rom. only the capture and restore happen under
+    //emuMutex, the file is read or written outside it
+    SaveState saveState;
+    wxString saveStatePath;
+
+    //Debug > Capture Audio. started and stopped under emuMutex, fed by the apu on the emulation thread
+    AudioCapture audioCapture;
+
+    //how many frames Debug > Record Performance Trace captures, about five seconds
+    static constexpr uint32_t PERF_TRACE_FRAMES = 300;
+
+    //how long Debug > Verify Save State replays from the state, twice, about a second
+    static constexpr int SAVE_STATE_CHECK_FRAMES = 60;
+
     wxDECLARE_EVENT_TABLE();
 };
 
@@ -121,29 +204,79 @@ public:
     ~SDLPanel();
 
     void InitSDL();
-    void Render();
+    void StopPresenting();
 
-    void SetSource(MemoryBus* memoryBus, std::mutex* memoryMutex);
+    //set before presenting starts
+    void SetSource(MemoryBus* memoryBus);
 
     void SetShowFps(bool show);
+    void SetShowPerfOverlay(bool show);
     void SetFpsSource(const std::atomic<double>* fps);
 
+    //called by the emulation thread after it hands off a frame, never blocks
+    void NotifyFrameReady();
+
+    //present to present interval in microseconds, recorded by whichever thread presents
+    const LatencyHistogram& GetPresentIntervals() const { return presentIntervals; }
+    bool IsVsyncEnabled() const { return vsyncEnabled.load(std::memory_order_relaxed); }
+
 private:
+    //the renderer and everything drawn with it live on the present thread, so a busy ui thread or an open
+    //menu never holds a frame back. the ui thread only owns the window and hands resizes over through
+    //pendingSize. where the platform won't render off the main thread the loop posts presents to the ui
+    //thread instead, with vsync off so they never block it
+    void PresentLoop();
+    void RequestPresent();
+    void Present();
+    void ApplyPendingSize();
+    bool CreateRenderer();
+    void DestroyRenderer();
+    void Render();
     void RenderFpsCounter(int panelWidth);
+    void RenderPerfOverlay(int panelWidth, float top);
+    void DrawOverlayText(SDL_Texture* texture, int width, int height, float x, float y);
 
     SDL_Window* sdlWindow;
     SDL_Renderer* sdlRenderer;
     SDL_Texture* gbaTexture;
 
+    std::thread presentThread;
+    std::atomic<bool> presentStopRequested{false};
+    std::mutex presentMutex;
+    std::condition_variable frameReadyCondition;
+    std::atomic<bool> frameReady{false};
+    //width in the high half, height in the low, zero when nothing's waiting. wxEVT_SIZE sets it, the present
+    //applies it right before drawing
+    std::atomic<uint64_t> pendingSize{0};
+    //ui thread path only, at most one present waits in the queue so a busy ui thread skips frames
+    std::atomic<bool> presentPending{false};
+    std::atomic<bool> vsyncEnabled{false};
+    //one display refresh, without vsync presents never go faster than that
+    std::chrono::nanoseconds refreshInterval{16666667};
+    std::chrono::steady_clock::time_point lastPresent;
+
+    LatencyHistogram presentIntervals;
+
+    //what the texture currently holds, only lines changed since then get uploaded
+    std::array<uint16_t, 240 * 160> framePixels{};
+    uint64_t lastSeenLine = 0;
+
+    //frames come through the bus's lock free handoff, rendering never waits on the emulation thread
     MemoryBus* memoryBus;
-    std::mutex* memoryMutex;
 
-    bool showFps = true;
+    std::atomic<bool> showFps{true};
     TTF_Font* fpsFont = nullptr;
     SDL_Texture* fpsTexture = nullptr;
     int fpsTextureWidth = 0;
     int fpsTextureHeight = 0;
     int lastDisplayedFps = -1;
+
+    //per subsystem host time of the last emulated frame, rebuilt a few times a second so it stays readable
+    std::atomic<bool> showPerfOverlay{false};
+    SDL_Texture* perfTexture = nullptr;
+    int perfTextureWidth = 0;
+    int perfTextureHeight = 0;
+    std::chrono::steady_clock::time_point perfTextureTime;
     const std::atomic<double>* fpsSource = nullptr;
 };
 
@@ -0,0 +1,153 @@
+#include "FrameLimiter.h"
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#pragma comment(lib, "Winmm.lib")
+#elif defined(__linux__)
+#include <cerrno>
+#include <ctime>
+#endif
+
+namespace
+{
+    std::chrono::steady_clock::duration ToDuration(double seconds)
+    {
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    }
+}
+
+FrameLimiter::FrameLimiter(double framePeriodSeconds)
+    : framePeriod(framePeriodSeconds)
+{
+}
+
+void FrameLimiter::SetAudioClock(std::function<double()> queuedSeconds, double targetSeconds)
+{
+    std::lock_guard<std::mutex> lock(audioClockMutex);
+    hasAudioClock.store(static_cast<bool>(queuedSeconds), std::memory_order_relaxed);
+    audioQueuedSeconds = std::move(queuedSeconds);
+    SetAudioTarget(targetSeconds);
+}
+
+void FrameLimiter::Start()
+{
+#ifdef _WIN32
+    //windows FUCKING SUCKS, without this a sleep is 15ms whatever you ask for
+    timeBeginPeriod(1);
+#endif
+    deadline = Clock::now();
+    TakeStats();
+}
+
+void FrameLimiter::Stop()
+{
+#ifdef _WIN32
+    timeEndPeriod(1);
+#endif
+}
+
+int FrameLimiter::FramesBehind() const
+{
+    Mode current = GetMode();
+    if (current == Mode::Unthrottled || PacedByAudio(current))
+        return 0;
+
+    double behind = std::chrono::duration<double>(Clock::now() - deadline).count();
+    return behind > 0.0 ? static_cast<int>(behind / (framePeriod / speed)) : 0;
+}
+
+void FrameLimiter::WaitForNextFrame()
+{
+    Mode current = GetMode();
+    Clock::time_point now = Clock::now();
+
+    if (current == Mode::Unthrottled)
+    {
+        deadline = now;
+        return;
+    }
+
+    bool pacedByAudio = false;
+    if (PacedByAudio(current))
+    {
+        //only uncontended unless the clock is being replaced right now
+        std::lock_guard<std::mutex> lock(audioClockMutex);
+        if (audioQueuedSeconds)
+        {
+            double excess = audioQueuedSeconds() - audioTargetSeconds.load(std::memory_order_relaxed);
+            deadline = now + ToDuration(std::max(excess, 0.0));
+            pacedByAudio = true;
+        }
+    }
+
+    if (!pacedByAudio)
+    {
+        deadline += ToDuration(framePeriod / speed);
+        if (now - deadline > ToDuration(MAX_CATCH_UP_SECONDS))
+            deadline = now;
+    }
+
+    if (deadline > now)
+        SleepUntil(deadline);
+
+    RecordError(std::chrono::duration<double>(Clock::now() - deadline).count());
+}
+
+bool FrameLimiter::PacedByAudio(Mode current) const
+{
+    //audio can only set the pace at normal speed, fast forward would just overflow the device queue
+    return current == Mode::SyncToAudio && hasAudioClock.load(std::memory_order_relaxed) && speed == 1.0;
+}
+
+void FrameLimiter::SleepUntil(Clock::time_point target)
+{
+    Clock::time_point spinFrom = target - ToDuration(SPIN_SECONDS);
+
+    if (Clock::now() < spinFrom)
+    {
+#if defined(__linux__)
+        //steady_clock is CLOCK_MONOTONIC here, so an absolute sleep cant drift by however long we got preempted
+        auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(spinFrom.time_since_epoch()).count();
+        timespec wakeAt;
+        wakeAt.tv_sec = static_cast<time_t>(nanoseconds / 1000000000);
+        wakeAt.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeAt, nullptr) == EINTR) {}
+#else
+        std::this_thread::sleep_until(spinFrom);
+#endif
+    }
+
+    while (Clock::now() < target)
+        std::this_thread::yield();
+}
+
+void FrameLimiter::RecordError(double seconds)
+{
+    seconds = std::max(seconds, 0.0);
+
+    statFrames++;
+    statErrorSum += seconds;
+    statErrorMax = std::max(statErrorMax, seconds);
+    if (seconds > LATE_SECONDS)
+        statLateFrames++;
+}
+
+FrameLimiter::Stats FrameLimiter::TakeStats()
+{
+    Stats stats;
+    stats.frames = statFrames;
+    stats.lateFrames = statLateFrames;
+    stats.averageErrorUs = statFrames ? statErrorSum / static_cast<double>(statFrames) * 1e6 : 0.0;
+    stats.maxErrorUs = statErrorMax * 1e6;
+
+    statFrames = 0;
+    statLateFrames = 0;
+    statErrorSum = 0.0;
+    statErrorMax = 0.0;
+    return stats;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+//paces the emulation thread by sleeping to absolute deadlines and spinning the last little bit,
+//so the cadence doesnt depend on how coarse the os timer is
+class FrameLimiter
+{
+public:
+    enum class Mode : uint8_t
+    {
+        Exact,
+        SyncToAudio,
+        Unthrottled
+    };
+
+    struct Stats
+    {
+        uint64_t frames = 0;
+        uint64_t lateFrames = 0;
+        double averageErrorUs = 0.0;
+        double maxErrorUs = 0.0;
+    };
+
+    explicit FrameLimiter(double framePeriodSeconds);
+
+    //safe from any thread, picked up at the next frame
+    void SetMode(Mode mode) { this->mode.store(mode, std::memory_order_relaxed); }
+    Mode GetMode() const { return mode.load(std::memory_order_relaxed); }
+
+    //returns how many seconds of audio are queued for the device, audio sync keeps that near targetSeconds.
+    //without a clock (or while fast forwarding) SyncToAudio behaves like Exact. safe from any thread, once it
+    //returns the old clock is never called again, so whatever it reads from can go away
+    void SetAudioClock(std::function<double()> queuedSeconds, double targetSeconds);
+
+    //safe from any thread
+    void SetAudioTarget(double targetSeconds) { audioTargetSeconds.store(targetSeconds, std::memory_order_relaxed); }
+
+    //fast forward, 1.0 is normal speed
+    void SetSpeed(double speed) { this->speed = speed; }
+
+    //everything below is for the emulation thread only
+    void Start();
+    void Stop();
+
+    //whole frame periods the schedule is behind right now, those frames get run back to back
+    int FramesBehind() const;
+
+    void WaitForNextFrame();
+
+    //stats since the last call
+    Stats TakeStats();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    //falling further behind than this drops the missed time instead of racing to catch it up
+    static constexpr double MAX_CATCH_UP_SECONDS = 0.1;
+    //the os sleep is only trusted up to this close to the deadline, the rest is spun
+    static constexpr double SPIN_SECONDS = 0.002;
+    //waking up later than this past the deadline counts as a late frame
+    static constexpr double LATE_SECONDS = 0.0005;
+
+    bool PacedByAudio(Mode current) const;
+    void SleepUntil(Clock::time_point target);
+    void RecordError(double seconds);
+
+    const double framePeriod;
+    std::atomic<Mode> mode{Mode::Exact};
+    double speed = 1.0;
+
+    //the emulation thread calls the clock every frame, the lock keeps it from being swapped out mid call
+    std::mutex audioClockMutex;
+    std::function<double()> audioQueuedSeconds;
+    std::atomic<bool> hasAudioClock{false};
+    std::atomic<double> audioTargetSeconds{0.0};
+
+    Clock::time_point deadline;
+
+    uint64_t statFrames = 0;
+    uint64_t statLateFrames = 0;
+    double statErrorSum = 0.0;
+    double statErrorMax = 0.0;
+};
@@ -0,0 +1,143 @@
+#include "LatencyHistogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram()
+{
+    for (auto& count : counts)
+        count.store(0, std::memory_order_relaxed);
+}
+
+size_t LatencyHistogram::BucketFor(uint32_t value)
+{
+    if (value < LINEAR_LIMIT)
+        return value;
+
+    uint32_t exponent = 7;
+    while (exponent < 31 && (value >> (exponent + 1)))
+        exponent++;
+
+    //top 7 bits of the value, the leading one is always set so only the low 6 pick the sub bucket
+    uint32_t shift = exponent - 6;
+    uint32_t sub = (value >> shift) - SUB_BUCKETS;
+    return LINEAR_LIMIT + (exponent - 7) * SUB_BUCKETS + sub;
+}
+
+uint32_t LatencyHistogram::BucketLowerBound(size_t bucket)
+{
+    if (bucket < LINEAR_LIMIT)
+        return static_cast<uint32_t>(bucket);
+
+    uint32_t exponent = static_cast<uint32_t>((bucket - LINEAR_LIMIT) / SUB_BUCKETS) + 7;
+    uint32_t sub = static_cast<uint32_t>((bucket - LINEAR_LIMIT) % SUB_BUCKETS) + SUB_BUCKETS;
+    return sub << (exponent - 6);
+}
+
+double LatencyHistogram::BucketMidpoint(size_t bucket)
+{
+    if (bucket < LINEAR_LIMIT)
+        return static_cast<double>(bucket);
+
+    uint32_t exponent = static_cast<uint32_t>((bucket - LINEAR_LIMIT) / SUB_BUCKETS) + 7;
+    double width = static_cast<double>(1u << (exponent - 6));
+    return BucketLowerBound(bucket) + width / 2.0;
+}
+
+void LatencyHistogram::Record(uint32_t microseconds)
+{
+    counts[BucketFor(microseconds)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::RecordSeconds(double seconds)
+{
+    double microseconds = seconds * 1e6;
+    if (microseconds < 0.0)
+        microseconds = 0.0;
+    Record(microseconds >= 4294967295.0 ? 0xFFFFFFFFu : static_cast<uint32_t>(microseconds + 0.5));
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::TakeSnapshot() const
+{
+    Snapshot snapshot;
+    snapshot.counts.resize(BUCKET_COUNT);
+    for (size_t i = 0; i < BUCKET_COUNT; i++)
+    {
+        snapshot.counts[i] = counts[i].load(std::memory_order_relaxed);
+        snapshot.total += snapshot.counts[i];
+    }
+    return snapshot;
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::Snapshot::Since(const Snapshot& earlier) const
+{
+    Snapshot window;
+    window.counts.resize(counts.size());
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        uint64_t before = i < earlier.counts.size() ? earlier.counts[i] : 0;
+        window.counts[i] = counts[i] - before;
+        window.total += window.counts[i];
+    }
+    return window;
+}
+
+uint64_t LatencyHistogram::Snapshot::CountAbove(uint32_t microseconds) const
+{
+    uint64_t above = 0;
+    for (size_t i = BucketFor(microseconds) + 1; i < counts.size(); i++)
+        above += counts[i];
+    return above;
+}
+
+double LatencyHistogram::Snapshot::Percentile(double fraction) const
+{
+    if (total == 0)
+        return 0.0;
+
+    uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(total)));
+    rank = std::min(std::max<uint64_t>(rank, 1), total);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return BucketMidpoint(i);
+    }
+    return 0.0;
+}
+
+LatencyHistogram::Summary LatencyHistogram::Snapshot::Summarize() const
+{
+    Summary summary;
+    summary.count = total;
+    if (total == 0)
+        return summary;
+
+    summary.p50 = Percentile(0.50);
+    summary.p90 = Percentile(0.90);
+    summary.p99 = Percentile(0.99);
+    summary.p999 = Percentile(0.999);
+
+    double sum = 0.0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        if (!counts[i])
+            continue;
+        sum += BucketMidpoint(i) * static_cast<double>(counts[i]);
+        summary.max = BucketMidpoint(i);
+    }
+    summary.mean = sum / static_cast<double>(total);
+
+    double squares = 0.0;
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        if (!counts[i])
+            continue;
+        double difference = BucketMidpoint(i) - summary.mean;
+        squares += difference * difference * static_cast<double>(counts[i]);
+    }
+    summary.jitter = std::sqrt(squares / static_cast<double>(total));
+    return summary;
+}
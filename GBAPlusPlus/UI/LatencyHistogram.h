@@ -0,0 +1,61 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+//log-linear histogram in the spirit of HdrHistogram: exact below 128us, above that every power of two is
+//split into 64 buckets so any value lands within ~1.6% of where it really was. Record is a single relaxed
+//increment so any thread can record while another reads
+class LatencyHistogram
+{
+public:
+    struct Summary
+    {
+        uint64_t count = 0;
+        double p50 = 0.0;
+        double p90 = 0.0;
+        double p99 = 0.0;
+        double p999 = 0.0;
+        double mean = 0.0;
+        //standard deviation
+        double jitter = 0.0;
+        double max = 0.0;
+    };
+
+    //plain counts at one point in time, subtract two to get just the window between them
+    class Snapshot
+    {
+    public:
+        Snapshot Since(const Snapshot& earlier) const;
+
+        uint64_t Count() const { return total; }
+        uint64_t CountAbove(uint32_t microseconds) const;
+        double Percentile(double fraction) const;
+        Summary Summarize() const;
+
+    private:
+        friend class LatencyHistogram;
+        std::vector<uint64_t> counts;
+        uint64_t total = 0;
+    };
+
+    LatencyHistogram();
+
+    void Record(uint32_t microseconds);
+    void RecordSeconds(double seconds);
+
+    Snapshot TakeSnapshot() const;
+
+private:
+    static constexpr uint32_t LINEAR_LIMIT = 128;
+    static constexpr uint32_t SUB_BUCKETS = 64;
+    //exponents 7 through 31 each get SUB_BUCKETS
+    static constexpr size_t BUCKET_COUNT = LINEAR_LIMIT + (32 - 7) * SUB_BUCKETS;
+
+    static size_t BucketFor(uint32_t value);
+    static double BucketMidpoint(size_t bucket);
+    static uint32_t BucketLowerBound(size_t bucket);
+
+    std::array<std::atomic<uint64_t>, BUCKET_COUNT> counts;
+};